@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <boost/bind.hpp>
+#include "common/crc32c.h"
+#include "common/thread_pool.h"
+#include "common/timer.h"
+#include "storage/binlog.h"
+
+using namespace galaxy::ins;
+
+static const char* bench_dir = "/tmp/nexus_bench";
+
+// Compare the append cost with the checksum cost of the same records
+static void ChecksumOverhead() {
+    const int count = 20000;
+    BinLogger bin_logger(std::string(bench_dir) + "/checksum");
+    LogEntry log_entry;
+    log_entry.key = "/benchmark/key";
+    log_entry.value = std::string(256, 'v');
+    log_entry.term = 1;
+    log_entry.op = kPut;
+    int64_t start = ins_common::timer::get_micros();
+    for (int i = 0; i < count; i++) {
+        int64_t slot_index = bin_logger.AppendEntryAsync(log_entry);
+        if (i % 100 == 99) {
+            bin_logger.Sync(slot_index);
+        }
+    }
+    bin_logger.Sync(count - 1);
+    int64_t append_us = ins_common::timer::get_micros() - start + 1;
+    std::string payload;
+    BinLogger::DumpLogEntry(log_entry, &payload);
+    uint32_t sum = 0;
+    start = ins_common::timer::get_micros();
+    for (int i = 0; i < count; i++) {
+        sum += ins_common::crc32c::Value(payload.data(), payload.size());
+    }
+    int64_t crc_us = ins_common::timer::get_micros() - start + 1;
+    printf("append %d records: %ld us, checksums: %ld us (%.2f%%) (%u)\n",
+           count, append_us, crc_us, crc_us * 100.0 / append_us, sum);
+}
+
+static void AppendWriter(BinLogger* bin_logger, int count) {
+    LogEntry log_entry;
+    log_entry.key = "/benchmark/key";
+    log_entry.term = 1;
+    log_entry.op = kPut;
+    for (int i = 0; i < count; i++) {
+        bin_logger->Sync(bin_logger->AppendEntryAsync(log_entry));
+    }
+}
+
+// Concurrent appends under each durability mode. Group mode shares one
+// fdatasync among the writers waiting on it, sync mode pays one per record
+static void DurabilityModes() {
+    const char* names[] = {"none", "periodic", "group", "sync"};
+    const int writers = 8;
+    const int count = 100;
+    for (int mode = kDurabilityNone; mode <= kDurabilitySync; mode++) {
+        BinLogOptions options;
+        options.segment_size = 4096;
+        options.durability = static_cast<DurabilityMode>(mode);
+        int64_t start = ins_common::timer::get_micros();
+        {
+            BinLogger bin_logger(std::string(bench_dir) + "/durability_"
+                                 + names[mode], options);
+            ThreadPool pool(writers);
+            for (int i = 0; i < writers; i++) {
+                pool.AddTask(boost::bind(&AppendWriter, &bin_logger, count));
+            }
+            pool.Stop(true);
+            bin_logger.Fsync();
+        }
+        int64_t used_us = ins_common::timer::get_micros() - start + 1;
+        printf("durability %s: %d appends in %ld us, %.0f appends/s\n",
+               names[mode], writers * count, used_us,
+               writers * count * 1000000.0 / used_us);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (system((std::string("rm -rf ") + bench_dir).c_str()) != 0) {
+        return 1;
+    }
+    ChecksumOverhead();
+    DurabilityModes();
+    return 0;
+}
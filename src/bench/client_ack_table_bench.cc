@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <vector>
+#include <boost/bind.hpp>
+#include "server/client_ack_table.h"
+#include "common/thread_pool.h"
+#include "common/timer.h"
+
+using namespace galaxy::ins;
+
+// Like the rpc threads and the apply loop: every writer adds its own
+// indexes and takes them back
+static void AckWorker(ClientAckTable* table, int64_t worker, int64_t workers,
+                      int64_t count) {
+    ClientAck ack;
+    for (int64_t i = 0; i < count; i++) {
+        int64_t index = i * workers + worker;
+        ack.term = index;
+        table->Add(index, ack);
+        table->Take(index, &ack);
+    }
+}
+
+static int64_t RunAckWorkers(int32_t shards, int64_t workers, int64_t count) {
+    ClientAckTable table(shards);
+    int64_t start = ins_common::timer::get_micros();
+    {
+        ThreadPool pool(workers);
+        for (int64_t i = 0; i < workers; i++) {
+            pool.AddTask(boost::bind(&AckWorker, &table, i, workers, count));
+        }
+        pool.Stop(true);
+    }
+    return ins_common::timer::get_micros() - start + 1;
+}
+
+int main(int argc, char* argv[]) {
+    int64_t workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers < 16) {
+        workers = 16;
+    }
+    const int64_t count = 50000;
+    // a single shard is the old table guarded by one lock
+    int32_t shards[] = {1, 16, 64};
+    for (size_t i = 0; i < sizeof(shards) / sizeof(shards[0]); i++) {
+        int64_t used_us = RunAckWorkers(shards[i], workers, count);
+        printf("%d shards, %ld threads: %ld acks in %ld us, %.0f acks/s\n",
+               shards[i], workers, workers * count, used_us,
+               workers * count * 1000000.0 / used_us);
+    }
+    return 0;
+}
@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "common/crc32c.h"
+#include "common/timer.h"
+
+using namespace ins_common;
+
+// Checksum cost per binlog record. A record is written once by pwrite and
+// copied a few times on its way there, so the checksum has to run at
+// memcpy speed to be negligible on the append path.
+int main(int argc, char* argv[]) {
+    const size_t total = 64 << 20;
+    std::string data(total, 'x');
+    for (size_t i = 0; i < total; i += 7) {
+        data[i] = static_cast<char>(i);
+    }
+    std::string copy(total, '\0');
+    const size_t record_sizes[] = {64, 256, 4096, 65536};
+    printf("crc32c hardware accelerated: %s\n",
+           crc32c::IsHardwareAccelerated() ? "yes" : "no");
+    for (size_t k = 0; k < sizeof(record_sizes) / sizeof(record_sizes[0]); k++) {
+        size_t record_size = record_sizes[k];
+        uint32_t sum = 0;
+        int64_t start = timer::get_micros();
+        for (size_t off = 0; off + record_size <= total; off += record_size) {
+            memcpy(&copy[off], data.data() + off, record_size);
+        }
+        int64_t memcpy_us = timer::get_micros() - start + 1;
+        start = timer::get_micros();
+        for (size_t off = 0; off + record_size <= total; off += record_size) {
+            sum += crc32c::Value(data.data() + off, record_size);
+        }
+        int64_t hw_us = timer::get_micros() - start + 1;
+        start = timer::get_micros();
+        for (size_t off = 0; off + record_size <= total; off += record_size) {
+            sum += crc32c::ExtendPortable(0, data.data() + off, record_size);
+        }
+        int64_t table_us = timer::get_micros() - start + 1;
+        printf("record %6lu bytes: memcpy %8.1f MB/s, crc32c %8.1f MB/s, "
+               "table %8.1f MB/s (%u)\n", record_size,
+               total * 1.0 / memcpy_us, total * 1.0 / hw_us,
+               total * 1.0 / table_us, sum);
+    }
+    return 0;
+}
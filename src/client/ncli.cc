@@ -30,6 +30,7 @@ void command_help_message() {
     std::cout << "command:" << std::endl
         << "  show                          show cluster" << std::endl
         << "  stat                          show statistics" << std::endl
+        << "  metric                        show internal counters of each node" << std::endl
         << "  put [key] [value]             update data" << std::endl
         << "  get [key]                     read data by key" << std::endl
         << "  delete [key]                  remove data by key" << std::endl
@@ -45,6 +46,10 @@ void command_help_message() {
         << "  login [user] [password]       start operating as a user" << std::endl
         << "  logout                        stop operating with user" << std::endl
         << "  whoami                        show current session and uuid" << std::endl
+        << "  transfer [server id]          make the server the new leader" << std::endl
+        << "  addlearner [server id]        add a server getting the log only" << std::endl
+        << "  addmember [server id]         add a voting server, or promote a learner" << std::endl
+        << "  rmmember [server id]          remove a server from the cluster" << std::endl
         << "  exit                          exit program" << std::endl
         << "  quit                          same as exit" << std::endl;
 }
@@ -96,6 +101,33 @@ int show_status(InsSDK& sdk) {
     return ERROR_OK;
 }
 
+int show_metrics(InsSDK& sdk) {
+    TPrinter mprinter(4);
+    mprinter.AddRow(4, "server id", "status", "metric", "value");
+    std::vector<NodeMetricInfo> metric_info;
+    bool ret = sdk.ShowMetrics(&metric_info);
+    if (!ret) {
+        std::cerr << "show metrics fail due to cluster issue" << std::endl;
+        return ERROR_CLUSTER_DOWN;
+    }
+    for (std::vector<NodeMetricInfo>::iterator it = metric_info.begin();
+            it != metric_info.end(); ++it) {
+        std::string s_status = InsSDK::StatusToString(it->status);
+        for (size_t i = 0; i < it->metrics.size(); ++i) {
+            mprinter.AddRow(4, i == 0 ? it->server_id.c_str() : "",
+                    i == 0 ? s_status.c_str() : "",
+                    it->metrics[i].first.c_str(),
+                    boost::lexical_cast<std::string>(it->metrics[i].second).c_str());
+        }
+    }
+    if (mprinter.Rows() <= 1) {
+        std::cerr << "show metrics fail due to cluster issue" << std::endl;
+        return ERROR_CLUSTER_DOWN;
+    }
+    std::cout << mprinter.ToString();
+    return ERROR_OK;
+}
+
 int show_statistics(InsSDK& sdk) {
     TPrinter sprinter(11);
     sprinter.AddRow(11, "server id", "status", "kind", "Put", "Get",
@@ -139,6 +171,35 @@ int show_statistics(InsSDK& sdk) {
     return ERROR_OK;
 }
 
+int transfer_leader(InsSDK& sdk, const std::string& server_id) {
+    SDKError error;
+    if (!sdk.TransferLeadership(server_id, &error)) {
+        std::cerr << "transfer failed: " << InsSDK::ErrorToString(error) << std::endl;
+        return ERROR_CLUSTER_DOWN;
+    }
+    std::cout << "leader: " << server_id << std::endl;
+    return ERROR_OK;
+}
+
+int change_membership(InsSDK& sdk, const std::string& operation,
+                      const std::string& server_id) {
+    SDKError error;
+    bool ok = false;
+    if (operation == "addmember") {
+        ok = sdk.AddMember(server_id, &error);
+    } else if (operation == "addlearner") {
+        ok = sdk.AddLearner(server_id, &error);
+    } else {
+        ok = sdk.RemoveMember(server_id, &error);
+    }
+    if (!ok) {
+        std::cerr << operation << " failed: " << InsSDK::ErrorToString(error) << std::endl;
+        return ERROR_CLUSTER_DOWN;
+    }
+    std::cout << operation << " " << server_id << " done" << std::endl;
+    return ERROR_OK;
+}
+
 int put_kv(InsSDK& sdk, const std::string& key, const std::string& value) {
     SDKError error;
     if (sdk.Put(key, value, &error)) {
@@ -570,6 +631,8 @@ int main(int argc, char* argv[]) {
             }
         } else if (operation == "stat") {
             retval = show_statistics(sdk);
+        } else if (operation == "metric") {
+            retval = show_metrics(sdk);
         } else if (operation == "login") {
             if (!FLAGS_i) {
                 std::cerr << "login function is available in interactive mode" << std::endl;
@@ -594,6 +657,15 @@ int main(int argc, char* argv[]) {
             retval = register_user(sdk, username, password);
         } else if (operation == "whoami") {
             retval = whoami(sdk);
+        } else if (operation == "transfer") {
+            std::string server_id;
+            fill_string(server_id, ss, std::cin, "  server id > ");
+            retval = transfer_leader(sdk, server_id);
+        } else if (operation == "addmember" || operation == "addlearner" ||
+                   operation == "rmmember") {
+            std::string server_id;
+            fill_string(server_id, ss, std::cin, "  server id > ");
+            retval = change_membership(sdk, operation, server_id);
         } else if (operation == "help") {
             if (FLAGS_i) {
                 command_help_message();
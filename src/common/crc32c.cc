@@ -0,0 +1,109 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "crc32c.h"
+
+#include <string.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+namespace ins_common {
+namespace crc32c {
+
+// reversed Castagnoli polynomial
+static const uint32_t kPoly = 0x82f63b78u;
+
+struct Crc32cTable {
+    uint32_t table[256];
+    Crc32cTable() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int j = 0; j < 8; j++) {
+                crc = (crc >> 1) ^ ((crc & 1) ? kPoly : 0);
+            }
+            table[i] = crc;
+        }
+    }
+};
+
+uint32_t ExtendPortable(uint32_t init_crc, const char* data, size_t n) {
+    static const Crc32cTable crc_table;
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    uint32_t crc = init_crc ^ 0xffffffffu;
+    for (size_t i = 0; i < n; i++) {
+        crc = crc_table.table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc ^ 0xffffffffu;
+}
+
+#if defined(__x86_64__)
+
+// the crc32 instruction is emitted directly, so the file builds
+// without -msse4.2 and old compilers are fine
+static uint32_t ExtendSSE42(uint32_t init_crc, const char* data, size_t n) {
+    const char* p = data;
+    uint32_t crc = init_crc ^ 0xffffffffu;
+    while (n > 0 && (reinterpret_cast<uintptr_t>(p) & 7) != 0) {
+        uint8_t v = *p;
+        __asm__("crc32b %1, %0" : "+r"(crc) : "rm"(v));
+        p++;
+        n--;
+    }
+    uint64_t crc64 = crc;
+    while (n >= 8) {
+        uint64_t v = 0;
+        memcpy(&v, p, sizeof(v));
+        __asm__("crc32q %1, %0" : "+r"(crc64) : "rm"(v));
+        p += 8;
+        n -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+    while (n > 0) {
+        uint8_t v = *p;
+        __asm__("crc32b %1, %0" : "+r"(crc) : "rm"(v));
+        p++;
+        n--;
+    }
+    return crc ^ 0xffffffffu;
+}
+
+static bool CpuHasSSE42() {
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0) {
+        return false;
+    }
+    return (ecx & (1 << 20)) != 0;
+}
+
+#else
+
+static bool CpuHasSSE42() {
+    return false;
+}
+
+#endif
+
+typedef uint32_t (*ExtendFunc)(uint32_t, const char*, size_t);
+
+static ExtendFunc ChooseExtend() {
+#if defined(__x86_64__)
+    if (CpuHasSSE42()) {
+        return ExtendSSE42;
+    }
+#endif
+    return ExtendPortable;
+}
+
+uint32_t Extend(uint32_t init_crc, const char* data, size_t n) {
+    static const ExtendFunc extend = ChooseExtend();
+    return extend(init_crc, data, n);
+}
+
+bool IsHardwareAccelerated() {
+    return CpuHasSSE42();
+}
+
+} // namespace crc32c
+} // namespace ins_common
@@ -0,0 +1,46 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef  COMMON_CRC32C_H_
+#define  COMMON_CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace ins_common {
+namespace crc32c {
+
+// Return the crc32c of concat(A, data[0,n-1]) where init_crc is the
+// crc32c of some string A. Uses the SSE4.2 crc32 instruction when the
+// cpu has it, and a lookup table otherwise.
+uint32_t Extend(uint32_t init_crc, const char* data, size_t n);
+
+// Table driven version of Extend, always available
+uint32_t ExtendPortable(uint32_t init_crc, const char* data, size_t n);
+
+// Whether Extend runs on the SSE4.2 instruction
+bool IsHardwareAccelerated();
+
+// Return the crc32c of data[0,n-1]
+inline uint32_t Value(const char* data, size_t n) {
+    return Extend(0, data, n);
+}
+
+static const uint32_t kMaskDelta = 0xa282ead8ul;
+
+// CRCs stored in files are masked, so that computing the CRC of data
+// which contains embedded CRCs does not degrade (same as leveldb)
+inline uint32_t Mask(uint32_t crc) {
+    return ((crc >> 15) | (crc << 17)) + kMaskDelta;
+}
+
+inline uint32_t Unmask(uint32_t masked_crc) {
+    uint32_t rot = masked_crc - kMaskDelta;
+    return ((rot >> 17) | (rot << 15));
+}
+
+} // namespace crc32c
+} // namespace ins_common
+
+#endif  // COMMON_CRC32C_H_
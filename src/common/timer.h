@@ -9,6 +9,7 @@
 
 #include <stdio.h>
 #include <sys/time.h>
+#include <time.h>
 
 namespace ins_common {
 namespace timer {
@@ -9,6 +9,7 @@
 #include <boost/scoped_ptr.hpp>
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
+#include <boost/functional/hash.hpp>
 #include <boost/uuid/uuid.hpp>
 #include <boost/uuid/uuid_generators.hpp>
 #include <boost/uuid/uuid_io.hpp>
@@ -80,6 +81,7 @@ void InsSDK::Init(const std::vector<std::string>& members) {
     watch_task_id_ = 0;
     last_succ_alive_timestamp_ = ins_common::timer::get_micros();
     timeout_time_ = FLAGS_ins_sdk_session_timeout;
+    read_preference_ = kReadLeaderOnly;
     pthread_once(&s_ponce, InitLog);
     if (members.size() < 1) {
         LOG(FATAL, "invalid cluster size");
@@ -131,6 +133,47 @@ void InsSDK::PrepareServerList(std::vector<std::string>& server_list) {
               std::back_inserter(server_list) );
 }
 
+// The read server goes first, picked by the session id to spread the
+// clients over the cluster
+void InsSDK::PrepareReadServerList(std::vector<std::string>& server_list) {
+    {
+        MutexLock lock(mu_);
+        if (read_preference_ != kReadLeaderOnly) {
+            if (read_server_.empty()) {
+                size_t offset = boost::hash<std::string>()(session_id_);
+                read_server_ = members_[offset % members_.size()];
+            }
+            server_list.push_back(read_server_);
+        }
+    }
+    PrepareServerList(server_list);
+}
+
+void InsSDK::SkipReadServer(const std::string& server_id) {
+    MutexLock lock(mu_);
+    if (server_id != read_server_) {
+        return;
+    }
+    std::vector<std::string>::iterator it = std::find(members_.begin(),
+                                                      members_.end(),
+                                                      server_id);
+    if (it == members_.end() || ++it == members_.end()) {
+        it = members_.begin();
+    }
+    read_server_ = *it;
+}
+
+static galaxy::ins::ReadMode ToReadMode(ReadPreference preference) {
+    switch (preference) {
+    case kReadAnyNode:
+        return galaxy::ins::kReadLinearizable;
+    case kReadAnyNodeStale:
+        return galaxy::ins::kReadBoundedStale;
+    default:
+        return galaxy::ins::kReadOnLeader;
+    }
+}
+
 bool InsSDK::ShowCluster(std::vector<ClusterNodeInfo>* cluster_info) {
     if (cluster_info == NULL) {
         return true;
@@ -179,6 +222,9 @@ std::string InsSDK::StatusToString(int32_t status) {
         case kOffline:
             return "Offline";
             break;
+        case kLearner:
+            return "Learner";
+            break;
     }
     return "UnKnown";
 }
@@ -288,7 +334,7 @@ bool InsSDK::Put(const std::string& key, const std::string& value, SDKError* err
 bool InsSDK::Get(const std::string& key, std::string* value,
                  SDKError* error) {
     std::vector<std::string> server_list;
-    PrepareServerList(server_list);
+    PrepareReadServerList(server_list);
     SDKError err_temp = kOK;
     if (error == NULL) {
         error = &err_temp;
@@ -304,19 +350,23 @@ bool InsSDK::Get(const std::string& key, std::string* value,
         {
             MutexLock lock(mu_);
             request.set_uuid(logged_uuid_);
+            request.set_read_mode(ToReadMode(read_preference_));
         }
         request.set_key(key);
         bool ok = rpc_client_->SendRequest(stub, &InsNode_Stub::Get,
                                           &request, &response, 2, 1);
         if (!ok) {
             LOG(FATAL, "faild to rpc %s", server_id.c_str());
+            SkipReadServer(server_id);
             continue;
         }
 
         if (response.success() || response.uuid_expired()) {
             {
                 MutexLock lock(mu_);
-                leader_id_ = server_id;
+                if (read_preference_ == kReadLeaderOnly) {
+                    leader_id_ = server_id;
+                }
             }
             *value = response.value();
             if (response.uuid_expired()) {
@@ -386,7 +436,7 @@ bool InsSDK::ScanOnce(const std::string& start_key,
         return false;
     }
     std::vector<std::string> server_list;
-    PrepareServerList(server_list);
+    PrepareReadServerList(server_list);
     std::vector<std::string>::const_iterator it ;
     for (it = server_list.begin(); it != server_list.end(); it++){
         std::string server_id = *it;
@@ -398,6 +448,7 @@ bool InsSDK::ScanOnce(const std::string& start_key,
         {
             MutexLock lock(mu_);
             request.set_uuid(logged_uuid_);
+            request.set_read_mode(ToReadMode(read_preference_));
         }
         request.set_start_key(start_key);
         request.set_end_key(end_key);
@@ -406,13 +457,16 @@ bool InsSDK::ScanOnce(const std::string& start_key,
                                            &request, &response, 5, 1);
         if (!ok) {
             LOG(FATAL, "faild to rpc %s", server_id.c_str());
+            SkipReadServer(server_id);
             continue;
         }
 
         if (response.success() || response.uuid_expired()) {
             {
                 MutexLock lock(mu_);
-                leader_id_ = server_id;
+                if (read_preference_ == kReadLeaderOnly) {
+                    leader_id_ = server_id;
+                }
             }
             if (response.uuid_expired()) {
                 LOG(WARNING, "uuid is expired before scan :[%s, %s)",
@@ -1290,6 +1344,117 @@ bool InsSDK::CleanBinlog(const std::string& server_id,
     return true;
 }
 
+bool InsSDK::TransferLeadership(const std::string& server_id,
+                                SDKError* error) {
+    std::vector<std::string> server_list;
+    PrepareServerList(server_list);
+    SDKError err_temp = kOK;
+    if (error == NULL) {
+        error = &err_temp;
+    }
+    galaxy::ins::TransferLeadershipRequest request;
+    request.set_target_id(server_id);
+    std::vector<std::string>::const_iterator it;
+    for (it = server_list.begin(); it != server_list.end(); it++) {
+        std::string leader_id = *it;
+        galaxy::ins::InsNode_Stub *stub;
+        rpc_client_->GetStub(leader_id, &stub);
+        galaxy::ins::TransferLeadershipResponse response;
+        // the leader answers once the handover is done or given up
+        bool ok = rpc_client_->SendRequest(stub, &InsNode_Stub::TransferLeadership,
+                                           &request, &response, 5, 1);
+        if (!ok) {
+            LOG(WARNING, "faild to rpc %s", leader_id.c_str());
+            continue;
+        }
+        if (!response.success() && !response.leader_id().empty() &&
+            response.leader_id() != leader_id) {
+            leader_id = response.leader_id();
+            LOG(DEBUG, "redirect to leader :%s", leader_id.c_str());
+            rpc_client_->GetStub(leader_id, &stub);
+            response.Clear();
+            ok = rpc_client_->SendRequest(stub, &InsNode_Stub::TransferLeadership,
+                                          &request, &response, 5, 1);
+            if (!ok) {
+                continue;
+            }
+        }
+        if (response.success()) {
+            MutexLock lock(mu_);
+            leader_id_ = response.leader_id();
+            *error = kOK;
+            return true;
+        }
+        if (response.leader_id() == leader_id) {
+            *error = kTimeout;
+            return false;
+        }
+    }
+    *error = kClusterDown;
+    return false;
+}
+
+bool InsSDK::AddMember(const std::string& server_id, SDKError* error) {
+    return ChangeMembership(galaxy::ins::kAddMember, server_id, error);
+}
+
+bool InsSDK::AddLearner(const std::string& server_id, SDKError* error) {
+    return ChangeMembership(galaxy::ins::kAddLearner, server_id, error);
+}
+
+bool InsSDK::RemoveMember(const std::string& server_id, SDKError* error) {
+    return ChangeMembership(galaxy::ins::kRemoveMember, server_id, error);
+}
+
+bool InsSDK::ChangeMembership(int action, const std::string& server_id,
+                              SDKError* error) {
+    std::vector<std::string> server_list;
+    PrepareServerList(server_list);
+    SDKError err_temp = kOK;
+    if (error == NULL) {
+        error = &err_temp;
+    }
+    galaxy::ins::ChangeMembershipRequest request;
+    request.set_action(static_cast<galaxy::ins::MembershipAction>(action));
+    request.set_server_id(server_id);
+    std::vector<std::string>::const_iterator it;
+    for (it = server_list.begin(); it != server_list.end(); it++) {
+        std::string leader_id = *it;
+        galaxy::ins::InsNode_Stub *stub;
+        rpc_client_->GetStub(leader_id, &stub);
+        galaxy::ins::ChangeMembershipResponse response;
+        // the leader answers once the new membership is committed
+        bool ok = rpc_client_->SendRequest(stub, &InsNode_Stub::ChangeMembership,
+                                           &request, &response, 5, 1);
+        if (!ok) {
+            LOG(WARNING, "faild to rpc %s", leader_id.c_str());
+            continue;
+        }
+        if (!response.success() && !response.leader_id().empty() &&
+            response.leader_id() != leader_id) {
+            leader_id = response.leader_id();
+            LOG(DEBUG, "redirect to leader :%s", leader_id.c_str());
+            rpc_client_->GetStub(leader_id, &stub);
+            response.Clear();
+            ok = rpc_client_->SendRequest(stub, &InsNode_Stub::ChangeMembership,
+                                          &request, &response, 5, 1);
+            if (!ok) {
+                continue;
+            }
+        }
+        if (response.success()) {
+            *error = kOK;
+            return true;
+        }
+        if (response.leader_id() == leader_id) {
+            *error = kTimeout;
+            return false;
+        }
+    }
+    *error = kClusterDown;
+    return false;
+}
+
 bool InsSDK::ShowStatistics(std::vector<NodeStatInfo>* statistics) {
     if (statistics == NULL) {
         return true;
@@ -1324,6 +1489,35 @@ bool InsSDK::ShowStatistics(std::vector<NodeStatInfo>* statistics) {
     return true;
 }
 
+bool InsSDK::ShowMetrics(std::vector<NodeMetricInfo>* metrics) {
+    if (metrics == NULL) {
+        return true;
+    }
+    std::vector<std::string>::iterator it;
+    for(it = members_.begin(); it != members_.end(); it++) {
+        NodeMetricInfo node_metric;
+        node_metric.server_id = *it;
+        galaxy::ins::InsNode_Stub* stub;
+        rpc_client_->GetStub(*it, &stub);
+        galaxy::ins::RpcStatRequest request;
+        galaxy::ins::RpcStatResponse response;
+        bool ok = rpc_client_->SendRequest(stub, &InsNode_Stub::RpcStat,
+                                           &request, &response, 2, 1);
+        if (!ok) {
+            node_metric.status = kOffline;
+        } else {
+            node_metric.status = response.status();
+            for (int i = 0; i < response.metrics_size(); ++i) {
+                node_metric.metrics.push_back(
+                        std::make_pair(response.metrics(i).name(),
+                                       response.metrics(i).value()));
+            }
+        }
+        metrics->push_back(node_metric);
+    }
+    return true;
+}
+
 std::string InsSDK::GetSessionID() {
     MutexLock lock(mu_);
     return session_id_;
@@ -1353,6 +1547,12 @@ void InsSDK::SetTimeoutTime(int64_t milliseconds) {
     LOG(INFO, "timeout time: %ld", timeout_time_);
 }
 
+void InsSDK::SetReadPreference(ReadPreference preference) {
+    MutexLock lock(mu_);
+    read_preference_ = preference;
+    LOG(INFO, "read preference: %d", preference);
+}
+
 ScanResult::ScanResult(InsSDK* sdk) : offset_(0),
                                       sdk_(sdk),
                                       error_(kOK) {
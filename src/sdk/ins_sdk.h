@@ -61,11 +61,27 @@ struct NodeStatInfo {
     StatInfo stats[8];
 };
 
+struct NodeMetricInfo {
+    std::string server_id;
+    int32_t status;
+    std::vector<std::pair<std::string, int64_t> > metrics;
+};
+
 struct KVPair {
     std::string key;
     std::string value;
 };
 
+// which nodes may answer Get and Scan
+enum ReadPreference {
+    // only the leader
+    kReadLeaderOnly = 0,
+    // any node, as up to date as reading on the leader
+    kReadAnyNode = 1,
+    // any node, which may lag slightly behind the leader
+    kReadAnyNodeStale = 2
+};
+
 class ScanResult;
 
 struct WatchParam {
@@ -113,12 +129,26 @@ public:
     virtual bool CleanBinlog(const std::string& server_id,
                              int64_t end_index,
                              SDKError* error);
+    // ask the leader to hand over to server_id, error is kTimeout if the
+    // leader took the request but server_id did not take over
+    virtual bool TransferLeadership(const std::string& server_id,
+                                    SDKError* error);
+    // change the membership through the leader, error is kTimeout if the
+    // leader refused the change or could not finish it in time.
+    // A node is added as a learner first, so it catches up before it votes.
+    virtual bool AddMember(const std::string& server_id, SDKError* error);
+    virtual bool AddLearner(const std::string& server_id, SDKError* error);
+    virtual bool RemoveMember(const std::string& server_id, SDKError* error);
     virtual bool ShowStatistics(std::vector<NodeStatInfo>* statistics);
+    virtual bool ShowMetrics(std::vector<NodeMetricInfo>* metrics);
     virtual std::string GetSessionID();
     virtual std::string GetCurrentUserID();
     virtual bool IsLoggedIn();
     virtual void RegisterSessionTimeout(void (*handle_session_timeout)(void*), void* ctx );
     virtual void SetTimeoutTime(int64_t milliseconds);
+    // reads of one sdk stay on the same node while it is up, so they
+    // never go back in time
+    virtual void SetReadPreference(ReadPreference preference);
 
     static std::string StatusToString(int32_t status);
     static std::string ErrorToString(SDKError error);
@@ -126,6 +156,8 @@ public:
 private:
     void Init(const std::vector<std::string>& members);
     void PrepareServerList(std::vector<std::string>& server_list);
+    void PrepareReadServerList(std::vector<std::string>& server_list);
+    void SkipReadServer(const std::string& server_id);
     void KeepAliveTask();
     void KeepWatchTask(const std::string& key, 
                        const std::string& old_value,
@@ -143,6 +175,8 @@ private:
                          bool key_exist,
                          std::string session_id,
                          int64_t watch_id);
+    bool ChangeMembership(int action, const std::string& server_id,
+                          SDKError* error);
     static std::string HashPassword(const std::string& password);
     std::string leader_id_;
     std::string session_id_;
@@ -165,6 +199,8 @@ private:
     std::set<int64_t> pending_watches_;
     bool loggin_expired_;
     int64_t timeout_time_;
+    ReadPreference read_preference_;
+    std::string read_server_;
 };
 
 class ScanResult {
@@ -7,7 +7,8 @@ import threading
 SDKError = ('OK', 'ClusterDown', 'NoSuchKey', 'Timeout', 'LockFail',
             'CleanBinlogFail', 'UserExists', 'PermissionDenied', 'PasswordError',
             'UnknownUser')
-NodeStatus = ('Leader', 'Candidate', 'Follower', 'Offline')
+NodeStatus = ('Leader', 'Candidate', 'Follower', 'Offline', 'Learner')
+ReadPreference = ('LeaderOnly', 'AnyNode', 'AnyNodeStale')
 ClusterInfo = ('server_id', 'status', 'term', 'last_log_index', 'last_log_term',
                'commit_index', 'last_applied')
 
@@ -190,6 +191,9 @@ class InsSDK:
     def is_logged_in(self):
         return _ins.SDKIsLoggedIn(self._sdk)
 
+    def set_read_preference(self, preference):
+        _ins.SDKSetReadPreference(self._sdk, ReadPreference.index(preference))
+
     def register_session_timeout(self, callback, context):
         ctx = py_object(context)
         self._contexts[addressof(context)] = context
@@ -296,6 +300,7 @@ def _set_function_sign():
     _ins.SDKGetCurrentUserID.restype = c_char_p
     _ins.SDKIsLoggedIn.argtypes = [c_void_p]
     _ins.SDKIsLoggedIn.restype = c_bool
+    _ins.SDKSetReadPreference.argtypes = [c_void_p, c_int]
     _ins.SDKRegisterSessionTimeout.argtypes = [c_void_p, InsSDK.SessionTimeoutCallback, \
                                                c_long, c_void_p]
     _ins.ScanResultDone.argtypes = [c_void_p]
@@ -226,6 +226,13 @@ bool SDKIsLoggedIn(InsSDK* sdk) {
     return sdk->IsLoggedIn();
 }
 
+void SDKSetReadPreference(InsSDK* sdk, ReadPreference preference) {
+    if (sdk == NULL) {
+        return;
+    }
+    sdk->SetReadPreference(preference);
+}
+
 // NOTE: This interface is customized for python sdk.
 //       For other purpose, please implement another interface
 void SDKRegisterSessionTimeout(InsSDK* sdk, SessionTimeoutCallback handle_session_timeout,
@@ -0,0 +1,84 @@
+#include "client_ack_table.h"
+
+#include <algorithm>
+
+namespace galaxy {
+namespace ins {
+
+ClientAckTable::ClientAckTable(int32_t shard_count) : shards_(NULL),
+                                                      shard_count_(shard_count) {
+    if (shard_count_ < 1) {
+        shard_count_ = 1;
+    }
+    shards_ = new Shard[shard_count_];
+}
+
+ClientAckTable::~ClientAckTable() {
+    delete[] shards_;
+}
+
+ClientAckTable::Shard* ClientAckTable::GetShard(int64_t index) {
+    return &shards_[index % shard_count_];
+}
+
+void ClientAckTable::Add(int64_t index, const ClientAck& ack) {
+    Shard* shard = GetShard(index);
+    MutexLock lock(&shard->mu);
+    if (shard->acks.insert(std::make_pair(index, ack)).second) {
+        size_.Inc();
+    }
+}
+
+bool ClientAckTable::Take(int64_t index, ClientAck* ack) {
+    Shard* shard = GetShard(index);
+    MutexLock lock(&shard->mu);
+    boost::unordered_map<int64_t, ClientAck>::iterator it = shard->acks.find(index);
+    if (it == shard->acks.end()) {
+        return false;
+    }
+    *ack = it->second;
+    shard->acks.erase(it);
+    size_.Dec();
+    return true;
+}
+
+static bool IndexLess(const std::pair<int64_t, ClientAck>& a,
+                      const std::pair<int64_t, ClientAck>& b) {
+    return a.first < b.first;
+}
+
+void ClientAckTable::TakeRange(int64_t from_index, int64_t to_index,
+                               std::vector<std::pair<int64_t, ClientAck> >* acks) {
+    acks->clear();
+    for (int32_t i = 0; i < shard_count_; i++) {
+        // the first index of the range falling into shard i
+        int64_t start = from_index +
+            ((i - from_index % shard_count_) + shard_count_) % shard_count_;
+        if (start > to_index) {
+            continue;
+        }
+        Shard* shard = &shards_[i];
+        MutexLock lock(&shard->mu);
+        if (shard->acks.empty()) {
+            continue;
+        }
+        for (int64_t index = start; index <= to_index; index += shard_count_) {
+            boost::unordered_map<int64_t, ClientAck>::iterator it;
+            it = shard->acks.find(index);
+            if (it == shard->acks.end()) {
+                continue;
+            }
+            acks->push_back(*it);
+            shard->acks.erase(it);
+            size_.Dec();
+        }
+    }
+    std::sort(acks->begin(), acks->end(), IndexLess);
+}
+
+int64_t ClientAckTable::Size() {
+    return size_.Get();
+}
+
+} //namespace ins
+} //namespace galaxy
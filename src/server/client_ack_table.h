@@ -0,0 +1,68 @@
+#ifndef GALAXY_INS_CLIENT_ACK_TABLE_H_
+#define GALAXY_INS_CLIENT_ACK_TABLE_H_
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+#include <boost/unordered_map.hpp>
+#include "common/counter.h"
+#include "common/mutex.h"
+#include "proto/ins_node.pb.h"
+
+namespace galaxy {
+namespace ins {
+
+struct ClientAck {
+    galaxy::ins::PutResponse* response;
+    galaxy::ins::DelResponse* del_response;
+    galaxy::ins::LockResponse* lock_response;
+    galaxy::ins::UnLockResponse* unlock_response;
+    galaxy::ins::LoginResponse* login_response;
+    galaxy::ins::LogoutResponse* logout_response;
+    galaxy::ins::RegisterResponse* register_response;
+    google::protobuf::Closure* done;
+    // term of the entry written for the request, a different entry applied
+    // at the same index means the request is lost
+    int64_t term;
+    ClientAck() : response(NULL),
+                  del_response(NULL),
+                  lock_response(NULL),
+                  unlock_response(NULL),
+                  login_response(NULL),
+                  logout_response(NULL),
+                  register_response(NULL),
+                  done(NULL),
+                  term(-1) {
+    }
+};
+
+// Client writes waiting for their log entry to be applied, by log index.
+// The rpc threads add and the apply loop takes acks without the node lock,
+// the table is sharded by index so they rarely meet on the same mutex.
+class ClientAckTable {
+public:
+    explicit ClientAckTable(int32_t shard_count = 16);
+    ~ClientAckTable();
+    void Add(int64_t index, const ClientAck& ack);
+    // remove the ack of index, false if there is none
+    bool Take(int64_t index, ClientAck* ack);
+    // remove the acks of [from_index, to_index] in index order, each shard
+    // is locked once for the whole range
+    void TakeRange(int64_t from_index, int64_t to_index,
+                   std::vector<std::pair<int64_t, ClientAck> >* acks);
+    int64_t Size();
+private:
+    struct Shard {
+        Mutex mu;
+        boost::unordered_map<int64_t, ClientAck> acks;
+    };
+    Shard* GetShard(int64_t index);
+    Shard* shards_;
+    int32_t shard_count_;
+    Counter size_;
+};
+
+} //namespace ins
+} //namespace galaxy
+
+#endif
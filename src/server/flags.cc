@@ -1,26 +1,46 @@
 #include <gflags/gflags.h>
 
 DEFINE_string(cluster_members, "", "cluster members , e.g. abc.com:1234,def.com:3456");
-DEFINE_int32(server_id, 1, "the offset in cluster members of this node");
+DEFINE_string(cluster_learners, "", "learners replicated from the leader but never voting, e.g. ghi.com:5678. Both lists only seed a new node, a membership changed online is kept in its data");
+DEFINE_int32(server_id, 1, "the offset in cluster members of this node, offsets past them address cluster learners");
 DEFINE_string(ins_data_dir, "data", "local directory which store pesistent information");
 DEFINE_string(ins_binlog_dir, "binlog", "write-ahead log directory path");
 DEFINE_int32(max_cluster_size, 10, "maximum size of ins cluster");
 DEFINE_int32(log_rep_batch_max, 500, "maximum batch size of log replication");
+DEFINE_int32(log_rep_batch_max_size, 4, "maximum bytes of log entries in a replication rpc, MB");
+DEFINE_int32(log_rep_window, 4, "maximum number of AppendEntries batches in flight per follower");
+DEFINE_int32(log_rep_rtt_target, 100, "replication batches to a follower shrink while its replies take longer than this, ms");
 DEFINE_int32(replication_retry_timespan, 2000, "when replication fail, sleep a while before retry");
 DEFINE_int64(elect_timeout_min, 150, "mininum timeout to make a new election");
 DEFINE_int32(elect_timeout_max, 300, "maximum timeout to make a new election");
+DEFINE_int32(leader_transfer_timeout, 1000, "a leadership transfer fails if the target is not caught up within this time, ms");
+DEFINE_bool(ins_pre_vote, true, "ask the others whether they would vote before starting an election, so a node cut off for a while does not depose a healthy leader");
+DEFINE_bool(ins_lease_read, false, "answer reads on the leader during a lease renewed by heartbeats, instead of confirming each with a quorum");
+DEFINE_int32(ins_lease_clock_drift, 30, "the leader lease is elect_timeout_min minus this to bear clock drift, ms");
+DEFINE_int32(ins_apply_threads, 4, "threads writing the databases of different users in parallel when applying log entries");
+DEFINE_int32(ins_follower_read_max_lag, 1000, "followers answer bounded-stale reads only while at most this many committed entries are not applied");
 DEFINE_int64(session_expire_timeout, 6000000, "timeout for session expiration, 6 seconds in default");
 DEFINE_int32(max_write_pending, 10000, "max write pending size of Put");
 DEFINE_int32(max_commit_pending, 10000, "max commit pending size");
 DEFINE_bool(ins_data_compress, true, "enable snappy compression on leveldb storage");
-DEFINE_bool(ins_binlog_compress, true, "enable snappy compression on binlog");
+DEFINE_bool(ins_binlog_compress, true, "deprecated, binlog is stored in segment files now");
 DEFINE_int32(ins_gc_interval, 60, "binlog clean interval (seconds)");
 DEFINE_int32(ins_max_throughput_in, -1, "max input throughput, MB");
 DEFINE_int32(ins_max_throughput_out, -1, "max output throughput, MB");
 DEFINE_int32(ins_data_block_size, 4, "for data, leveldb block_size, KB");
-DEFINE_int32(ins_binlog_block_size, 4, "for binlog, leveldb block_size, KB");
+DEFINE_int32(ins_binlog_block_size, 4, "deprecated, binlog is stored in segment files now");
 DEFINE_int32(ins_data_write_buffer_size, 4, "for data, leveldb write_buffer_size, MB");
-DEFINE_int32(ins_binlog_write_buffer_size, 4, "for binlog, leveldb write_buffer_size, MB");
+DEFINE_int32(ins_binlog_write_buffer_size, 4, "deprecated, binlog is stored in segment files now");
+DEFINE_int32(ins_binlog_segment_size, 64, "size of a single binlog segment file, MB");
+DEFINE_int32(ins_binlog_cache_entries, 10000, "max entries of the in-memory binlog tail cache");
+DEFINE_int32(ins_binlog_cache_size, 64, "max memory of the in-memory binlog tail cache, MB");
+DEFINE_int32(ins_binlog_verify_threads, 4, "threads checking binlog segment checksums at startup");
+DEFINE_int32(ins_binlog_reclaim_rate, 32, "disk space of removed binlog segments given back per second in background, MB, 0 for no limit");
+DEFINE_int32(ins_snapshot_threshold, 100000, "take a snapshot once this many log entries are applied after the last one");
+DEFINE_int32(ins_snapshot_keep_entries, 10000, "binlog entries kept before the latest snapshot, so slightly lagging followers need no snapshot");
+DEFINE_int32(ins_snapshot_chunk_size, 1024, "size of a chunk when sending a snapshot to a follower, KB");
+DEFINE_string(ins_durability_mode, "group", "when binlog, meta and data writes are synced to disk: none, periodic, group or sync");
+DEFINE_int32(ins_durability_sync_interval, 1000, "interval of the background disk sync in periodic durability mode, ms");
 DEFINE_int32(performance_interval, 1000, "milliseconds of the interval of performance counter ticktock");
 DEFINE_int32(performance_buffer_size, 60, "size of the buffer to hold the history record of performance data");
 DEFINE_double(ins_trace_ratio, 0.001, "trace log printing ratio");
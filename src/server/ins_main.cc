@@ -12,6 +12,7 @@
 #include "ins_node_impl.h"
 
 DECLARE_string(cluster_members);
+DECLARE_string(cluster_learners);
 DECLARE_int32(ins_port);
 DECLARE_int32(server_id);
 DECLARE_int32(ins_max_throughput_in);
@@ -42,14 +43,23 @@ int main(int argc, char* argv[]) {
         LOG(FATAL, "cluster is empty , please check your configuration");
         return -1;
     }
+    std::vector<std::string> learners;
+    if (!FLAGS_cluster_learners.empty()) {
+        boost::split(learners, FLAGS_cluster_learners,
+                     boost::is_any_of(","), boost::token_compress_on);
+    }
+    // offsets past the members address the learners
+    std::vector<std::string> nodes(members);
+    nodes.insert(nodes.end(), learners.begin(), learners.end());
     if (FLAGS_server_id < 1 || 
-        FLAGS_server_id > static_cast<int32_t>(members.size())) {
+        FLAGS_server_id > static_cast<int32_t>(nodes.size())) {
         LOG(FATAL, "bad server_id: %d", FLAGS_server_id);
         return -1;
     }
-    std::string server_id = members.at(FLAGS_server_id - 1); //offset -> real endpoint
+    std::string server_id = nodes.at(FLAGS_server_id - 1); //offset -> real endpoint
     galaxy::ins::InsNodeImpl * ins_node = new galaxy::ins::InsNodeImpl(server_id, 
-                                                                       members);
+                                                                       members,
+                                                                       learners);
     sofa::pbrpc::RpcServerOptions options;
     options.max_throughput_in = FLAGS_ins_max_throughput_in;
     options.max_throughput_out = FLAGS_ins_max_throughput_out;
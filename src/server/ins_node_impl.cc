@@ -1,7 +1,13 @@
 #include "ins_node_impl.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
+#include <boost/algorithm/string/join.hpp>
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
@@ -9,91 +15,166 @@
 #include <gflags/gflags.h>
 #include <limits>
 #include <algorithm>
+#include <functional>
 #include <vector>
 #include <sofa/pbrpc/pbrpc.h>
 #include "common/this_thread.h"
 #include "common/timer.h"
 #include "storage/meta.h"
 #include "storage/binlog.h"
+#include "storage/snapshot.h"
+#include "storage/utils.h"
 
 DECLARE_string(ins_data_dir);
 DECLARE_string(ins_binlog_dir);
 DECLARE_int32(max_cluster_size);
 DECLARE_int32(log_rep_batch_max);
+DECLARE_int32(log_rep_batch_max_size);
+DECLARE_int32(log_rep_window);
+DECLARE_int32(log_rep_rtt_target);
 DECLARE_int32(replication_retry_timespan);
 DECLARE_int64(elect_timeout_min);
 DECLARE_int32(elect_timeout_max);
+DECLARE_int32(leader_transfer_timeout);
+DECLARE_bool(ins_pre_vote);
+DECLARE_bool(ins_lease_read);
+DECLARE_int32(ins_lease_clock_drift);
+DECLARE_int32(ins_follower_read_max_lag);
 DECLARE_int64(session_expire_timeout);
 DECLARE_int32(ins_gc_interval);
 DECLARE_int32(max_write_pending);
 DECLARE_int32(max_commit_pending);
-DECLARE_bool(ins_binlog_compress);
-DECLARE_int32(ins_binlog_block_size);
-DECLARE_int32(ins_binlog_write_buffer_size);
+DECLARE_int32(ins_binlog_segment_size);
+DECLARE_int32(ins_binlog_cache_entries);
+DECLARE_int32(ins_binlog_cache_size);
+DECLARE_int32(ins_binlog_verify_threads);
+DECLARE_int32(ins_binlog_reclaim_rate);
+DECLARE_int32(ins_snapshot_threshold);
+DECLARE_int32(ins_snapshot_keep_entries);
+DECLARE_int32(ins_snapshot_chunk_size);
+DECLARE_string(ins_durability_mode);
+DECLARE_int32(ins_durability_sync_interval);
 DECLARE_int32(performance_buffer_size);
 DECLARE_double(ins_trace_ratio);
 
 const std::string tag_last_applied_index = "#TAG_LAST_APPLIED_INDEX#";
+// the serialized Membership of the applied state
+const std::string tag_membership = "#TAG_MEMBERSHIP#";
+const std::string snapshot_file_name = "snapshot.data";
+// a snapshot being written by this node
+const std::string snapshot_tmp_file_name = "snapshot.tmp";
+// a snapshot being received from the leader
+const std::string install_tmp_file_name = "install.tmp";
 
 namespace galaxy {
 namespace ins {
 
 const static size_t sMaxPBSize = (26<<20);
+// the apply loop publishes last_applied_index_ every this many entries
+const static int64_t sApplyPublishInterval = 64;
+// milliseconds between two heartbeats to an otherwise idle follower
+const static int64_t sHeartBeatInterval = 50;
+// floor of the adaptive replication batch size
+const static int64_t sRepMinBatchBytes = 64 * 1024;
 
 InsNodeImpl::InsNodeImpl(std::string& server_id,
-                         const std::vector<std::string>& members
+                         const std::vector<std::string>& members,
+                         const std::vector<std::string>& learners
                          ) : stop_(false),
                              self_id_(server_id),
                              current_term_(0),
                              status_(kFollower),
                              heartbeat_count_(0),
+                             pre_vote_term_(-1),
                              meta_(NULL),
                              binlogger_(NULL),
                              user_manager_(NULL),
                              replicatter_(FLAGS_max_cluster_size),
+                             heartbeat_sent_count_(0),
+                             heartbeat_avoided_count_(0),
                              heartbeat_read_timestamp_(0),
+                             lease_expire_timestamp_(0),
+                             leader_contact_timestamp_(0),
+                             lease_read_count_(0),
+                             read_confirming_(false),
+                             quorum_read_count_(0),
+                             follower_read_count_(0),
+                             transfer_worker_(1),
+                             membership_changing_(false),
+                             membership_worker_(1),
                              in_safe_mode_(true),
                              server_start_timestamp_(0),
                              commit_index_(-1),
                              last_applied_index_(-1),
-                             single_node_mode_(false),
-                             last_safe_clean_index_(-1),
+                             snapshot_index_(-1),
+                             snapshot_term_(-1),
+                             snapshot_sent_count_(0),
+                             snapshot_installed_count_(0),
+                             snapshot_installer_(1),
+                             apply_pausers_(0),
+                             applying_(false),
+                             appending_entries_(false),
+                             snapshot_installing_(false),
+                             local_readers_(0),
+                             durability_(kDurabilityNone),
+                             last_data_sync_time_(0),
+                             disk_syncer_(1),
                              perform_(FLAGS_performance_buffer_size) {
     srand(time(NULL));
     replication_cond_ = new CondVar(&mu_);
     commit_cond_ = new CondVar(&mu_);
+    apply_cond_ = new CondVar(&mu_);
+    append_cond_ = new CondVar(&mu_);
+    local_read_cond_ = new CondVar(&mu_);
+    // the configured membership, until one is found in the data or the log
+    Membership membership;
     std::vector<std::string>::const_iterator it = members.begin();
-    bool self_in_cluster = false;
     for(; it != members.end(); it++) {
-        members_.push_back(*it);
+        membership.add_members(*it);
         if (self_id_ == *it) {
             LOG(INFO, "cluster member[Self]: %s", it->c_str());
-            self_in_cluster = true;
         } else {
             LOG(INFO, "cluster member: %s", it->c_str());
         }
     }
-    if (!self_in_cluster) {
-        LOG(FATAL, "this node is not in cluster membership,"
-                   " please check your configuration. self: %s", self_id_.c_str());
-        exit(-1);
+    for (it = learners.begin(); it != learners.end(); it++) {
+        if (std::find(members.begin(), members.end(), *it) != members.end()) {
+            LOG(FATAL, "%s is both a member and a learner", it->c_str());
+            exit(-1);
+        }
+        membership.add_learners(*it);
+        if (self_id_ == *it) {
+            LOG(INFO, "cluster learner[Self]: %s", it->c_str());
+        } else {
+            LOG(INFO, "cluster learner: %s", it->c_str());
+        }
     }
-    if (members_.size() > static_cast<size_t>(FLAGS_max_cluster_size)) {
+    if (members.size() + learners.size() >
+        static_cast<size_t>(FLAGS_max_cluster_size)) {
         LOG(FATAL, "cluster size is larger than configuration: %d > %d",
-            members_.size(), FLAGS_max_cluster_size);
+            members.size() + learners.size(), FLAGS_max_cluster_size);
         exit(-1);
     }
-    if (members_.size() == 1) {
-        single_node_mode_ = true;
+    memberships_[-1] = membership;
+    if (!ParseDurabilityMode(FLAGS_ins_durability_mode, &durability_)) {
+        LOG(FATAL, "unknown durability mode: %s, "
+                   "it should be none, periodic, group or sync",
+                   FLAGS_ins_durability_mode.c_str());
+        exit(-1);
     }
     std::string sub_dir = self_id_;
     boost::replace_all(sub_dir, ":", "_");
 
     meta_ = new Meta(FLAGS_ins_data_dir + "/" + sub_dir);
-    binlogger_ = new BinLogger(FLAGS_ins_binlog_dir + "/" + sub_dir, 
-                               FLAGS_ins_binlog_compress,
-                               FLAGS_ins_binlog_block_size * 1024,
-                               FLAGS_ins_binlog_write_buffer_size * 1024 * 1024);
+    BinLogOptions binlog_options;
+    binlog_options.segment_size = FLAGS_ins_binlog_segment_size * 1024L * 1024L;
+    binlog_options.cache_entries = FLAGS_ins_binlog_cache_entries;
+    binlog_options.cache_size = FLAGS_ins_binlog_cache_size * 1024L * 1024L;
+    binlog_options.recover_threads = FLAGS_ins_binlog_verify_threads;
+    binlog_options.durability = durability_;
+    binlog_options.reclaim_rate = FLAGS_ins_binlog_reclaim_rate * 1024L * 1024L;
+    binlogger_ = new BinLogger(FLAGS_ins_binlog_dir + "/" + sub_dir,
+                               binlog_options);
     current_term_ = meta_->ReadCurrentTerm();
     meta_->ReadVotedFor(voted_for_);
 
@@ -109,6 +190,55 @@ InsNodeImpl::InsNodeImpl(std::string& server_id,
     if (status == kOk) {
         last_applied_index_ =  BinLogger::StringToInt(tag_value);
     }
+    snapshot_dir_ = FLAGS_ins_data_dir + "/" + sub_dir + "/snapshot";
+    if (!ins_common::Mkdirs(snapshot_dir_.c_str())) {
+        LOG(FATAL, "failed to create dir :%s", snapshot_dir_.c_str());
+        abort();
+    }
+    std::string snapshot_file = snapshot_dir_ + "/" + snapshot_file_name;
+    if (access(snapshot_file.c_str(), F_OK) == 0) {
+        SnapshotMeta snapshot_meta;
+        SnapshotReader reader(snapshot_file);
+        if (!reader.Open(&snapshot_meta)) {
+            LOG(FATAL, "failed to read snapshot %s", snapshot_file.c_str());
+            abort();
+        }
+        snapshot_index_ = snapshot_meta.last_included_index();
+        snapshot_term_ = snapshot_meta.last_included_term();
+        LOG(INFO, "[snapshot] found snapshot at %ld, term %ld",
+            snapshot_index_, snapshot_term_);
+    }
+    if (last_applied_index_ < snapshot_index_) {
+        // the node stopped in the middle of installing a snapshot
+        LOG(INFO, "[snapshot] reload snapshot, last applied %ld < %ld",
+            last_applied_index_, snapshot_index_);
+        if (!LoadSnapshot(snapshot_file)) {
+            LOG(FATAL, "failed to load snapshot %s", snapshot_file.c_str());
+            abort();
+        }
+        last_applied_index_ = snapshot_index_;
+    }
+    if (snapshot_index_ >= 0) {
+        int64_t last_log_index = -1;
+        int64_t last_log_term = -1;
+        binlogger_->GetLastLogIndexAndTerm(&last_log_index, &last_log_term);
+        if (last_log_index < snapshot_index_ ||
+            (last_log_index == snapshot_index_ &&
+             binlogger_->GetFirstIndex() > snapshot_index_)) {
+            binlogger_->Reset(snapshot_index_ + 1, snapshot_term_);
+        }
+    }
+    {
+        MutexLock lock(&mu_);
+        LoadMemberships();
+        if (!IsVoter(self_id_) &&
+            std::find(learners_.begin(), learners_.end(), self_id_) == learners_.end()) {
+            LOG(FATAL, "this node is not in cluster membership,"
+                       " please check your configuration. self: %s",
+                self_id_.c_str());
+            exit(-1);
+        }
+    }
     server_start_timestamp_ = ins_common::timer::get_micros();
     committer_.AddTask(boost::bind(&InsNodeImpl::CommitIndexObserv, this));
     MutexLock lock(&mu_);
@@ -119,6 +249,10 @@ InsNodeImpl::InsNodeImpl(std::string& server_id,
     binlog_cleaner_.AddTask(
         boost::bind(&InsNodeImpl::GarbageClean, this)
     );
+    if (durability_ == kDurabilityPeriodic) {
+        disk_syncer_.DelayTask(FLAGS_ins_durability_sync_interval,
+            boost::bind(&InsNodeImpl::SyncToDisk, this));
+    }
 }
 
 InsNodeImpl::~InsNodeImpl() {
@@ -132,15 +266,23 @@ InsNodeImpl::~InsNodeImpl() {
     committer_.Stop(true);
     leader_crash_checker_.Stop(true);
     heart_beat_pool_.Stop(true);
+    transfer_worker_.Stop(true);
+    membership_worker_.Stop(true);
     session_checker_.Stop(true);
     event_trigger_.Stop(true);
     binlog_cleaner_.Stop(true);
+    snapshot_installer_.Stop(true);
+    disk_syncer_.Stop(true);
     {
         MutexLock lock(&mu_);
         delete meta_;
         delete binlogger_;
         delete user_manager_;
         delete data_store_;
+        std::map<std::string, FollowerContact*>::iterator it;
+        for (it = contacts_.begin(); it != contacts_.end(); ++it) {
+            delete it->second;
+        }
     }
 }
 
@@ -177,7 +319,7 @@ void InsNodeImpl::ShowStatus(::google::protobuf::RpcController* /*controller*/,
         last_log_index, last_log_term);
     {
         MutexLock lock(&mu_);
-        response->set_status(status_);
+        response->set_status(ReportedStatus());
         response->set_term(current_term_);    
         response->set_last_log_index(last_log_index);
         response->set_last_log_term(last_log_term);
@@ -196,9 +338,192 @@ void InsNodeImpl::TransToFollower(const char* msg, int64_t new_term) {
         new_term);
     status_ = kFollower;
     current_term_ = new_term;
+    lease_expire_timestamp_ = 0;
     meta_->WriteCurrentTerm(current_term_);
 }
 
+NodeStatus InsNodeImpl::ReportedStatus() {
+    mu_.AssertHeld();
+    if (status_ == kFollower &&
+        std::find(learners_.begin(), learners_.end(), self_id_) != learners_.end()) {
+        return kLearner;
+    }
+    return status_;
+}
+
+void InsNodeImpl::GetVoters(std::vector<std::string>* voters) {
+    mu_.AssertHeld();
+    voters->insert(voters->end(), members_.begin(), members_.end());
+    std::vector<std::string>::const_iterator it;
+    for (it = old_members_.begin(); it != old_members_.end(); ++it) {
+        if (std::find(members_.begin(), members_.end(), *it) == members_.end()) {
+            voters->push_back(*it);
+        }
+    }
+}
+
+bool InsNodeImpl::IsVoter(const std::string& server_id) {
+    mu_.AssertHeld();
+    return std::find(members_.begin(), members_.end(), server_id) != members_.end() ||
+           std::find(old_members_.begin(), old_members_.end(), server_id)
+               != old_members_.end();
+}
+
+static bool HasMajority(const std::vector<std::string>& group,
+                        const std::set<std::string>& voters) {
+    size_t count = 0;
+    std::vector<std::string>::const_iterator it;
+    for (it = group.begin(); it != group.end(); ++it) {
+        count += voters.count(*it);
+    }
+    return count > group.size() / 2;
+}
+
+bool InsNodeImpl::IsQuorum(const std::set<std::string>& voters) {
+    mu_.AssertHeld();
+    return HasMajority(members_, voters) &&
+           (old_members_.empty() || HasMajority(old_members_, voters));
+}
+
+static int64_t MajorityValue(const std::vector<std::string>& group,
+                             const std::map<std::string, int64_t>& values,
+                             const std::string& self_id, int64_t self_value) {
+    if (group.empty()) {
+        return -1;
+    }
+    std::vector<int64_t> sorted_values;
+    std::vector<std::string>::const_iterator it;
+    for (it = group.begin(); it != group.end(); ++it) {
+        if (*it == self_id) {
+            sorted_values.push_back(self_value);
+            continue;
+        }
+        std::map<std::string, int64_t>::const_iterator jt = values.find(*it);
+        sorted_values.push_back(jt == values.end() ? -1 : jt->second);
+    }
+    std::sort(sorted_values.begin(), sorted_values.end(),
+              std::greater<int64_t>());
+    return sorted_values[group.size() / 2];
+}
+
+int64_t InsNodeImpl::QuorumValue(const std::map<std::string, int64_t>& values,
+                                 int64_t self_value) {
+    mu_.AssertHeld();
+    int64_t value = MajorityValue(members_, values, self_id_, self_value);
+    if (!old_members_.empty()) {
+        value = std::min(value, MajorityValue(old_members_, values,
+                                              self_id_, self_value));
+    }
+    return value;
+}
+
+static void AddFollowers(const Membership& membership, const std::string& self_id,
+                         std::set<std::string>* followers) {
+    followers->insert(membership.members().begin(), membership.members().end());
+    followers->insert(membership.learners().begin(), membership.learners().end());
+    followers->insert(membership.old_members().begin(),
+                      membership.old_members().end());
+    followers->erase(self_id);
+}
+
+void InsNodeImpl::GetFollowers(std::vector<std::string>* followers) {
+    mu_.AssertHeld();
+    std::set<std::string> ids;
+    std::map<int64_t, Membership>::reverse_iterator it = memberships_.rbegin();
+    AddFollowers(it->second, self_id_, &ids);
+    if (it->first > commit_index_ && ++it != memberships_.rend()) {
+        // the removed ones learn of their removal this way
+        AddFollowers(it->second, self_id_, &ids);
+    }
+    followers->insert(followers->end(), ids.begin(), ids.end());
+}
+
+static bool InMembership(const Membership& membership,
+                         const std::string& server_id) {
+    return std::find(membership.members().begin(), membership.members().end(),
+                     server_id) != membership.members().end() ||
+           std::find(membership.learners().begin(), membership.learners().end(),
+                     server_id) != membership.learners().end() ||
+           std::find(membership.old_members().begin(),
+                     membership.old_members().end(),
+                     server_id) != membership.old_members().end();
+}
+
+bool InsNodeImpl::IsFollower(const std::string& server_id) {
+    mu_.AssertHeld();
+    if (server_id == self_id_) {
+        return false;
+    }
+    std::map<int64_t, Membership>::reverse_iterator it = memberships_.rbegin();
+    if (InMembership(it->second, server_id)) {
+        return true;
+    }
+    return it->first > commit_index_ && ++it != memberships_.rend() &&
+           InMembership(it->second, server_id);
+}
+
+void InsNodeImpl::AppendMembership(int64_t index, const std::string& value) {
+    mu_.AssertHeld();
+    Membership membership;
+    if (!membership.ParseFromString(value)) {
+        LOG(FATAL, "bad membership entry at %ld", index);
+        abort();
+    }
+    memberships_[index] = membership;
+    UseMembership();
+}
+
+void InsNodeImpl::TruncateMemberships() {
+    mu_.AssertHeld();
+    std::map<int64_t, Membership>::iterator it;
+    it = memberships_.lower_bound(std::max(0L, binlogger_->GetLength()));
+    if (it == memberships_.end()) {
+        return;
+    }
+    memberships_.erase(it, memberships_.end());
+    UseMembership();
+}
+
+void InsNodeImpl::LoadMemberships() {
+    mu_.AssertHeld();
+    memberships_.erase(memberships_.lower_bound(0), memberships_.end());
+    std::string value;
+    if (data_store_->Get(StorageManager::anonymous_user,
+                         tag_membership, &value) == kOk) {
+        if (!memberships_[-1].ParseFromString(value)) {
+            LOG(FATAL, "bad membership in the data store");
+            abort();
+        }
+    }
+    for (int64_t i = last_applied_index_ + 1; i < binlogger_->GetLength(); i++) {
+        LogEntry log_entry;
+        if (binlogger_->ReadSlot(i, &log_entry) && log_entry.op == kMembership) {
+            Membership& membership = memberships_[i];
+            if (!membership.ParseFromString(log_entry.value)) {
+                LOG(FATAL, "bad membership entry at %ld", i);
+                abort();
+            }
+        }
+    }
+    UseMembership();
+}
+
+void InsNodeImpl::UseMembership() {
+    mu_.AssertHeld();
+    const Membership& membership = memberships_.rbegin()->second;
+    members_.assign(membership.members().begin(), membership.members().end());
+    learners_.assign(membership.learners().begin(), membership.learners().end());
+    old_members_.assign(membership.old_members().begin(),
+                        membership.old_members().end());
+    LOG(INFO, "[membership] members: %s, learners: %s, old members: %s",
+        boost::algorithm::join(members_, ",").c_str(),
+        boost::algorithm::join(learners_, ",").c_str(),
+        boost::algorithm::join(old_members_, ",").c_str());
+    if (status_ == kLeader) {
+        StartReplicators();
+    }
+}
+
 inline std::string InsNodeImpl::BindKeyAndUser(const std::string& user, const std::string& key) {
     return user + "::" + key;
 }
@@ -210,7 +535,8 @@ inline std::string InsNodeImpl::GetKeyFromEvent(const std::string& event_key) {
 void InsNodeImpl::CommitIndexObserv() {
     MutexLock lock(&mu_);
     while (!stop_) {
-        while (!stop_ && commit_index_ <=  last_applied_index_) {
+        while (!stop_ && (commit_index_ <=  last_applied_index_
+                          || apply_pausers_ > 0)) {
             LOG(DEBUG, "commit_idx: %ld, last_applied_index: %ld",
                 commit_index_, last_applied_index_);
             commit_cond_->Wait();
@@ -220,12 +546,20 @@ void InsNodeImpl::CommitIndexObserv() {
         }
         int64_t from_idx = last_applied_index_;
         int64_t to_idx = commit_index_;
-        bool nop_committed = false;
+        applying_ = true;
         mu_.Unlock();
+        ApplyBatch batch;
+        batch.from_index = from_idx + 1;
         for (int64_t i = from_idx + 1; i <= to_idx; i++) {
             LogEntry log_entry;
             bool slot_ok = binlogger_->ReadSlot(i, &log_entry);
             assert(slot_ok);
+            if (log_entry.op == kUnLock && !batch.writes.Empty()) {
+                // the unlock reads the lock written by an earlier entry
+                if (FlushApplyBatch(&batch, i - 1)) {
+                    break;
+                }
+            }
             Status s;
             std::string type_and_value;
             std::string new_uuid;
@@ -238,17 +572,12 @@ void InsNodeImpl::CommitIndexObserv() {
                         log_entry.user.c_str());
                     type_and_value.append(1, static_cast<char>(log_entry.op));
                     type_and_value.append(log_entry.value);
-                    s = data_store_->Put(log_entry.user, log_entry.key, type_and_value);
-                    if (s == kUnknownUser) {
-                        if (data_store_->OpenDatabase(log_entry.user)) {
-                            s = data_store_->Put(log_entry.user, log_entry.key, type_and_value);
-                        }
-                    }
+                    batch.writes.Put(log_entry.user, log_entry.key, type_and_value);
                     if (log_entry.op == kLock) {
                         TouchParentKey(log_entry.user, log_entry.key, 
-                                       log_entry.value, "lock");
+                                       log_entry.value, "lock", &batch.writes);
                     }
-                    event_trigger_.AddTask(
+                    batch.events.push_back(
                         boost::bind(&InsNodeImpl::TriggerEventWithParent,
                                     this,
                                     BindKeyAndUser(log_entry.user, log_entry.key),
@@ -258,19 +587,12 @@ void InsNodeImpl::CommitIndexObserv() {
                         MutexLock lock_sk(&session_locks_mu_);
                         session_locks_[log_entry.value].insert(log_entry.key);
                     }
-                    assert(s == kOk);
                     break;
                 case kDel:
                     LOG(INFO, "delete from data_store_, key: %s",
                         log_entry.key.c_str());
-                    s = data_store_->Delete(log_entry.user, log_entry.key);
-                    if (s == kUnknownUser) {
-                        if (data_store_->OpenDatabase(log_entry.user)) {
-                            s = data_store_->Delete(log_entry.user, log_entry.key);
-                        }
-                    }
-                    assert(s == kOk);
-                    event_trigger_.AddTask(
+                    batch.writes.Delete(log_entry.user, log_entry.key);
+                    batch.events.push_back(
                         boost::bind(&InsNodeImpl::TriggerEventWithParent,
                                     this,
                                     BindKeyAndUser(log_entry.user, log_entry.key),
@@ -282,8 +604,9 @@ void InsNodeImpl::CommitIndexObserv() {
                               log_entry.key.c_str());
                     {
                         MutexLock locker(&mu_);
-                        if (log_entry.term == current_term_) {
-                            nop_committed = true;
+                        if (status_ == kLeader && log_entry.term == current_term_) {
+                            in_safe_mode_ = false;
+                            LOG(INFO, "Leave safe mode now");
                         }
                         LOG(INFO, "nop term: %ld, cur term: %ld", 
                             log_entry.term, current_term_);
@@ -300,17 +623,12 @@ void InsNodeImpl::CommitIndexObserv() {
                             LogOperation op;
                             ParseValue(value, op, cur_session);
                             if (op == kLock && cur_session == old_session) { //DeleteIf
-                                s = data_store_->Delete(log_entry.user, key);
-                                if (s == kUnknownUser) {
-                                    if (data_store_->OpenDatabase(log_entry.user)) {
-                                       s = data_store_->Delete(log_entry.user, key); 
-                                    }
-                                }
-                                assert(s == kOk);
+                                batch.writes.Delete(log_entry.user, key);
                                 LOG(INFO, "unlock on %s", key.c_str());
                                 TouchParentKey(log_entry.user, log_entry.key, 
-                                               cur_session, "unlock");
-                                event_trigger_.AddTask(
+                                               cur_session, "unlock",
+                                               &batch.writes);
+                                batch.events.push_back(
                                   boost::bind(&InsNodeImpl::TriggerEventWithParent,
                                               this,
                                               BindKeyAndUser(log_entry.user, key),
@@ -335,63 +653,138 @@ void InsNodeImpl::CommitIndexObserv() {
                 case kRegister:
                     log_status = user_manager_->Register(log_entry.key, log_entry.value);
                     break;
+                case kMembership:
+                    // already in use since it was appended, kept for restarts
+                    batch.writes.Put(StorageManager::anonymous_user,
+                                     tag_membership, log_entry.value);
+                    break;
                 default:
                     LOG(WARNING, "Unfamiliar op :%d", static_cast<int>(log_entry.op));
             }
-            mu_.Lock();
-            if (status_ == kLeader && nop_committed) {
-                in_safe_mode_ = false;
-                LOG(INFO, "Leave safe mode now");
-            }
-            if (status_ == kLeader && client_ack_.find(i) != client_ack_.end()) {
-                ClientAck& ack = client_ack_[i];
-                if (ack.response) {
-                    ack.response->set_success(true);
-                    ack.response->set_leader_id("");
-                    ack.done->Run(); //client put ok;
-                }
-                if (ack.del_response) {
-                    ack.del_response->set_success(true);
-                    ack.del_response->set_leader_id("");
-                    ack.done->Run(); //client del ok;   
-                }
-                if (ack.lock_response) {
-                    ack.lock_response->set_success(true);
-                    ack.lock_response->set_leader_id("");
-                    ack.done->Run(); //client lock ok;   
-                }
-                if (ack.unlock_response) {
-                    ack.unlock_response->set_success(true);
-                    ack.unlock_response->set_leader_id("");
-                    ack.done->Run(); //client unlock ok;
-                }
-                if (ack.login_response) {
-                    ack.login_response->set_status(log_status);
-                    ack.login_response->set_uuid(new_uuid);
-                    ack.login_response->set_leader_id("");
-                    ack.done->Run();
-                }
-                if (ack.logout_response) {
-                    ack.logout_response->set_status(log_status);
-                    ack.logout_response->set_leader_id("");
-                    ack.done->Run();
-                }
-                if (ack.register_response) {
-                    ack.register_response->set_status(log_status);
-                    ack.register_response->set_leader_id("");
-                    ack.done->Run();
+            ApplyResult result;
+            result.term = log_entry.term;
+            result.status = log_status;
+            result.uuid = new_uuid;
+            batch.results.push_back(result);
+            // the writes of a range go out in one batch per database, the
+            // node lock is only taken then to publish the progress and look
+            // for pausers
+            if (i == to_idx || (i - from_idx) % sApplyPublishInterval == 0) {
+                if (FlushApplyBatch(&batch, i)) {
+                    break;
                 }
-                client_ack_.erase(i);
             }
-            last_applied_index_ += 1;
-            Status sp = data_store_->Put(StorageManager::anonymous_user,
-                                         tag_last_applied_index, 
-                                         BinLogger::IntToString(last_applied_index_));
-            assert(sp == kOk);
-            mu_.Unlock();
+        }
+        if (durability_ == kDurabilityPeriodic || durability_ == kDurabilityGroup) {
+            int64_t applied_index = -1;
+            {
+                MutexLock locker(&mu_);
+                applied_index = last_applied_index_;
+            }
+            SyncAppliedIndex(applied_index);
         }
         mu_.Lock();
+        applying_ = false;
+        apply_cond_->Broadcast();
+        std::vector<ClientReadAck::Ptr> ready_reads;
+        TakeReadyReads(&ready_reads);
+        if (!ready_reads.empty()) {
+            mu_.Unlock();
+            ReplyReads(ready_reads);
+            mu_.Lock();
+        }
+    }
+}
+
+// Move the confirmed reads whose read index is applied to reads
+void InsNodeImpl::TakeReadyReads(std::vector<ClientReadAck::Ptr>* reads) {
+    mu_.AssertHeld();
+    if (confirmed_reads_.empty() ||
+        confirmed_reads_.begin()->first > last_applied_index_) {
+        return;
     }
+    std::multimap<int64_t, ClientReadAck::Ptr>::iterator it;
+    it = confirmed_reads_.upper_bound(last_applied_index_);
+    std::multimap<int64_t, ClientReadAck::Ptr>::iterator jt;
+    for (jt = confirmed_reads_.begin(); jt != it; ++jt) {
+        reads->push_back(jt->second);
+    }
+    confirmed_reads_.erase(confirmed_reads_.begin(), it);
+}
+
+// Write the entries applied since batch->from_index up to applied_index,
+// then answer their clients and fire their watch events. In the none and
+// sync durability modes the applied index goes in the same write as the
+// default database, which is written after the user databases. Returns
+// true if the apply loop has to pause.
+bool InsNodeImpl::FlushApplyBatch(ApplyBatch* batch, int64_t applied_index) {
+    if (durability_ == kDurabilityNone || durability_ == kDurabilitySync) {
+        batch->writes.Put(StorageManager::anonymous_user,
+                          tag_last_applied_index,
+                          BinLogger::IntToString(applied_index));
+    }
+    if (!batch->writes.Empty()) {
+        Status s = data_store_->Write(&batch->writes);
+        assert(s == kOk);
+    }
+    bool pause = false;
+    {
+        MutexLock locker(&mu_);
+        last_applied_index_ = applied_index;
+        pause = (apply_pausers_ > 0);
+    }
+    for (size_t i = 0; i < batch->events.size(); i++) {
+        event_trigger_.AddTask(batch->events[i]);
+    }
+    std::vector<std::pair<int64_t, ClientAck> > acks;
+    client_ack_.TakeRange(batch->from_index, applied_index, &acks);
+    for (size_t i = 0; i < acks.size(); i++) {
+        ClientAck& ack = acks[i].second;
+        const ApplyResult& result = batch->results[acks[i].first - batch->from_index];
+        // the entry of the request was replaced after a leader change
+        bool ok = (ack.term == result.term);
+        Status log_status = ok ? result.status : kError;
+        if (ack.response) {
+            ack.response->set_success(ok);
+            ack.response->set_leader_id("");
+            ack.done->Run(); //client put ok;
+        }
+        if (ack.del_response) {
+            ack.del_response->set_success(ok);
+            ack.del_response->set_leader_id("");
+            ack.done->Run(); //client del ok;   
+        }
+        if (ack.lock_response) {
+            ack.lock_response->set_success(ok);
+            ack.lock_response->set_leader_id("");
+            ack.done->Run(); //client lock ok;   
+        }
+        if (ack.unlock_response) {
+            ack.unlock_response->set_success(ok);
+            ack.unlock_response->set_leader_id("");
+            ack.done->Run(); //client unlock ok;
+        }
+        if (ack.login_response) {
+            ack.login_response->set_status(log_status);
+            ack.login_response->set_uuid(result.uuid);
+            ack.login_response->set_leader_id("");
+            ack.done->Run();
+        }
+        if (ack.logout_response) {
+            ack.logout_response->set_status(log_status);
+            ack.logout_response->set_leader_id("");
+            ack.done->Run();
+        }
+        if (ack.register_response) {
+            ack.register_response->set_status(log_status);
+            ack.register_response->set_leader_id("");
+            ack.done->Run();
+        }
+    }
+    batch->from_index = applied_index + 1;
+    batch->results.clear();
+    batch->events.clear();
+    return pause;
 }
 
 void InsNodeImpl::ForwardKeepAliveCallback(
@@ -403,125 +796,222 @@ void InsNodeImpl::ForwardKeepAliveCallback(
     LOG(DEBUG, "heartbeat from clients forwarded");
 }
 
-void InsNodeImpl::HearBeatCallback(const ::galaxy::ins::AppendEntriesRequest* request,
+void InsNodeImpl::HearBeatCallback(const ::galaxy::ins::AppendEntriesRequest* /*request*/,
                                   ::galaxy::ins::AppendEntriesResponse* response,
-                                  bool failed, int /*error*/) {
+                                  bool failed, int /*error*/,
+                                  std::string follower_id,
+                                  int64_t term,
+                                  int64_t send_time) {
     MutexLock lock(&mu_);
-    boost::scoped_ptr<const galaxy::ins::AppendEntriesRequest> request_ptr(request);
-    boost::scoped_ptr<galaxy::ins::AppendEntriesResponse> response_ptr(response);
+    // the messages belong to the contact and are reused
+    GetContact(follower_id)->heartbeat_in_flight = false;
     if (status_ != kLeader) {
         LOG(INFO, "outdated HearBeatCallback, I am no longer leader now.");
         return ;
     }
     if (!failed) {
-        if (response_ptr->current_term() > current_term_) {
+        if (response->current_term() > current_term_) {
             TransToFollower("InsNodeImpl::HearBeatCallback", 
-                            response_ptr->current_term());
+                            response->current_term());
         }
-        else {
+        else if (term == current_term_) {
             //LOG(INFO, "I am the leader at term: %ld", current_term_);
+            UpdateAppendLimit(follower_id, response);
+            AckContact(follower_id, send_time);
         }
     }  
 }
 
+FollowerContact* InsNodeImpl::GetContact(const std::string& follower_id) {
+    mu_.AssertHeld();
+    FollowerContact*& contact = contacts_[follower_id];
+    if (contact == NULL) {
+        contact = new FollowerContact();
+    }
+    return contact;
+}
+
+// A follower answered an AppendEntries of the current term sent at
+// send_time. The lease is renewed from the time a majority, the leader
+// included, has been heard of.
+void InsNodeImpl::AckContact(const std::string& follower_id, int64_t send_time) {
+    mu_.AssertHeld();
+    FollowerContact* contact = GetContact(follower_id);
+    contact->last_ack_time = std::max(contact->last_ack_time, send_time);
+    std::vector<std::string> voters;
+    GetVoters(&voters);
+    std::map<std::string, int64_t> ack_times;
+    std::vector<std::string>::const_iterator it;
+    for (it = voters.begin(); it != voters.end(); ++it) {
+        if (*it != self_id_) {
+            ack_times[*it] = GetContact(*it)->last_ack_time;
+        }
+    }
+    int64_t lease_start = QuorumValue(ack_times,
+                                      std::numeric_limits<int64_t>::max());
+    if (lease_start == std::numeric_limits<int64_t>::max()) {
+        // the only voter
+        return;
+    }
+    ExtendLease(lease_start);
+}
+
+// A quorum heard from this leader at lease_start, so none of them votes
+// for another candidate before the election timeout has passed
+void InsNodeImpl::ExtendLease(int64_t lease_start) {
+    mu_.AssertHeld();
+    if (!transfer_target_.empty()) {
+        // the target may win an election before the lease expires
+        return;
+    }
+    int64_t lease_span = (FLAGS_elect_timeout_min
+                          - FLAGS_ins_lease_clock_drift) * 1000;
+    if (lease_start > 0 && lease_span > 0 &&
+        lease_start + lease_span > lease_expire_timestamp_) {
+        lease_expire_timestamp_ = lease_start + lease_span;
+    }
+}
+
+// The follower applied more since it last told, so its held back slots
+// may be sent now
+void InsNodeImpl::UpdateAppendLimit(const std::string& follower_id,
+                    const ::galaxy::ins::AppendEntriesResponse* response) {
+    mu_.AssertHeld();
+    if (!response->has_append_limit()) {
+        return;
+    }
+    std::map<std::string, ReplicationPipeline*>::iterator it;
+    it = pipelines_.find(follower_id);
+    if (it == pipelines_.end()) {
+        return;
+    }
+    if (response->append_limit() > it->second->append_limit) {
+        it->second->append_limit = response->append_limit();
+        replication_cond_->Broadcast();
+    }
+}
+
+bool InsNodeImpl::InLeaderLease() {
+    mu_.AssertHeld();
+    return FLAGS_ins_lease_read && status_ == kLeader &&
+           ins_common::timer::get_micros() < lease_expire_timestamp_;
+}
+
+bool InsNodeImpl::InLeaseOfOthers() {
+    mu_.AssertHeld();
+    if (!FLAGS_ins_lease_read) {
+        return false;
+    }
+    if (status_ == kLeader) {
+        return ins_common::timer::get_micros() < lease_expire_timestamp_;
+    }
+    return status_ == kFollower && leader_contact_timestamp_ > 0 &&
+           ins_common::timer::get_micros() - leader_contact_timestamp_
+               < FLAGS_elect_timeout_min * 1000;
+}
+
 void InsNodeImpl::HeartBeatForReadCallback(
                               const ::galaxy::ins::AppendEntriesRequest* request,
                               ::galaxy::ins::AppendEntriesResponse* response,
                               bool failed, int /*error*/,
-                              ClientReadAck::Ptr context) {
+                              std::string follower_id,
+                              ReadConfirmRound::Ptr round) {
     MutexLock lock(&mu_);
     boost::scoped_ptr<const galaxy::ins::AppendEntriesRequest> request_ptr(request);
     boost::scoped_ptr<galaxy::ins::AppendEntriesResponse> response_ptr(response);
-    if (context->triggered) {
+    if (round->triggered) {
         return;
     }
-    if (status_ != kLeader) {
+    bool confirmed = false;
+    bool rejected = false;
+    if (status_ != kLeader || round->term != current_term_) {
         LOG(INFO, "outdated HearBeatCallbackForRead, I am no longer leader now.");
-        context->response->set_success(false);
-        context->response->set_hit(false);
-        context->response->set_leader_id("");
-        context->done->Run();
-        context->triggered = true;
-        return ;
-    }
-    if (!failed) {
+        rejected = true;
+    } else if (!failed) {
         if (response_ptr->current_term() > current_term_) {
             TransToFollower("InsNodeImpl::HeartBeatCallbackForRead", 
                             response_ptr->current_term());
-            context->response->set_success(false);
-            context->response->set_hit(false);
-            context->response->set_leader_id("");
-            context->done->Run();
-            context->triggered = true;
-            return ;
+            rejected = true;
         }
         else {
-            context->succ_count += 1;
+            round->acked.insert(follower_id);
         }
     } else {
-        context->err_count += 1;
-    }
-    if (context->succ_count > members_.size() / 2) {
-        const std::string& key = context->request->key();
-        const std::string& uuid = context->request->uuid();
-        LOG(DEBUG, "client get key: %s", key.c_str());
-        Status s;
-        std::string value;
-        s = data_store_->Get(user_manager_->GetUsernameFromUuid(uuid), key, &value);
-        std::string real_value;
-        LogOperation op;
-        ParseValue(value, op, real_value);
-        if (s == kOk) {
-            if (op == kLock) {
-                if (IsExpiredSession(real_value)) {
-                    context->response->set_hit(false);
-                    context->response->set_success(true);
-                    context->response->set_leader_id("");
-                } else{
-                    context->response->set_hit(true);
-                    context->response->set_success(true);
-                    context->response->set_value(real_value);
-                    context->response->set_leader_id("");
-                }
-            } else{
-                context->response->set_hit(true);
-                context->response->set_success(true);
-                //LOG(INFO, "get value: %s", real_value.c_str());
-                context->response->set_value(real_value);
-                context->response->set_leader_id("");
+        round->failed.insert(follower_id);
+    }
+    if (!rejected && IsQuorum(round->acked)) {
+        confirmed = true;
+    }
+    if (!rejected && !confirmed) {
+        // no quorum is left once too many could not be reached
+        std::vector<std::string> voters;
+        GetVoters(&voters);
+        std::set<std::string> reachable;
+        std::vector<std::string>::const_iterator it;
+        for (it = voters.begin(); it != voters.end(); ++it) {
+            if (round->failed.find(*it) == round->failed.end()) {
+                reachable.insert(*it);
             }
-        } else {
-            context->response->set_hit(false);
-            context->response->set_success(true);
-            context->response->set_leader_id("");
         }
-        context->done->Run();
-        context->triggered = true;
+        rejected = !IsQuorum(reachable);
+    }
+    if (!confirmed && !rejected) {
+        return;
+    }
+    round->triggered = true;
+    read_confirming_ = false;
+    std::vector<ClientReadAck::Ptr> ready_reads;
+    std::vector<ClientReadAck::Ptr> failed_reads;
+    if (confirmed) {
         heartbeat_read_timestamp_ = ins_common::timer::get_micros();
+        ExtendLease(round->start_timestamp);
+        std::vector<ClientReadAck::Ptr>::iterator it = round->reads.begin();
+        for (; it != round->reads.end(); ++it) {
+            if ((*it)->index_response || (*it)->read_index <= last_applied_index_) {
+                ready_reads.push_back(*it);
+            } else {
+                confirmed_reads_.insert(std::make_pair((*it)->read_index, *it));
+            }
+        }
+    } else {
+        failed_reads.swap(round->reads);
     }
-    if (context->err_count > members_.size() / 2) {
-        context->response->set_success(false);
-        context->response->set_hit(false);
-        context->response->set_leader_id("");
-        context->done->Run();
-        context->triggered = true;
+    if (!pending_reads_.empty()) {
+        if (status_ == kLeader) {
+            StartReadConfirm();
+        } else {
+            failed_reads.insert(failed_reads.end(),
+                                pending_reads_.begin(), pending_reads_.end());
+            pending_reads_.clear();
+        }
     }
+    mu_.Unlock();
+    ReplyReads(ready_reads);
+    FailReads(failed_reads, "");
+    mu_.Lock();
 }
 
-void InsNodeImpl::BroadCastHeartBeat() {
-    MutexLock lock(&mu_);
-    if (stop_) {
-        return;
-    }
-    if (status_ != kLeader) {
-        return;
-    }
-    //LOG(INFO,"broadcast heartbeat to clusters");
-    std::vector<std::string>::iterator it = members_.begin();
-    for(; it!= members_.end(); it++) {
+void InsNodeImpl::StartReadConfirm() {
+    mu_.AssertHeld();
+    LOG(DEBUG, "broadcast for %lu reads", pending_reads_.size());
+    ReadConfirmRound::Ptr round(new ReadConfirmRound());
+    round->reads.swap(pending_reads_);
+    round->start_timestamp = ins_common::timer::get_micros();
+    round->term = current_term_;
+    round->acked.insert(self_id_); //self Get success;
+    read_confirming_ = true;
+    std::vector<std::string> voters;
+    GetVoters(&voters);
+    std::vector<std::string>::iterator it = voters.begin();
+    for(; it!= voters.end(); it++) { // make sure I am still leader
         if (*it == self_id_) {
             continue;
         }
+        boost::function<void (const ::galaxy::ins::AppendEntriesRequest*,
+                              ::galaxy::ins::AppendEntriesResponse*,
+                              bool, int) > callback;
+        callback = boost::bind(&InsNodeImpl::HeartBeatForReadCallback, this,
+                               _1, _2, _3, _4, *it, round);
         InsNode_Stub* stub;
         rpc_client_.GetStub(*it, &stub);
         ::galaxy::ins::AppendEntriesRequest* request = 
@@ -531,92 +1021,317 @@ void InsNodeImpl::BroadCastHeartBeat() {
         request->set_term(current_term_);
         request->set_leader_id(self_id_);
         request->set_leader_commit_index(commit_index_);
-        boost::function<void (const ::galaxy::ins::AppendEntriesRequest*,
-                        ::galaxy::ins::AppendEntriesResponse*,
-                        bool, int) > callback;
-        callback = boost::bind(&InsNodeImpl::HearBeatCallback, this,
-                               _1, _2, _3, _4);
         rpc_client_.AsyncRequest(stub, &InsNode_Stub::AppendEntries, 
                                  request, response, callback, 2, 1);
     }
-    heart_beat_pool_.DelayTask(50, boost::bind(&InsNodeImpl::BroadCastHeartBeat, this));
 }
 
-void InsNodeImpl::StartReplicateLog() {
-    mu_.AssertHeld();
-    LOG(INFO, "StartReplicateLog");
-    std::vector<std::string>::iterator it = members_.begin();
-    for(; it!= members_.end(); it++) {
-        if (*it == self_id_) {
-            continue;
+void InsNodeImpl::ReplyReads(const std::vector<ClientReadAck::Ptr>& reads) {
+    std::vector<ClientReadAck::Ptr>::const_iterator it = reads.begin();
+    {
+        MutexLock lock(&mu_);
+        if (snapshot_installing_) {
+            // answered once the snapshot is in, its index covers them
+            for (; it != reads.end(); ++it) {
+                confirmed_reads_.insert(std::make_pair((*it)->read_index, *it));
+            }
+            return;
         }
-        if (replicating_.find(*it) != replicating_.end()){
-            LOG(INFO, "there is another thread replicating on : %s",
-                it->c_str());
-            continue;
+        local_readers_++;
+    }
+    for (; it != reads.end(); ++it) {
+        if ((*it)->index_response) {
+            (*it)->index_response->set_success(true);
+            (*it)->index_response->set_read_index((*it)->read_index);
+        } else if ((*it)->scan_request) {
+            ScanLocal((*it)->scan_request, (*it)->scan_response);
+        } else {
+            ReadLocal((*it)->request, (*it)->response);
         }
-        std::string follower_id = *it;
-        next_index_[follower_id] = binlogger_->GetLength();
-        match_index_[follower_id] = -1;
-        replicatter_.AddTask(boost::bind(&InsNodeImpl::ReplicateLog,
-                                         this, *it));
+        (*it)->done->Run();
     }
-    LogEntry log_entry;
-    log_entry.key = "Ping";
-    log_entry.value = "";
-    log_entry.term = current_term_;
-    log_entry.op = kNop;
-    binlogger_->AppendEntry(log_entry);
+    MutexLock lock(&mu_);
+    EndLocalRead();
 }
 
-void InsNodeImpl::TransToLeader() {
+void InsNodeImpl::EndLocalRead() {
     mu_.AssertHeld();
-    in_safe_mode_ = true;
-    status_ = kLeader;
-    current_leader_ = self_id_;
-    LOG(INFO, "I win the election, term:%d", current_term_);
-    heart_beat_pool_.AddTask(
-        boost::bind(&InsNodeImpl::BroadCastHeartBeat, this));
-    StartReplicateLog();
+    local_readers_--;
+    if (local_readers_ == 0 && snapshot_installing_) {
+        local_read_cond_->Broadcast();
+    }
 }
 
-void InsNodeImpl::VoteCallback(const ::galaxy::ins::VoteRequest* request,
-                               ::galaxy::ins::VoteResponse* response,
-                               bool failed, int /*error*/) {
-    MutexLock lock(&mu_);
-    boost::scoped_ptr<const galaxy::ins::VoteRequest> request_ptr(request);
-    boost::scoped_ptr<galaxy::ins::VoteResponse> response_ptr(response);
-    if (!failed && status_ == kCandidate) {
-        int64_t their_term = response_ptr->term();
-        LOG(INFO, "InsNodeImpl::VoteCallback[%ld], result:%s",
-            their_term, response_ptr->vote_granted()?"true":"false");
-        if (response_ptr->vote_granted() && their_term == current_term_) {
-            vote_grant_[current_term_]++;
-            if (vote_grant_[current_term_] > (members_.size() / 2)) {
-                TransToLeader();
-            }
+void InsNodeImpl::FailReads(const std::vector<ClientReadAck::Ptr>& reads,
+                            const std::string& leader_id) {
+    std::vector<ClientReadAck::Ptr>::const_iterator it = reads.begin();
+    for (; it != reads.end(); ++it) {
+        if ((*it)->index_response) {
+            (*it)->index_response->set_success(false);
+            (*it)->index_response->set_leader_id(leader_id);
+        } else if ((*it)->scan_request) {
+            (*it)->scan_response->set_success(false);
+            (*it)->scan_response->set_leader_id(leader_id);
         } else {
-            if (their_term > current_term_) {
-                TransToFollower("InsNodeImpl::VoteCallback", their_term);
-            }
+            (*it)->response->set_success(false);
+            (*it)->response->set_hit(false);
+            (*it)->response->set_leader_id(leader_id);
         }
+        (*it)->done->Run();
     }
 }
 
-void InsNodeImpl::GetLastLogIndexAndTerm(int64_t* last_log_index,
-                                         int64_t* last_log_term) {
-    binlogger_->GetLastLogIndexAndTerm(last_log_index, last_log_term);
-}
-
-void InsNodeImpl::TryToBeLeader() {
+bool InsNodeImpl::NeedReadConfirm() {
+    mu_.AssertHeld();
+    if (old_members_.empty() && members_.size() == 1 && members_[0] == self_id_) {
+        return false;
+    }
+    if (FLAGS_ins_lease_read) {
+        return !InLeaderLease();
+    }
+    int64_t now_timestamp = ins_common::timer::get_micros();
+    return (now_timestamp - heartbeat_read_timestamp_) > 
+           1000 * FLAGS_elect_timeout_min;
+}
+
+void InsNodeImpl::RequestReadIndex(ClientReadAck::Ptr context) {
+    mu_.AssertHeld();
+    InsNode_Stub* stub;
+    rpc_client_.GetStub(current_leader_, &stub);
+    ::galaxy::ins::ReadIndexRequest* request =
+                new ::galaxy::ins::ReadIndexRequest();
+    ::galaxy::ins::ReadIndexResponse* response =
+                new ::galaxy::ins::ReadIndexResponse();
+    boost::function<void (const ::galaxy::ins::ReadIndexRequest*,
+                          ::galaxy::ins::ReadIndexResponse*,
+                          bool, int) > callback;
+    callback = boost::bind(&InsNodeImpl::ReadIndexCallback, this,
+                           _1, _2, _3, _4, context);
+    rpc_client_.AsyncRequest(stub, &InsNode_Stub::ReadIndex,
+                             request, response, callback, 2, 1);
+}
+
+void InsNodeImpl::ReadIndexCallback(const ::galaxy::ins::ReadIndexRequest* request,
+                                    ::galaxy::ins::ReadIndexResponse* response,
+                                    bool failed, int /*error*/,
+                                    ClientReadAck::Ptr context) {
+    MutexLock lock(&mu_);
+    boost::scoped_ptr<const galaxy::ins::ReadIndexRequest> request_ptr(request);
+    boost::scoped_ptr<galaxy::ins::ReadIndexResponse> response_ptr(response);
+    std::vector<ClientReadAck::Ptr> reads(1, context);
+    if (failed || !response->success()) {
+        // let the client retry on the leader
+        LOG(INFO, "failed to get read index from %s", current_leader_.c_str());
+        std::string leader_id = (status_ == kFollower) ? current_leader_ : "";
+        mu_.Unlock();
+        FailReads(reads, leader_id);
+        mu_.Lock();
+        return;
+    }
+    context->read_index = response->read_index();
+    if (context->read_index > last_applied_index_) {
+        confirmed_reads_.insert(std::make_pair(context->read_index, context));
+        return;
+    }
+    mu_.Unlock();
+    ReplyReads(reads);
+    mu_.Lock();
+}
+
+bool InsNodeImpl::CanReadStale() {
+    mu_.AssertHeld();
+    int64_t now_timestamp = ins_common::timer::get_micros();
+    return status_ == kFollower && !current_leader_.empty() &&
+           !snapshot_installing_ &&
+           commit_index_ - last_applied_index_ <= FLAGS_ins_follower_read_max_lag &&
+           now_timestamp - leader_contact_timestamp_ < 1000 * FLAGS_elect_timeout_max;
+}
+
+void InsNodeImpl::ReadLocal(const ::galaxy::ins::GetRequest* request,
+                            ::galaxy::ins::GetResponse* response) {
+    const std::string& key = request->key();
+    const std::string& uuid = request->uuid();
+    LOG(DEBUG, "client get key: %s", key.c_str());
+    Status s;
+    std::string value;
+    s = data_store_->Get(user_manager_->GetUsernameFromUuid(uuid), key, &value);
+    std::string real_value;
+    LogOperation op;
+    ParseValue(value, op, real_value);
+    if (s == kOk) {
+        if (op == kLock) {
+            if (IsExpiredSession(real_value)) {
+                response->set_hit(false);
+                response->set_success(true);
+                response->set_leader_id("");
+            } else {
+                response->set_hit(true);
+                response->set_success(true);
+                response->set_value(real_value);
+                response->set_leader_id("");
+            }
+        } else {
+            response->set_hit(true);
+            response->set_success(true);
+            response->set_value(real_value);
+            //LOG(INFO, "get value: %s", real_value.c_str());
+            response->set_leader_id("");
+        }
+    } else {
+        response->set_hit(false);
+        response->set_success(true);
+        response->set_leader_id("");
+    }
+}
+
+void InsNodeImpl::BroadCastHeartBeat() {
+    MutexLock lock(&mu_);
+    if (stop_) {
+        return;
+    }
+    if (status_ != kLeader) {
+        return;
+    }
+    //LOG(INFO,"broadcast heartbeat to clusters");
+    int64_t now = ins_common::timer::get_micros();
+    std::vector<std::string> followers;
+    GetFollowers(&followers);
+    std::vector<std::string>::iterator it = followers.begin();
+    for(; it!= followers.end(); it++) {
+        // replication batches and an unanswered heartbeat keep the
+        // follower in touch just as well
+        FollowerContact* contact = GetContact(*it);
+        if (contact->heartbeat_in_flight ||
+            now - contact->last_send_time < sHeartBeatInterval * 1000L) {
+            heartbeat_avoided_count_++;
+            continue;
+        }
+        InsNode_Stub* stub;
+        rpc_client_.GetStub(*it, &stub);
+        ::galaxy::ins::AppendEntriesRequest* request = &contact->heartbeat_request;
+        ::galaxy::ins::AppendEntriesResponse* response = &contact->heartbeat_response;
+        request->set_term(current_term_);
+        request->set_leader_id(self_id_);
+        request->set_leader_commit_index(commit_index_);
+        response->Clear();
+        contact->heartbeat_in_flight = true;
+        contact->last_send_time = now;
+        heartbeat_sent_count_++;
+        boost::function<void (const ::galaxy::ins::AppendEntriesRequest*,
+                        ::galaxy::ins::AppendEntriesResponse*,
+                        bool, int) > callback;
+        callback = boost::bind(&InsNodeImpl::HearBeatCallback, this,
+                               _1, _2, _3, _4, *it, current_term_, now);
+        rpc_client_.AsyncRequest(stub, &InsNode_Stub::AppendEntries, 
+                                 request, response, callback, 2, 1);
+    }
+    heart_beat_pool_.DelayTask(sHeartBeatInterval,
+        boost::bind(&InsNodeImpl::BroadCastHeartBeat, this));
+}
+
+void InsNodeImpl::StartReplicators() {
+    mu_.AssertHeld();
+    std::vector<std::string> followers;
+    GetFollowers(&followers);
+    std::vector<std::string>::iterator it = followers.begin();
+    for(; it!= followers.end(); it++) {
+        if (replicating_.find(*it) != replicating_.end()){
+            LOG(INFO, "there is another thread replicating on : %s",
+                it->c_str());
+            continue;
+        }
+        std::string follower_id = *it;
+        next_index_[follower_id] = binlogger_->GetLength();
+        match_index_[follower_id] = -1;
+        // marked here, so that a membership change right after does not
+        // queue a second thread before this one runs
+        replicating_.insert(follower_id);
+        replicatter_.AddTask(boost::bind(&InsNodeImpl::ReplicateLog,
+                                         this, *it));
+    }
+}
+
+void InsNodeImpl::StartReplicateLog() {
+    mu_.AssertHeld();
+    LOG(INFO, "StartReplicateLog");
+    // StartReplicators skips a follower whose thread outlived the last
+    // leadership, progress learnt back then must not carry over
+    std::vector<std::string> followers;
+    GetFollowers(&followers);
+    for (size_t i = 0; i < followers.size(); i++) {
+        next_index_[followers[i]] = binlogger_->GetLength();
+        match_index_[followers[i]] = -1;
+    }
+    StartReplicators();
+    LogEntry log_entry;
+    log_entry.key = "Ping";
+    log_entry.value = "";
+    log_entry.term = current_term_;
+    log_entry.op = kNop;
+    binlogger_->AppendEntry(log_entry);
+    // commits at once when this is the only voter
+    UpdateCommitIndex(binlogger_->GetLength() - 1);
+}
+
+void InsNodeImpl::TransToLeader() {
+    mu_.AssertHeld();
+    // answers from an earlier leadership renew no lease
+    std::map<std::string, FollowerContact*>::iterator it;
+    for (it = contacts_.begin(); it != contacts_.end(); ++it) {
+        it->second->last_ack_time = 0;
+    }
+    in_safe_mode_ = true;
+    status_ = kLeader;
+    current_leader_ = self_id_;
+    LOG(INFO, "I win the election, term:%d", current_term_);
+    heart_beat_pool_.AddTask(
+        boost::bind(&InsNodeImpl::BroadCastHeartBeat, this));
+    StartReplicateLog();
+    if (!old_members_.empty()) {
+        // the last leader left the joint consensus unfinished
+        membership_worker_.AddTask(
+            boost::bind(&InsNodeImpl::FinishMembershipChange, this,
+                        memberships_.rbegin()->first, current_term_,
+                        static_cast<ChangeMembershipResponse*>(NULL),
+                        static_cast<google::protobuf::Closure*>(NULL)));
+    }
+}
+
+void InsNodeImpl::VoteCallback(const ::galaxy::ins::VoteRequest* request,
+                               ::galaxy::ins::VoteResponse* response,
+                               bool failed, int /*error*/,
+                               std::string voter_id) {
+    MutexLock lock(&mu_);
+    boost::scoped_ptr<const galaxy::ins::VoteRequest> request_ptr(request);
+    boost::scoped_ptr<galaxy::ins::VoteResponse> response_ptr(response);
+    if (!failed && status_ == kCandidate) {
+        int64_t their_term = response_ptr->term();
+        LOG(INFO, "InsNodeImpl::VoteCallback[%ld], result:%s",
+            their_term, response_ptr->vote_granted()?"true":"false");
+        if (response_ptr->vote_granted() && their_term == current_term_) {
+            std::set<std::string>& grants = vote_grant_[current_term_];
+            grants.insert(voter_id);
+            if (IsQuorum(grants)) {
+                TransToLeader();
+            }
+        } else {
+            if (their_term > current_term_) {
+                TransToFollower("InsNodeImpl::VoteCallback", their_term);
+            }
+        }
+    }
+}
+
+void InsNodeImpl::GetLastLogIndexAndTerm(int64_t* last_log_index,
+                                         int64_t* last_log_term) {
+    binlogger_->GetLastLogIndexAndTerm(last_log_index, last_log_term);
+}
+
+void InsNodeImpl::TryToBeLeader() {
     MutexLock lock(&mu_);
-    if (single_node_mode_) { //single node mode
-        status_ = kLeader;
-        current_leader_ =  self_id_;
-        in_safe_mode_ = false;
-        commit_index_ = last_applied_index_;
-        current_term_++;
-        meta_->WriteCurrentTerm(current_term_);
+    if (!IsVoter(self_id_)) {
+        // learners never campaign, but may be made members later
+        CheckLeaderCrash();
         return;
     }
     if (status_ == kLeader) {
@@ -628,18 +1343,92 @@ void InsNodeImpl::TryToBeLeader() {
         CheckLeaderCrash();
         return;
     }
+    if (FLAGS_ins_pre_vote) {
+        StartPreVote();
+    } else {
+        StartElection(false);
+    }
+    CheckLeaderCrash();
+}
+
+// Ask whether the others would vote for this node in the next term,
+// without bumping the term. A node that merely stalled for a while, e.g.
+// on a compaction, is refused by followers still hearing of the leader,
+// so it cannot depose a healthy leader.
+void InsNodeImpl::StartPreVote() {
+    mu_.AssertHeld();
+    pre_vote_term_ = current_term_ + 1;
+    pre_vote_grant_.clear();
+    pre_vote_grant_.insert(self_id_);
+    if (IsQuorum(pre_vote_grant_)) {
+        // the only voter
+        pre_vote_term_ = -1;
+        StartElection(false);
+        return;
+    }
+    LOG(INFO, "broad cast pre-vote request to cluster, next term: %ld",
+        pre_vote_term_);
+    SendVoteRequests(pre_vote_term_, true, false);
+}
+
+void InsNodeImpl::PreVoteCallback(const ::galaxy::ins::VoteRequest* request,
+                                  ::galaxy::ins::VoteResponse* response,
+                                  bool failed, int /*error*/,
+                                  std::string voter_id) {
+    MutexLock lock(&mu_);
+    boost::scoped_ptr<const galaxy::ins::VoteRequest> request_ptr(request);
+    boost::scoped_ptr<galaxy::ins::VoteResponse> response_ptr(response);
+    if (failed) {
+        return;
+    }
+    if (response->term() > current_term_) {
+        TransToFollower("InsNodeImpl::PreVoteCallback", response->term());
+        return;
+    }
+    // stale round, or a leader showed up meanwhile
+    if (request->term() != pre_vote_term_ ||
+        request->term() != current_term_ + 1 ||
+        status_ == kLeader || heartbeat_count_ > 0) {
+        return;
+    }
+    if (response->vote_granted()) {
+        pre_vote_grant_.insert(voter_id);
+        if (IsQuorum(pre_vote_grant_)) {
+            pre_vote_term_ = -1;
+            StartElection(false);
+        }
+    }
+}
+
+void InsNodeImpl::StartElection(bool leadership_transfer) {
+    mu_.AssertHeld();
     current_term_++;
     meta_->WriteCurrentTerm(current_term_);
     status_ =  kCandidate;
+    // votes of earlier terms are of no use any more
+    voted_for_.erase(voted_for_.begin(), voted_for_.lower_bound(current_term_));
+    vote_grant_.erase(vote_grant_.begin(), vote_grant_.lower_bound(current_term_));
     voted_for_[current_term_] = self_id_;
     meta_->WriteVotedFor(current_term_, self_id_);
-    vote_grant_[current_term_] ++;
-    std::vector<std::string>::iterator it = members_.begin();
+    vote_grant_[current_term_].insert(self_id_);
+    if (IsQuorum(vote_grant_[current_term_])) {
+        TransToLeader();
+        return;
+    }
+    LOG(INFO, "broad cast vote request to cluster, new term: %ld", current_term_);
+    SendVoteRequests(current_term_, false, leadership_transfer);
+}
+
+void InsNodeImpl::SendVoteRequests(int64_t term, bool pre_vote,
+                                   bool leadership_transfer) {
+    mu_.AssertHeld();
+    std::vector<std::string> voters;
+    GetVoters(&voters);
+    std::vector<std::string>::iterator it = voters.begin();
     int64_t last_log_index;
     int64_t last_log_term;
     GetLastLogIndexAndTerm(&last_log_index, &last_log_term);
-    LOG(INFO, "broad cast vote request to cluster, new term: %ld", current_term_);
-    for(; it!= members_.end(); it++) {
+    for(; it!= voters.end(); it++) {
         if (*it == self_id_) {
             continue;
         }
@@ -648,30 +1437,32 @@ void InsNodeImpl::TryToBeLeader() {
         ::galaxy::ins::VoteRequest* request = new ::galaxy::ins::VoteRequest();
         ::galaxy::ins::VoteResponse* response = new ::galaxy::ins::VoteResponse();
         request->set_candidate_id(self_id_);
-        request->set_term(current_term_);
+        request->set_term(term);
         request->set_last_log_index(last_log_index);
         request->set_last_log_term(last_log_term);
+        request->set_pre_vote(pre_vote);
+        request->set_leadership_transfer(leadership_transfer);
         boost::function<void (const ::galaxy::ins::VoteRequest* ,
                               ::galaxy::ins::VoteResponse* ,
                               bool, int ) > callback;
-        callback = boost::bind(&InsNodeImpl::VoteCallback, this, _1, _2, _3, _4);
+        if (pre_vote) {
+            callback = boost::bind(&InsNodeImpl::PreVoteCallback, this,
+                                   _1, _2, _3, _4, *it);
+        } else {
+            callback = boost::bind(&InsNodeImpl::VoteCallback, this,
+                                   _1, _2, _3, _4, *it);
+        }
         rpc_client_.AsyncRequest(stub, &InsNode_Stub::Vote, request, response,
                                  callback, 2, 1);
     }
-    CheckLeaderCrash();
 }
 
 void InsNodeImpl::DoAppendEntries(const ::galaxy::ins::AppendEntriesRequest* request,
                                   ::galaxy::ins::AppendEntriesResponse* response,
                                   ::google::protobuf::Closure* done) {
     MutexLock lock(&mu_);
-    if (request->term() >= current_term_) {
-        status_ = kFollower;
-        if (request->term() > current_term_) {
-            meta_->WriteCurrentTerm(request->term());
-        }
-        current_term_ = request->term();
-    } else {
+    response->set_accept_packed_entries(true);
+    if (request->term() < current_term_) {
         response->set_current_term(current_term_);
         response->set_success(false);
         response->set_log_length(binlogger_->GetLength());
@@ -679,11 +1470,48 @@ void InsNodeImpl::DoAppendEntries(const ::galaxy::ins::AppendEntriesRequest* req
         done->Run();
         return;
     }
+    status_ = kFollower;
+    if (request->term() > current_term_) {
+        meta_->WriteCurrentTerm(request->term());
+    }
+    current_term_ = request->term();
+    int64_t entry_count = std::max(request->entries_size(),
+                                   request->packed_entries_size());
+    if (entry_count > 0) {
+        // the leader pipelines batches, which may be picked up by the
+        // workers out of order, give the earlier ones a moment to land;
+        // the appender wakes us up as soon as it is done
+        int64_t wait_end = ins_common::timer::get_micros() + 50000;
+        while (request->term() == current_term_) {
+            int64_t now = ins_common::timer::get_micros();
+            if (appending_entries_) {
+                append_cond_->Wait();
+            } else if (request->prev_log_index() >= binlogger_->GetLength() &&
+                       now < wait_end) {
+                append_cond_->TimeWaitInUs(wait_end - now);
+            } else {
+                break;
+            }
+        }
+        if (request->term() != current_term_) {
+            // a newer leader showed up while waiting
+            response->set_current_term(current_term_);
+            response->set_success(false);
+            response->set_log_length(binlogger_->GetLength());
+            LOG(INFO, "[AppendEntries] term is outdated");
+            done->Run();
+            return;
+        }
+    }
 
     if (status_ == kFollower) {
         current_leader_ = request->leader_id();
         heartbeat_count_++;
-        if (request->entries_size() > 0) {
+        leader_contact_timestamp_ = ins_common::timer::get_micros();
+        // the leader paces its batches to this instead of running into
+        // the busy check below
+        response->set_append_limit(last_applied_index_ + FLAGS_max_commit_pending);
+        if (request->entries_size() > 0 || request->packed_entries_size() > 0) {
             if (request->prev_log_index() >= binlogger_->GetLength()){
                 response->set_current_term(current_term_);
                 response->set_success(false);
@@ -694,15 +1522,19 @@ void InsNodeImpl::DoAppendEntries(const ::galaxy::ins::AppendEntriesRequest* req
             }
 
             int64_t prev_log_term = -1;
-            if (request->prev_log_index() >= 0) {
-                LogEntry prev_log_entry;
-                bool slot_ok = binlogger_->ReadSlot(request->prev_log_index(),
-                                                    &prev_log_entry);
-                assert(slot_ok);
-                prev_log_term = prev_log_entry.term;
+            if (request->prev_log_index() >= 0 &&
+                !GetLogTerm(request->prev_log_index(), &prev_log_term)) {
+                response->set_current_term(current_term_);
+                response->set_success(false);
+                response->set_log_length(binlogger_->GetLength());
+                LOG(WARNING, "[AppendEntries] prev log %ld is compacted",
+                    request->prev_log_index());
+                done->Run();
+                return;
             }
             if (prev_log_term != request->prev_log_term() ) {
                 binlogger_->Truncate(request->prev_log_index() - 1);
+                TruncateMemberships();
                 response->set_current_term(current_term_);
                 response->set_success(false);
                 response->set_log_length(binlogger_->GetLength());
@@ -723,22 +1555,84 @@ void InsNodeImpl::DoAppendEntries(const ::galaxy::ins::AppendEntriesRequest* req
                 done->Run();
                 return;
             }
-            if (binlogger_->GetLength() > request->prev_log_index() + 1) {
-                int64_t old_length = binlogger_->GetLength();
-                binlogger_->Truncate(request->prev_log_index() );
-                LOG(INFO, "[AppendEntries] log length alignment, "
-                    "length: %ld,%ld", 
-                    old_length, request->prev_log_index());
+            // a resent batch may overlap slots already written, those are
+            // skipped and the log is only cut at the first conflict
+            int64_t skip = 0;
+            while (skip < entry_count &&
+                   request->prev_log_index() + 1 + skip < binlogger_->GetLength()) {
+                int64_t slot_index = request->prev_log_index() + 1 + skip;
+                int64_t entry_term = -1;
+                if (request->packed_entries_size() > 0) {
+                    Entry entry;
+                    entry.ParseFromString(request->packed_entries(skip));
+                    entry_term = entry.term();
+                } else {
+                    entry_term = request->entries(skip).term();
+                }
+                int64_t slot_term = -1;
+                if (!GetLogTerm(slot_index, &slot_term) || slot_term != entry_term) {
+                    int64_t old_length = binlogger_->GetLength();
+                    binlogger_->Truncate(slot_index - 1);
+                    TruncateMemberships();
+                    LOG(INFO, "[AppendEntries] log length alignment, "
+                        "length: %ld,%ld", 
+                        old_length, slot_index - 1);
+                    break;
+                }
+                skip++;
+            }
+            if (skip < entry_count) {
+                appending_entries_ = true;
+                mu_.Unlock();
+                if (request->packed_entries_size() > 0) {
+                    if (skip == 0) {
+                        binlogger_->AppendEntryList(request->packed_entries());
+                    } else {
+                        ::google::protobuf::RepeatedPtrField<std::string> rest(
+                            request->packed_entries().begin() + skip,
+                            request->packed_entries().end());
+                        binlogger_->AppendEntryList(rest);
+                    }
+                } else {
+                    if (skip == 0) {
+                        binlogger_->AppendEntryList(request->entries());
+                    } else {
+                        ::google::protobuf::RepeatedPtrField<Entry> rest(
+                            request->entries().begin() + skip,
+                            request->entries().end());
+                        binlogger_->AppendEntryList(rest);
+                    }
+                }
+                mu_.Lock();
+                appending_entries_ = false;
+                append_cond_->Broadcast();
+                for (int64_t i = skip; i < entry_count; i++) {
+                    if (request->packed_entries_size() > 0) {
+                        if (BinLogger::EntryOp(request->packed_entries(i))
+                            == kMembership) {
+                            Entry entry;
+                            entry.ParseFromString(request->packed_entries(i));
+                            AppendMembership(request->prev_log_index() + 1 + i,
+                                             entry.value());
+                        }
+                    } else if (request->entries(i).op() == kMembership) {
+                        AppendMembership(request->prev_log_index() + 1 + i,
+                                         request->entries(i).value());
+                    }
+                }
             }
-            mu_.Unlock();
-            binlogger_->AppendEntryList(request->entries());
-            mu_.Lock();
         }
+        // only slots known to match the leader may be committed, and a
+        // late batch must not move the commit index backwards
         int64_t old_commit_index = commit_index_;
-        commit_index_ = std::min(binlogger_->GetLength() - 1,
-                                 request->leader_commit_index());
-       
-        if (commit_index_ > old_commit_index) {
+        int64_t new_commit_index = binlogger_->GetLength() - 1;
+        if (entry_count > 0) {
+            new_commit_index = request->prev_log_index() + entry_count;
+        }
+        new_commit_index = std::min(new_commit_index,
+                                    request->leader_commit_index());
+        if (new_commit_index > old_commit_index) {
+            commit_index_ = new_commit_index;
             commit_cond_->Signal();
             LOG(DEBUG, "follower: update my commit index to :%ld", commit_index_);
         }
@@ -764,17 +1658,198 @@ void InsNodeImpl::AppendEntries(::google::protobuf::RpcController* /*controller*
     return;
 }
 
+void InsNodeImpl::InstallSnapshot(::google::protobuf::RpcController* /*controller*/,
+                                  const ::galaxy::ins::InstallSnapshotRequest* request,
+                                  ::galaxy::ins::InstallSnapshotResponse* response,
+                                  ::google::protobuf::Closure* done) {
+    // installing takes a while, so it must not hold up the heartbeats
+    snapshot_installer_.AddTask(
+        boost::bind(&InsNodeImpl::DoInstallSnapshot, this,
+                    request, response, done)
+    );
+}
+
+static bool WriteSnapshotChunk(const std::string& file_name, int64_t offset,
+                               const std::string& data, bool sync) {
+    int flags = O_WRONLY | O_CREAT;
+    if (offset == 0) {
+        flags |= O_TRUNC;
+    }
+    int fd = open(file_name.c_str(), flags, 0644);
+    if (fd < 0) {
+        LOG(WARNING, "[snapshot] failed to open %s", file_name.c_str());
+        return false;
+    }
+    bool ok = true;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size != offset) {
+        LOG(WARNING, "[snapshot] chunk at %ld does not follow the received %ld bytes",
+            offset, static_cast<int64_t>(st.st_size));
+        ok = false;
+    }
+    int64_t written = 0;
+    while (ok && written < static_cast<int64_t>(data.size())) {
+        ssize_t ret = pwrite(fd, data.data() + written, data.size() - written,
+                             offset + written);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            ok = false;
+            break;
+        }
+        written += ret;
+    }
+    if (ok && sync && fsync(fd) != 0) {
+        ok = false;
+    }
+    close(fd);
+    return ok;
+}
+
+void InsNodeImpl::DoInstallSnapshot(const ::galaxy::ins::InstallSnapshotRequest* request,
+                                    ::galaxy::ins::InstallSnapshotResponse* response,
+                                    ::google::protobuf::Closure* done) {
+    MutexLock lock(&mu_);
+    if (request->term() < current_term_) {
+        response->set_current_term(current_term_);
+        response->set_success(false);
+        LOG(INFO, "[InstallSnapshot] term is outdated");
+        done->Run();
+        return;
+    }
+    if (request->term() > current_term_) {
+        meta_->WriteCurrentTerm(request->term());
+    }
+    status_ = kFollower;
+    current_term_ = request->term();
+    current_leader_ = request->leader_id();
+    heartbeat_count_++;
+    leader_contact_timestamp_ = ins_common::timer::get_micros();
+    response->set_current_term(current_term_);
+    mu_.Unlock();
+    std::string tmp_file_name = snapshot_dir_ + "/" + install_tmp_file_name;
+    bool ok = WriteSnapshotChunk(tmp_file_name, request->offset(),
+                                 request->data(), request->done());
+    if (ok && request->done()) {
+        ok = InstallSnapshotFile(tmp_file_name, request->term());
+    }
+    mu_.Lock();
+    if (current_term_ != request->term()) {
+        // a newer leader showed up meanwhile
+        ok = false;
+    }
+    response->set_current_term(current_term_);
+    response->set_success(ok);
+    done->Run();
+}
+
+// Replace the state machine and the binlog with a snapshot received
+// from the leader of term. A snapshot this node has already applied,
+// e.g. a delayed or resent one, is dropped as installed; the log after
+// the snapshot is kept if it follows the snapshot.
+bool InsNodeImpl::InstallSnapshotFile(const std::string& tmp_file_name,
+                                      int64_t term) {
+    MutexLock snapshot_lock(&snapshot_mu_);
+    SnapshotMeta meta;
+    if (!SnapshotReader::Verify(tmp_file_name, &meta)) {
+        LOG(WARNING, "[snapshot] received a broken snapshot");
+        return false;
+    }
+    int64_t start_time = ins_common::timer::get_micros();
+    bool keep_log = false;
+    {
+        MutexLock lock(&mu_);
+        if (current_term_ != term) {
+            LOG(INFO, "[snapshot] drop snapshot of term %ld, now in %ld",
+                term, current_term_);
+            unlink(tmp_file_name.c_str());
+            return false;
+        }
+        PauseApply();
+        if (meta.last_included_index() <= last_applied_index_) {
+            LOG(INFO, "[snapshot] drop snapshot at %ld, already applied %ld",
+                meta.last_included_index(), last_applied_index_);
+            ResumeApply();
+            unlink(tmp_file_name.c_str());
+            return true;
+        }
+        int64_t log_term = -1;
+        keep_log = GetLogTerm(meta.last_included_index(), &log_term) &&
+                   log_term == meta.last_included_term();
+        snapshot_installing_ = true;
+        while (local_readers_ > 0) {
+            local_read_cond_->Wait();
+        }
+    }
+    std::string file_name = snapshot_dir_ + "/" + snapshot_file_name;
+    if (rename(tmp_file_name.c_str(), file_name.c_str()) != 0) {
+        LOG(FATAL, "failed to rename %s to %s",
+            tmp_file_name.c_str(), file_name.c_str());
+        abort();
+    }
+    SyncSnapshotDir();
+    LOG(INFO, "[snapshot] install snapshot at %ld, term %ld, keep log: %s",
+        meta.last_included_index(), meta.last_included_term(),
+        keep_log ? "true" : "false");
+    // the old state is gone once loading starts, a failure here is
+    // recovered by reloading the snapshot file at restart
+    if (!LoadSnapshot(file_name)) {
+        LOG(FATAL, "failed to load snapshot %s", file_name.c_str());
+        abort();
+    }
+    // the loaded data must be on disk before the log it replaces is gone
+    if (data_store_->Sync() != kOk) {
+        LOG(FATAL, "failed to sync data store");
+        abort();
+    }
+    MutexLock lock(&mu_);
+    if (!keep_log) {
+        binlogger_->Reset(meta.last_included_index() + 1,
+                          meta.last_included_term());
+    }
+    snapshot_index_ = meta.last_included_index();
+    snapshot_term_ = meta.last_included_term();
+    last_applied_index_ = snapshot_index_;
+    commit_index_ = std::max(commit_index_, snapshot_index_);
+    LoadMemberships();
+    snapshot_installed_count_++;
+    snapshot_installing_ = false;
+    ResumeApply();
+    std::vector<ClientReadAck::Ptr> ready_reads;
+    TakeReadyReads(&ready_reads);
+    if (!ready_reads.empty()) {
+        mu_.Unlock();
+        ReplyReads(ready_reads);
+        mu_.Lock();
+    }
+    LOG(INFO, "[snapshot] installed snapshot at %ld in %ld ms", snapshot_index_,
+        (ins_common::timer::get_micros() - start_time) / 1000);
+    return true;
+}
+
 void InsNodeImpl::Vote(::google::protobuf::RpcController* /*controller*/,
                        const ::galaxy::ins::VoteRequest* request,
                        ::galaxy::ins::VoteResponse* response,
                        ::google::protobuf::Closure* done) {
     MutexLock lock(&mu_);
+    // answered whatever the membership, a node added lately may not know
+    // of its membership yet
     if (request->term() < current_term_) {
         response->set_vote_granted(false);
         response->set_term(current_term_);
         done->Run();
         return;
     }
+    if (!request->leadership_transfer() && InLeaseOfOthers()) {
+        // the leader may still be answering reads on its lease
+        LOG(INFO, "refuse vote for %s, leader lease is not expired",
+            request->candidate_id().c_str());
+        response->set_vote_granted(false);
+        response->set_term(current_term_);
+        done->Run();
+        return;
+    }
     int64_t last_log_index;
     int64_t last_log_term;
     GetLastLogIndexAndTerm(&last_log_index, &last_log_term);
@@ -792,6 +1867,19 @@ void InsNodeImpl::Vote(::google::protobuf::RpcController* /*controller*/,
         }
     }
 
+    if (request->pre_vote()) {
+        // nothing changes here. A leader is still around while this node
+        // leads or heard of the leader within an election timeout.
+        bool leader_alive = status_ == kLeader ||
+            (status_ == kFollower && leader_contact_timestamp_ > 0 &&
+             ins_common::timer::get_micros() - leader_contact_timestamp_
+                 < FLAGS_elect_timeout_min * 1000);
+        response->set_vote_granted(request->term() > current_term_ &&
+                                   !leader_alive);
+        response->set_term(current_term_);
+        done->Run();
+        return;
+    }
     if (request->term() > current_term_) {
         TransToFollower("InsNodeImpl::Vote", request->term());
     }
@@ -802,6 +1890,7 @@ void InsNodeImpl::Vote(::google::protobuf::RpcController* /*controller*/,
         done->Run();
         return;
     }
+    voted_for_.erase(voted_for_.begin(), voted_for_.lower_bound(current_term_));
     voted_for_[current_term_] = request->candidate_id();
     meta_->WriteVotedFor(current_term_, request->candidate_id());
     response->set_vote_granted(true);
@@ -811,148 +1900,383 @@ void InsNodeImpl::Vote(::google::protobuf::RpcController* /*controller*/,
 }
 
 
+// The leader counts like a follower whose match index is the end of its
+// written log, as its own entries are replicated before it writes them.
+// a_index bounds the new commit index.
 void InsNodeImpl::UpdateCommitIndex(int64_t a_index) {
     mu_.AssertHeld();
-    std::vector<std::string>::const_iterator it;
-    uint32_t match_count = 0;
-    for (it = members_.begin(); it != members_.end(); it++) {
-        std::string server_id = *it;
-        if (match_index_[server_id] >= a_index) {
-            match_count += 1;
-        }
+    int64_t new_commit_index = std::min(a_index,
+        QuorumValue(match_index_, binlogger_->GetLength() - 1));
+    if (new_commit_index <= commit_index_) {
+        return;
     }
-    if (match_count >= match_index_.size()/2 && a_index > commit_index_) {
-        commit_index_ = a_index;
-        LOG(DEBUG, "update to new commit index: %ld", commit_index_);
-        commit_cond_->Signal();
+    // entries of older terms are only committed along with a newer one
+    int64_t log_term = -1;
+    if (!GetLogTerm(new_commit_index, &log_term) || log_term != current_term_) {
+        return;
+    }
+    commit_index_ = new_commit_index;
+    LOG(DEBUG, "update to new commit index: %ld", commit_index_);
+    commit_cond_->Signal();
+}
+
+// Wait for a client entry to reach the binlog. The entry is readable as
+// soon as it is queued, so the followers get it while the leader writes
+// it. mu_ is released meanwhile, so entries from concurrent clients are
+// written by one group commit.
+void InsNodeImpl::WaitLogDurable(int64_t log_index) {
+    mu_.AssertHeld();
+    replication_cond_->Broadcast();
+    mu_.Unlock();
+    binlogger_->Sync(log_index);
+    mu_.Lock();
+    if (status_ == kLeader) {
+        UpdateCommitIndex(binlogger_->GetLength() - 1);
+    }
+}
+
+bool InsNodeImpl::GetLogTerm(int64_t log_index, int64_t* log_term) {
+    mu_.AssertHeld();
+    if (log_index == snapshot_index_) {
+        *log_term = snapshot_term_;
+        return true;
+    }
+    LogEntry log_entry;
+    if (!binlogger_->ReadSlot(log_index, &log_entry)) {
+        return false;
+    }
+    *log_term = log_entry.term;
+    return true;
+}
+
+// Hold the apply loop between two entries, so that the state machine
+// stays at last_applied_index_ until ResumeApply.
+void InsNodeImpl::PauseApply() {
+    mu_.AssertHeld();
+    apply_pausers_++;
+    while (applying_) {
+        apply_cond_->Wait();
+    }
+}
+
+void InsNodeImpl::ResumeApply() {
+    mu_.AssertHeld();
+    apply_pausers_--;
+    commit_cond_->Signal();
+}
+
+static void GrowPipeline(ReplicationPipeline* pipeline) {
+    int64_t max_entries = std::max(1, FLAGS_log_rep_batch_max);
+    int64_t max_bytes = FLAGS_log_rep_batch_max_size * 1024L * 1024L;
+    pipeline->window = std::min(pipeline->window + 1,
+                                std::max(1, FLAGS_log_rep_window));
+    pipeline->batch_entries = std::min(pipeline->batch_entries
+                                       + std::max(1L, max_entries / 8),
+                                       max_entries);
+    pipeline->batch_bytes = std::min(pipeline->batch_bytes
+                                     + std::max(sRepMinBatchBytes, max_bytes / 16),
+                                     max_bytes);
+}
+
+static void ShrinkPipeline(ReplicationPipeline* pipeline,
+                           const ReplicationBatch& batch) {
+    if (batch.send_time < pipeline->shrink_time) {
+        // the batch was on its way before the last shrink
+        return;
     }
+    pipeline->window = std::max(1, pipeline->window / 2);
+    pipeline->batch_entries = std::max(1L, pipeline->batch_entries / 2);
+    pipeline->batch_bytes = std::max(sRepMinBatchBytes, pipeline->batch_bytes / 2);
+    pipeline->shrink_time = ins_common::timer::get_micros();
 }
 
+// Keep up to log_rep_window AppendEntries in flight to a follower. Batches
+// are sent from pipeline.send_index without waiting for the replies, which
+// come back in AppendEntriesCallback; a rejected batch rewinds the pipeline
+// to next_index_. The thread only quits once its callbacks are all done.
 void InsNodeImpl::ReplicateLog(std::string follower_id) {
     MutexLock lock(&mu_);
-    replicating_.insert(follower_id);
-    bool latest_replicating_ok = true;
-    while (!stop_ && status_ == kLeader) {
-        while (!stop_ && binlogger_->GetLength() <= next_index_[follower_id]) {
-            LOG(DEBUG, "no new log entry for %s", follower_id.c_str());
-            replication_cond_->TimeWait(2000);
-            if (status_ != kLeader) {
+    ReplicationPipeline pipeline;
+    pipeline.batch_entries = std::max(1, FLAGS_log_rep_batch_max / 8);
+    pipeline.batch_bytes = sRepMinBatchBytes;
+    pipelines_[follower_id] = &pipeline;
+    bool has_bad_slot = false;
+    while (!stop_ || pipeline.in_flight > 0) {
+        if (stop_ || status_ != kLeader || has_bad_slot ||
+            !IsFollower(follower_id)) {
+            if (pipeline.in_flight == 0) {
+                LOG(INFO, "stop realicate log to %s", follower_id.c_str());
                 break;
             }
+            replication_cond_->TimeWait(100);
+            continue;
         }
-        if (stop_) {
-            break;
+        if (pipeline.term != current_term_) {
+            // a new term, next_index_ has been reset by StartReplicateLog
+            pipeline.term = current_term_;
+            pipeline.epoch++;
+            pipeline.send_index = next_index_[follower_id];
+            pipeline.retry_time = 0;
         }
-        if (status_ != kLeader) {
-            LOG(INFO, "stop realicate log, no longger leader"); 
-            break;
+        int64_t now = ins_common::timer::get_micros();
+        int64_t send_end = binlogger_->GetAppendedLength();
+        if (pipeline.append_limit >= 0) {
+            send_end = std::min(send_end, pipeline.append_limit + 1);
         }
-        int64_t index = next_index_[follower_id];
-        int64_t cur_term = current_term_;
+        if (pipeline.in_flight >= pipeline.window || now < pipeline.retry_time ||
+            send_end <= pipeline.send_index) {
+            LOG(DEBUG, "no new log entry for %s", follower_id.c_str());
+            int64_t wait_ms = 2000;
+            if (now < pipeline.retry_time) {
+                wait_ms = std::min(wait_ms, (pipeline.retry_time - now) / 1000 + 1);
+            }
+            replication_cond_->TimeWait(wait_ms);
+            continue;
+        }
+        int64_t index = pipeline.send_index;
         int64_t prev_index = index - 1;
         int64_t prev_term = -1;
-        int64_t cur_commit_index = commit_index_;
-        int64_t batch_span = binlogger_->GetLength() - index;
-        batch_span = std::min(batch_span, 
-                              static_cast<int64_t>(FLAGS_log_rep_batch_max));
-        if (!latest_replicating_ok) {
-            batch_span = std::min(1L, batch_span);
+        if (index < binlogger_->GetFirstIndex() ||
+            (prev_index > -1 && !GetLogTerm(prev_index, &prev_term))) {
+            // the slots the follower needs are compacted into the snapshot,
+            // which is sent once the batches in flight are answered
+            if (pipeline.in_flight > 0) {
+                replication_cond_->TimeWait(100);
+                continue;
+            }
+            if (!SendSnapshot(follower_id)) {
+                pipeline.retry_time = ins_common::timer::get_micros()
+                                      + FLAGS_replication_retry_timespan * 1000L;
+            }
+            pipeline.epoch++;
+            pipeline.send_index = next_index_[follower_id];
+            continue;
         }
+        bool use_packed = (packed_followers_.find(follower_id)
+                           != packed_followers_.end());
+        int64_t cur_term = current_term_;
+        int64_t cur_commit_index = commit_index_;
+        int64_t epoch = pipeline.epoch;
+        int64_t batch_span = send_end - index;
+        batch_span = std::min(batch_span, pipeline.batch_entries);
+        int64_t max_size = pipeline.batch_bytes;
         std::string leader_id = self_id_;
-        LogEntry prev_log_entry;
-        if (prev_index > -1) {
-            bool slot_ok = binlogger_->ReadSlot(prev_index, &prev_log_entry);
-            if (!slot_ok) {
-                LOG(FATAL, "bad slot [%ld], can't replicate on %s ", 
-                    prev_index, follower_id.c_str());
-                break;
-            }
-            prev_term = prev_log_entry.term;
-        } 
         mu_.Unlock();
 
         InsNode_Stub* stub;
         int64_t max_term = -1;
         rpc_client_.GetStub(follower_id, &stub);
-        galaxy::ins::AppendEntriesRequest request;
-        galaxy::ins::AppendEntriesResponse response;
-        request.set_term(cur_term);
-        request.set_leader_id(leader_id);
-        request.set_prev_log_index(prev_index);
-        request.set_prev_log_term(prev_term);
-        request.set_leader_commit_index(cur_commit_index);
-        bool has_bad_slot = false;
-        for (int64_t idx = index; idx < (index + batch_span); idx++) {
-            LogEntry log_entry;
-            bool slot_ok = binlogger_->ReadSlot(idx, &log_entry);
-            if (!slot_ok) {
-                LOG(INFO, "bad slot at %ld", idx);
+        galaxy::ins::AppendEntriesRequest* request =
+            new galaxy::ins::AppendEntriesRequest();
+        galaxy::ins::AppendEntriesResponse* response =
+            new galaxy::ins::AppendEntriesResponse();
+        request->set_term(cur_term);
+        request->set_leader_id(leader_id);
+        request->set_prev_log_index(prev_index);
+        request->set_prev_log_term(prev_term);
+        request->set_leader_commit_index(cur_commit_index);
+        bool slot_ok = false;
+        if (use_packed) {
+            // stored records go out as they are, terms never decrease
+            // along the log so the last one is the max
+            slot_ok = binlogger_->ReadRange(index, batch_span, max_size,
+                                            request->mutable_packed_entries(),
+                                            &max_term);
+            batch_span = request->packed_entries_size();
+        } else {
+            slot_ok = binlogger_->ReadRange(index, batch_span, max_size,
+                                            request->mutable_entries());
+            batch_span = request->entries_size();
+            for (int i = 0; i < request->entries_size(); i++) {
+                max_term = std::max(max_term, request->entries(i).term());
+            }
+        }
+        mu_.Lock();
+        if (!slot_ok || batch_span == 0 || epoch != pipeline.epoch ||
+            cur_term != current_term_ || status_ != kLeader) {
+            // the slots were removed by the cleaner meanwhile, or the
+            // pipeline restarted while the batch was read
+            if (!slot_ok && index >= binlogger_->GetFirstIndex()) {
+                LOG(FATAL, "bad slot at %ld, can't replicate on server: %s",
+                    index, follower_id.c_str());
                 has_bad_slot = true;
-                break;
             }
-            galaxy::ins::Entry * entry = request.add_entries();
-            entry->set_term(log_entry.term);
-            entry->set_key(log_entry.key);
-            entry->set_value(log_entry.value);
-            entry->set_op(log_entry.op);
-            entry->set_user(log_entry.user);
-            max_term = std::max(max_term, log_entry.term);
-        }
-        if (has_bad_slot) {
-            LOG(FATAL, "bad slot, can't replicate on server: %s", follower_id.c_str());
-            mu_.Lock();
-            break;
+            delete request;
+            delete response;
+            continue;
         }
-        bool ok = rpc_client_.SendRequest(stub, 
-                                          &InsNode_Stub::AppendEntries,
-                                          &request,
-                                          &response,
-                                          60, 1);
+        ReplicationBatch batch;
+        batch.epoch = epoch;
+        batch.index = index;
+        batch.span = batch_span;
+        batch.max_term = max_term;
+        batch.send_time = ins_common::timer::get_micros();
+        GetContact(follower_id)->last_send_time = batch.send_time;
+        pipeline.send_index = index + batch_span;
+        pipeline.in_flight++;
+        boost::function<void (const ::galaxy::ins::AppendEntriesRequest*,
+                              ::galaxy::ins::AppendEntriesResponse*,
+                              bool, int) > callback;
+        callback = boost::bind(&InsNodeImpl::AppendEntriesCallback, this,
+                               &pipeline, follower_id, batch, _1, _2, _3, _4);
+        mu_.Unlock();
+        rpc_client_.AsyncRequest(stub, &InsNode_Stub::AppendEntries,
+                                 request, response, callback, 60, 1);
         mu_.Lock();
-        mu_.AssertHeld();
-        if (ok && response.current_term() > current_term_) {
-            TransToFollower("InsNodeImpl::ReplicateLog", 
-                            response.current_term());
+    }
+    pipelines_.erase(follower_id);
+    replicating_.erase(follower_id);
+}
+
+void InsNodeImpl::AppendEntriesCallback(ReplicationPipeline* pipeline,
+                                        std::string follower_id,
+                                        ReplicationBatch batch,
+                                        const ::galaxy::ins::AppendEntriesRequest* request,
+                                        ::galaxy::ins::AppendEntriesResponse* response,
+                                        bool failed, int /*error*/) {
+    MutexLock lock(&mu_);
+    boost::scoped_ptr<const galaxy::ins::AppendEntriesRequest> request_ptr(request);
+    boost::scoped_ptr<galaxy::ins::AppendEntriesResponse> response_ptr(response);
+    pipeline->in_flight--;
+    replication_cond_->Broadcast();
+    bool ok = !failed;
+    if (ok && response->current_term() > current_term_) {
+        TransToFollower("InsNodeImpl::ReplicateLog", 
+                        response->current_term());
+    }
+    if (status_ != kLeader || request->term() != current_term_) {
+        return;
+    }
+    // a follower restarted with an older binary must not get packed
+    // entries, so the flag is dropped on rpc errors and relearned
+    if (ok && response->accept_packed_entries()) {
+        packed_followers_.insert(follower_id);
+    } else {
+        packed_followers_.erase(follower_id);
+    }
+    if (ok) {
+        UpdateAppendLimit(follower_id, response);
+        AckContact(follower_id, batch.send_time);
+    }
+    if (ok && response->success()) { // log replicated
+        int64_t last_index = batch.index + batch.span - 1;
+        if (last_index >= next_index_[follower_id]) {
+            next_index_[follower_id] = last_index + 1;
         }
-        if (status_ != kLeader) {
-            LOG(INFO, "stop realicate log, no longger leader"); 
+        if (last_index > match_index_[follower_id]) {
+            match_index_[follower_id] = last_index;
+        }
+        if (batch.max_term == current_term_) {
+            UpdateCommitIndex(last_index);
+        }
+        int64_t rtt = ins_common::timer::get_micros() - batch.send_time;
+        pipeline->rtt = (pipeline->rtt == 0) ? rtt : (pipeline->rtt * 7 + rtt) / 8;
+        if (rtt > FLAGS_log_rep_rtt_target * 1000L) {
+            ShrinkPipeline(pipeline, batch);
+        } else {
+            GrowPipeline(pipeline);
+        }
+        return;
+    }
+    if (batch.epoch != pipeline->epoch) {
+        // sent before the pipeline restarted, nothing new to learn
+        return;
+    }
+    int64_t now = ins_common::timer::get_micros();
+    if (!ok) { //rpc error;
+        LOG(WARNING, "faild to send replicate-rpc to %s ", 
+            follower_id.c_str());
+        pipeline->retry_time = now + FLAGS_replication_retry_timespan * 1000L;
+        ShrinkPipeline(pipeline, batch);
+    } else if (response->is_busy()) {
+        LOG(WARNING, "delay replicate-rpc to %s , [busy]", 
+            follower_id.c_str());
+        if (response->has_append_limit()) {
+            // the follower went back, e.g. restarted, resend within its limit
+            pipeline->append_limit = response->append_limit();
+        } else {
+            pipeline->retry_time = now + FLAGS_replication_retry_timespan * 1000L;
+        }
+        ShrinkPipeline(pipeline, batch);
+    } else { // (index, term ) miss match
+        next_index_[follower_id] = std::min(batch.index - 1,
+                                            response->log_length());
+        if (next_index_[follower_id] < 0 ){
+            next_index_[follower_id] = 0;
+        }
+        LOG(INFO, "adjust next_index of %s to %ld",
+            follower_id.c_str(), 
+            next_index_[follower_id]);
+    }
+    pipeline->epoch++;
+    pipeline->send_index = next_index_[follower_id];
+}
+
+// Stream the latest snapshot to a follower whose next slot has been
+// removed from the binlog. mu_ is released while sending.
+bool InsNodeImpl::SendSnapshot(const std::string& follower_id) {
+    mu_.AssertHeld();
+    int64_t cur_term = current_term_;
+    std::string leader_id = self_id_;
+    mu_.Unlock();
+    std::string file_name = snapshot_dir_ + "/" + snapshot_file_name;
+    // the open file stays readable even if a newer snapshot replaces it
+    SnapshotReader reader(file_name);
+    SnapshotMeta meta;
+    bool ok = reader.Open(&meta);
+    if (!ok) {
+        LOG(WARNING, "[snapshot] no snapshot to send to %s", follower_id.c_str());
+    } else {
+        LOG(INFO, "[snapshot] send snapshot at %ld to %s, %ld bytes",
+            meta.last_included_index(), follower_id.c_str(), reader.file_size());
+    }
+    InsNode_Stub* stub;
+    rpc_client_.GetStub(follower_id, &stub);
+    int64_t chunk_size = FLAGS_ins_snapshot_chunk_size * 1024L;
+    int64_t offset = 0;
+    bool finished = false;
+    galaxy::ins::InstallSnapshotResponse response;
+    while (ok && !finished) {
+        galaxy::ins::InstallSnapshotRequest request;
+        request.set_term(cur_term);
+        request.set_leader_id(leader_id);
+        request.set_last_included_index(meta.last_included_index());
+        request.set_last_included_term(meta.last_included_term());
+        request.set_offset(offset);
+        int64_t size = std::min(chunk_size, reader.file_size() - offset);
+        if (!reader.ReadChunk(offset, size, request.mutable_data())) {
+            LOG(WARNING, "[snapshot] failed to read %s at %ld",
+                file_name.c_str(), offset);
+            ok = false;
             break;
         }
-        if (ok) {
-            if (response.success()) { // log replicated
-                next_index_[follower_id] = index + batch_span;
-                match_index_[follower_id] = index + batch_span - 1;
-                if (max_term == current_term_) {
-                    UpdateCommitIndex(index + batch_span - 1);
-                }
-                latest_replicating_ok = true;
-            } else if (response.is_busy()) {
-                mu_.Unlock();
-                LOG(FATAL, "delay replicate-rpc to %s , [busy]", 
-                    follower_id.c_str());
-                ThisThread::Sleep(FLAGS_replication_retry_timespan);
-                latest_replicating_ok = true;
-                mu_.Lock();
-            } else { // (index, term ) miss match
-                next_index_[follower_id] = std::min(next_index_[follower_id] - 1,
-                                                    response.log_length());
-                LOG(INFO, "adjust next_index of %s to %ld",
-                    follower_id.c_str(), 
-                    next_index_[follower_id]);
-                if (next_index_[follower_id] < 0 ){
-                    next_index_[follower_id] = 0;
-                }
-            }
-        } else { //rpc error;
-            mu_.Unlock();
-            LOG(FATAL, "faild to send replicate-rpc to %s ", 
-                follower_id.c_str());
-            ThisThread::Sleep(FLAGS_replication_retry_timespan);
-            latest_replicating_ok = false;
-            mu_.Lock();
+        request.set_done(offset + size == reader.file_size());
+        ok = rpc_client_.SendRequest(stub,
+                                     &InsNode_Stub::InstallSnapshot,
+                                     &request,
+                                     &response,
+                                     60, 1);
+        if (!ok || !response.success()) {
+            LOG(WARNING, "[snapshot] failed to send snapshot to %s at %ld",
+                follower_id.c_str(), offset);
+            break;
         }
+        offset += size;
+        finished = request.done();
     }
-    replicating_.erase(follower_id);
+    mu_.Lock();
+    if (ok && response.current_term() > current_term_) {
+        TransToFollower("InsNodeImpl::SendSnapshot", response.current_term());
+    }
+    if (!finished || status_ != kLeader) {
+        return false;
+    }
+    next_index_[follower_id] = meta.last_included_index() + 1;
+    match_index_[follower_id] = meta.last_included_index();
+    snapshot_sent_count_++;
+    LOG(INFO, "[snapshot] %s installed snapshot at %ld",
+        follower_id.c_str(), meta.last_included_index());
+    return true;
 }
 
 void InsNodeImpl::Get(::google::protobuf::RpcController* controller,
@@ -962,7 +2286,8 @@ void InsNodeImpl::Get(::google::protobuf::RpcController* controller,
     SampleAccessLog(controller, "Get");
     perform_.Get();
     MutexLock lock(&mu_);
-    if (status_ == kFollower) {
+    if (status_ == kFollower && (request->read_mode() == kReadOnLeader
+                                 || current_leader_.empty())) {
         response->set_hit(false);
         response->set_leader_id(current_leader_);
         response->set_success(false);
@@ -997,73 +2322,52 @@ void InsNodeImpl::Get(::google::protobuf::RpcController* controller,
         return;
     }
 
-    int64_t now_timestamp = ins_common::timer::get_micros();
-    if (members_.size() > 1
-        && (now_timestamp - heartbeat_read_timestamp_) > 
-              1000 * FLAGS_elect_timeout_min) {
-        LOG(DEBUG, "broadcast for read");
+    if (status_ == kFollower) {
+        follower_read_count_++;
+        if (request->read_mode() == kReadBoundedStale) {
+            if (!CanReadStale()) {
+                response->set_hit(false);
+                response->set_leader_id(current_leader_);
+                response->set_success(false);
+                done->Run();
+                return;
+            }
+            local_readers_++;
+            mu_.Unlock();
+            ReadLocal(request, response);
+            done->Run();
+            mu_.Lock();
+            EndLocalRead();
+            return;
+        }
+        ClientReadAck::Ptr context(new ClientReadAck());
+        context->request = request;
+        context->response = response;
+        context->done = done;
+        RequestReadIndex(context);
+        return;
+    }
+
+    if (NeedReadConfirm() || snapshot_installing_) {
+        quorum_read_count_++;
+        // reads arriving while a round is in flight share the next one
         ClientReadAck::Ptr context(new ClientReadAck());
         context->request = request;
         context->response = response;
         context->done = done;
-        context->succ_count = 1;//self Get success;
-        std::vector<std::string>::iterator it = members_.begin();
-        boost::function<void (const ::galaxy::ins::AppendEntriesRequest*,
-                              ::galaxy::ins::AppendEntriesResponse*,
-                              bool, int) > callback;
-        callback = boost::bind(&InsNodeImpl::HeartBeatForReadCallback, this,
-                               _1, _2, _3, _4, context);
-        for(; it!= members_.end(); it++) { // make sure I am still leader
-            if (*it == self_id_) {
-                continue;
-            }
-            InsNode_Stub* stub;
-            rpc_client_.GetStub(*it, &stub);
-            ::galaxy::ins::AppendEntriesRequest* request = 
-                        new ::galaxy::ins::AppendEntriesRequest();
-            ::galaxy::ins::AppendEntriesResponse* response =
-                        new ::galaxy::ins::AppendEntriesResponse();
-            request->set_term(current_term_);
-            request->set_leader_id(self_id_);
-            request->set_leader_commit_index(commit_index_);
-            rpc_client_.AsyncRequest(stub, &InsNode_Stub::AppendEntries, 
-                                     request, response, callback, 2, 1);
+        context->read_index = commit_index_;
+        pending_reads_.push_back(context);
+        if (!read_confirming_) {
+            StartReadConfirm();
         }
     } else {
+        lease_read_count_++;
+        local_readers_++;
         mu_.Unlock();
-        std::string key = request->key();
-        Status s;
-        std::string value;
-        s = data_store_->Get(user_manager_->GetUsernameFromUuid(uuid), key, &value);
-        std::string real_value;
-        LogOperation op;
-        ParseValue(value, op, real_value);
-        if (s == kOk) {
-            if (op == kLock) {
-                if (IsExpiredSession(real_value)) {
-                    response->set_hit(false);
-                    response->set_success(true);
-                    response->set_leader_id("");
-                } else {
-                    response->set_hit(true);
-                    response->set_success(true);
-                    response->set_value(real_value);
-                    response->set_leader_id("");
-                }
-            } else {
-                response->set_hit(true);
-                response->set_success(true);
-                response->set_value(real_value);
-                //LOG(INFO, "get value: %s", real_value.c_str());
-                response->set_leader_id("");
-            }
-        } else {
-            response->set_hit(false);
-            response->set_success(true);
-            response->set_leader_id("");
-        }
+        ReadLocal(request, response);
         done->Run();
         mu_.Lock();
+        EndLocalRead();
     }
 }
 
@@ -1081,7 +2385,9 @@ void InsNodeImpl::Delete(::google::protobuf::RpcController* controller,
         return;
     }
 
-    if (status_ == kCandidate) {
+    // refused during a leadership handover too, the client retries until
+    // the new leader is known
+    if (status_ == kCandidate || !transfer_target_.empty()) {
         response->set_success(false);
         response->set_leader_id("");
         done->Run();
@@ -1105,15 +2411,13 @@ void InsNodeImpl::Delete(::google::protobuf::RpcController* controller,
     log_entry.value = "";
     log_entry.term = current_term_;
     log_entry.op = kDel;
-    binlogger_->AppendEntry(log_entry);
-    int64_t cur_index = binlogger_->GetLength() - 1;
-    ClientAck& ack = client_ack_[cur_index];
+    int64_t cur_index = binlogger_->AppendEntryAsync(log_entry);
+    ClientAck ack;
     ack.done = done;
     ack.del_response = response;
-    replication_cond_->Broadcast();
-    if (single_node_mode_) { //single node cluster
-        UpdateCommitIndex(binlogger_->GetLength() - 1);
-    }
+    ack.term = log_entry.term;
+    client_ack_.Add(cur_index, ack);
+    WaitLogDurable(cur_index);
     return;
 }
 
@@ -1131,15 +2435,15 @@ void InsNodeImpl::Put(::google::protobuf::RpcController* controller,
         return;
     }
 
-    if (status_ == kCandidate) {
+    if (status_ == kCandidate || !transfer_target_.empty()) {
         response->set_success(false);
         response->set_leader_id("");
         done->Run();
         return;
     }
 
-    if (client_ack_.size() > static_cast<size_t>(FLAGS_max_write_pending)) {
-        LOG(WARNING, "write pending size: %d", client_ack_.size());
+    if (client_ack_.Size() > FLAGS_max_write_pending) {
+        LOG(WARNING, "write pending size: %ld", client_ack_.Size());
         response->set_success(false);
         response->set_leader_id("");
         done->Run();
@@ -1164,15 +2468,13 @@ void InsNodeImpl::Put(::google::protobuf::RpcController* controller,
     log_entry.value = value;
     log_entry.term = current_term_;
     log_entry.op = kPut;
-    binlogger_->AppendEntry(log_entry);
-    int64_t cur_index = binlogger_->GetLength() - 1;
-    ClientAck& ack = client_ack_[cur_index];
+    int64_t cur_index = binlogger_->AppendEntryAsync(log_entry);
+    ClientAck ack;
     ack.done = done;
     ack.response = response;
-    replication_cond_->Broadcast();
-    if (single_node_mode_) { //single node cluster
-        UpdateCommitIndex(binlogger_->GetLength() - 1);
-    }
+    ack.term = log_entry.term;
+    client_ack_.Add(cur_index, ack);
+    WaitLogDurable(cur_index);
     return;
 }
 
@@ -1227,7 +2529,7 @@ void InsNodeImpl::Lock(::google::protobuf::RpcController* controller,
         return;
     }
 
-    if (status_ == kCandidate) {
+    if (status_ == kCandidate || !transfer_target_.empty()) {
         response->set_success(false);
         response->set_leader_id("");
         done->Run();
@@ -1281,15 +2583,13 @@ void InsNodeImpl::Lock(::google::protobuf::RpcController* controller,
         type_and_value.append(session_id);
         Status st = data_store_->Put(user, key, type_and_value);
         assert(st == kOk);
-        binlogger_->AppendEntry(log_entry);
-        int64_t cur_index = binlogger_->GetLength() - 1;
-        ClientAck& ack = client_ack_[cur_index];
+        int64_t cur_index = binlogger_->AppendEntryAsync(log_entry);
+        ClientAck ack;
         ack.done = done;
         ack.lock_response = response;
-        replication_cond_->Broadcast();
-        if (single_node_mode_) { //single node cluster
-            UpdateCommitIndex(binlogger_->GetLength() - 1);
-        }
+        ack.term = log_entry.term;
+        client_ack_.Add(cur_index, ack);
+        WaitLogDurable(cur_index);
     } else {
         LOG(DEBUG, "the lock %s is hold by another session",
             key.c_str());
@@ -1309,7 +2609,8 @@ void InsNodeImpl::Scan(::google::protobuf::RpcController* controller,
     const std::string& uuid = request->uuid();
     {
         MutexLock lock(&mu_);
-        if (status_ == kFollower) {
+        if (status_ == kFollower && (request->read_mode() == kReadOnLeader
+                                     || current_leader_.empty())) {
             response->set_leader_id(current_leader_);
             response->set_success(false);
             done->Run();
@@ -1348,18 +2649,54 @@ void InsNodeImpl::Scan(::google::protobuf::RpcController* controller,
             done->Run();
             return;
         }
+
+        if (status_ == kFollower) {
+            follower_read_count_++;
+            if (request->read_mode() == kReadBoundedStale) {
+                if (!CanReadStale()) {
+                    response->set_leader_id(current_leader_);
+                    response->set_success(false);
+                    done->Run();
+                    return;
+                }
+            } else {
+                ClientReadAck::Ptr context(new ClientReadAck());
+                context->scan_request = request;
+                context->scan_response = response;
+                context->done = done;
+                RequestReadIndex(context);
+                return;
+            }
+        }
+
+        if (snapshot_installing_) {
+            response->set_leader_id(current_leader_);
+            response->set_success(false);
+            done->Run();
+            return;
+        }
+        local_readers_++;
     }
 
+    ScanLocal(request, response);
+    done->Run();
+    MutexLock lock(&mu_);
+    EndLocalRead();
+}
+
+void InsNodeImpl::ScanLocal(const ::galaxy::ins::ScanRequest* request,
+                            ::galaxy::ins::ScanResponse* response) {
+    const std::string& uuid = request->uuid();
     const std::string& start_key = request->start_key();
     const std::string& end_key = request->end_key();
     int32_t size_limit = request->size_limit();
-    StorageManager::Iterator* it = data_store_->NewIterator(
-            user_manager_->GetUsernameFromUuid(uuid));
+    const std::string user = user_manager_->GetUsernameFromUuid(uuid);
+    StorageManager::Iterator* it = data_store_->NewIterator(user);
+    // the node keeps its own keys in the anonymous database
+    bool skip_tags = (user == StorageManager::anonymous_user);
     if (it == NULL) {
         response->set_uuid_expired(true);
         response->set_success(true);
-        done->Run();
-        mu_.Lock();
         return;
     }
     bool has_more = false;
@@ -1376,7 +2713,8 @@ void InsNodeImpl::Scan(::google::protobuf::RpcController* controller,
             has_more = true;
             break;
         }
-        if (it->key() == tag_last_applied_index) {
+        if (skip_tags && (it->key() == tag_last_applied_index ||
+                          it->key() == tag_membership)) {
             continue;
         }
         const std::string& value = it->value();
@@ -1401,8 +2739,6 @@ void InsNodeImpl::Scan(::google::protobuf::RpcController* controller,
     delete it;
     response->set_has_more(has_more);
     response->set_success(true);
-    done->Run();
-    return;
 }
 
 void InsNodeImpl::KeepAlive(::google::protobuf::RpcController* controller,
@@ -1466,13 +2802,8 @@ void InsNodeImpl::ForwardKeepAlive(const ::galaxy::ins::KeepAliveRequest * reque
         if (status_ != kLeader) {
             return;
         }
-        std::vector<std::string>::iterator it = members_.begin();
-        for(; it!= members_.end(); it++) {
-            if (*it == self_id_) {
-                continue;
-            }
-            followers.push_back(*it);
-        }
+        // learners get the sessions too, they may be promoted later
+        GetFollowers(&followers);
     }
     std::vector<std::string>::iterator it;
     for (it = followers.begin(); it != followers.end(); it++) {
@@ -1557,6 +2888,7 @@ void InsNodeImpl::RemoveExpiredSessions() {
     }
 
     if (cur_status == kLeader) {
+        int64_t last_index = -1;
         for (size_t i = 0; i < unlock_keys.size(); i++){
             const std::string& key = unlock_keys[i].first;
             const std::string& session_id = unlock_keys[i].second.session_id;
@@ -1567,7 +2899,7 @@ void InsNodeImpl::RemoveExpiredSessions() {
             log_entry.value = session_id;
             log_entry.term = cur_term;
             log_entry.op = kUnLock;
-            binlogger_->AppendEntry(log_entry);
+            last_index = binlogger_->AppendEntryAsync(log_entry);
         }
         for (std::vector<Session>::iterator it = expired_sessions.begin();
              it != expired_sessions.end(); ++it) {
@@ -1577,11 +2909,15 @@ void InsNodeImpl::RemoveExpiredSessions() {
                 log_entry.user = uuid;
                 log_entry.term = cur_term;
                 log_entry.op = kLogout;
-                binlogger_->AppendEntry(log_entry);
+                last_index = binlogger_->AppendEntryAsync(log_entry);
             }
         }
-        if (single_node_mode_) { //single node cluster
-            MutexLock lock(&mu_);
+        if (last_index >= 0) {
+            binlogger_->Sync(last_index);
+        }
+        MutexLock lock(&mu_);
+        replication_cond_->Broadcast();
+        if (status_ == kLeader) {
             UpdateCommitIndex(binlogger_->GetLength() - 1);
         }
     }
@@ -1627,13 +2963,14 @@ bool InsNodeImpl::GetParentKey(const std::string& key, std::string* parent_key)
 
 void InsNodeImpl::TouchParentKey(const std::string& user, const std::string& key,
                                  const std::string& changed_session,
-                                 const std::string& action) {
+                                 const std::string& action,
+                                 StorageManager::Batch* writes) {
     std::string parent_key;
     if (GetParentKey(key, &parent_key)) {
         std::string type_and_value;
         type_and_value.append(1, kPut);
         type_and_value.append(action + "," + changed_session);
-        data_store_->Put(user, parent_key, type_and_value);
+        writes->Put(user, parent_key, type_and_value);
     }
 }
 
@@ -1840,7 +3177,7 @@ void InsNodeImpl::UnLock(::google::protobuf::RpcController* controller,
         return;
     }
 
-    if (status_ == kCandidate) {
+    if (status_ == kCandidate || !transfer_target_.empty()) {
         response->set_success(false);
         response->set_leader_id("");
         done->Run();
@@ -1865,15 +3202,13 @@ void InsNodeImpl::UnLock(::google::protobuf::RpcController* controller,
     log_entry.value = session_id;
     log_entry.term = current_term_;
     log_entry.op = kUnLock;
-    binlogger_->AppendEntry(log_entry);
-    int64_t cur_index = binlogger_->GetLength() - 1;
-    ClientAck& ack = client_ack_[cur_index];
+    int64_t cur_index = binlogger_->AppendEntryAsync(log_entry);
+    ClientAck ack;
     ack.done = done;
     ack.unlock_response = response;
-    replication_cond_->Broadcast();
-    if (single_node_mode_) { //single node cluster
-        UpdateCommitIndex(binlogger_->GetLength() - 1);
-    }
+    ack.term = log_entry.term;
+    client_ack_.Add(cur_index, ack);
+    WaitLogDurable(cur_index);
     return;
 }
 
@@ -1889,7 +3224,7 @@ void InsNodeImpl::Login(::google::protobuf::RpcController* /*controller*/,
         return;
     }
 
-    if (status_ == kCandidate) {
+    if (status_ == kCandidate || !transfer_target_.empty()) {
         response->set_status(kError);
         response->set_leader_id("");
         done->Run();
@@ -1913,15 +3248,13 @@ void InsNodeImpl::Login(::google::protobuf::RpcController* /*controller*/,
     log_entry.value = passwd;
     log_entry.term = current_term_;
     log_entry.op = kLogin;
-    binlogger_->AppendEntry(log_entry);
-    int64_t cur_index = binlogger_->GetLength() - 1;
-    ClientAck& ack = client_ack_[cur_index];
+    int64_t cur_index = binlogger_->AppendEntryAsync(log_entry);
+    ClientAck ack;
     ack.done = done;
     ack.login_response = response;
-    replication_cond_->Broadcast();
-    if (single_node_mode_) {
-        UpdateCommitIndex(binlogger_->GetLength() - 1);
-    }
+    ack.term = log_entry.term;
+    client_ack_.Add(cur_index, ack);
+    WaitLogDurable(cur_index);
     return;
 }
 
@@ -1937,7 +3270,7 @@ void InsNodeImpl::Logout(::google::protobuf::RpcController* /*controller*/,
         return;
     }
 
-    if (status_ == kCandidate) {
+    if (status_ == kCandidate || !transfer_target_.empty()) {
         response->set_status(kError);
         response->set_leader_id("");
         done->Run();
@@ -1957,15 +3290,13 @@ void InsNodeImpl::Logout(::google::protobuf::RpcController* /*controller*/,
     log_entry.user = uuid;
     log_entry.term = current_term_;
     log_entry.op = kLogout;
-    binlogger_->AppendEntry(log_entry);
-    int64_t cur_index = binlogger_->GetLength() - 1;
-    ClientAck& ack = client_ack_[cur_index];
+    int64_t cur_index = binlogger_->AppendEntryAsync(log_entry);
+    ClientAck ack;
     ack.done = done;
     ack.logout_response = response;
-    replication_cond_->Broadcast();
-    if (single_node_mode_) {
-        UpdateCommitIndex(binlogger_->GetLength() - 1);
-    }
+    ack.term = log_entry.term;
+    client_ack_.Add(cur_index, ack);
+    WaitLogDurable(cur_index);
     return;
 }
 
@@ -1981,7 +3312,7 @@ void InsNodeImpl::Register(::google::protobuf::RpcController* /*controller*/,
         return;
     }
 
-    if (status_ == kCandidate) {
+    if (status_ == kCandidate || !transfer_target_.empty()) {
         response->set_status(kError);
         response->set_leader_id("");
         done->Run();
@@ -1996,15 +3327,13 @@ void InsNodeImpl::Register(::google::protobuf::RpcController* /*controller*/,
     log_entry.value = password;
     log_entry.term = current_term_;
     log_entry.op = kRegister;
-    binlogger_->AppendEntry(log_entry);
-    int64_t cur_index = binlogger_->GetLength() - 1;
-    ClientAck& ack = client_ack_[cur_index];
+    int64_t cur_index = binlogger_->AppendEntryAsync(log_entry);
+    ClientAck ack;
     ack.done = done;
     ack.register_response = response;
-    replication_cond_->Broadcast();
-    if (single_node_mode_) {
-        UpdateCommitIndex(binlogger_->GetLength() - 1);
-    }
+    ack.term = log_entry.term;
+    client_ack_.Add(cur_index, ack);
+    WaitLogDurable(cur_index);
     return;
 }
 
@@ -2020,10 +3349,12 @@ void InsNodeImpl::CleanBinlog(::google::protobuf::RpcController* /*controller*/,
     int64_t del_end_index = request->end_index();
     {
         MutexLock lock(&mu_);
-        if (last_applied_index_ < del_end_index) {
+        // slots after the snapshot are still needed by lagging followers
+        if (last_applied_index_ < del_end_index ||
+            snapshot_index_ + 1 < del_end_index) {
             response->set_success(false);
-            LOG(FATAL, "del log  %ld > %ld is unsafe", 
-                del_end_index, last_applied_index_);
+            LOG(FATAL, "del log  %ld > %ld is unsafe, snapshot at %ld", 
+                del_end_index, last_applied_index_, snapshot_index_);
             done->Run();
             return;
         }
@@ -2035,6 +3366,13 @@ void InsNodeImpl::CleanBinlog(::google::protobuf::RpcController* /*controller*/,
     done->Run();
 }
 
+static void AddMetric(::galaxy::ins::RpcStatResponse* response,
+                      const char* name, int64_t value) {
+    MetricInfo* metric = response->add_metrics();
+    metric->set_name(name);
+    metric->set_value(value);
+}
+
 void InsNodeImpl::RpcStat(::google::protobuf::RpcController* /*controller*/,
                           const ::galaxy::ins::RpcStatRequest* request,
                           ::galaxy::ins::RpcStatResponse* response,
@@ -2090,69 +3428,513 @@ void InsNodeImpl::RpcStat(::google::protobuf::RpcController* /*controller*/,
         stat->set_current_stat(current_stat);
         stat->set_average_stat(average_stat);
     }
-    response->set_status(status_);
+    int64_t cache_hits = 0;
+    int64_t cache_misses = 0;
+    binlogger_->GetCacheStat(&cache_hits, &cache_misses);
+    AddMetric(response, "binlog_cache_hit", cache_hits);
+    AddMetric(response, "binlog_cache_miss", cache_misses);
+    int64_t reclaimed_bytes = 0;
+    int64_t reclaim_pending_bytes = 0;
+    binlogger_->GetReclaimStat(&reclaimed_bytes, &reclaim_pending_bytes);
+    AddMetric(response, "binlog_reclaimed_bytes", reclaimed_bytes);
+    AddMetric(response, "binlog_reclaim_pending_bytes", reclaim_pending_bytes);
+    {
+        MutexLock lock(&mu_);
+        AddMetric(response, "snapshot_index", snapshot_index_);
+        AddMetric(response, "snapshot_sent", snapshot_sent_count_);
+        AddMetric(response, "snapshot_installed", snapshot_installed_count_);
+        AddMetric(response, "read_lease", lease_read_count_);
+        AddMetric(response, "read_quorum", quorum_read_count_);
+        AddMetric(response, "read_follower", follower_read_count_);
+        AddMetric(response, "heartbeat_sent", heartbeat_sent_count_);
+        AddMetric(response, "heartbeat_avoided", heartbeat_avoided_count_);
+        std::map<std::string, ReplicationPipeline*>::iterator it;
+        for (it = pipelines_.begin(); it != pipelines_.end(); ++it) {
+            const ReplicationPipeline* pipeline = it->second;
+            AddMetric(response, ("rep_window@" + it->first).c_str(),
+                      pipeline->window);
+            AddMetric(response, ("rep_batch_entries@" + it->first).c_str(),
+                      pipeline->batch_entries);
+            AddMetric(response, ("rep_batch_bytes@" + it->first).c_str(),
+                      pipeline->batch_bytes);
+            AddMetric(response, ("rep_rtt_us@" + it->first).c_str(),
+                      pipeline->rtt);
+            AddMetric(response, ("rep_append_limit@" + it->first).c_str(),
+                      pipeline->append_limit);
+        }
+        response->set_status(ReportedStatus());
+    }
+    done->Run();
+}
+
+void InsNodeImpl::ReadIndex(::google::protobuf::RpcController* /*controller*/,
+                            const ::galaxy::ins::ReadIndexRequest* /*request*/,
+                            ::galaxy::ins::ReadIndexResponse* response,
+                            ::google::protobuf::Closure* done) {
+    MutexLock lock(&mu_);
+    if (status_ != kLeader || in_safe_mode_) {
+        response->set_success(false);
+        response->set_leader_id(status_ == kFollower ? current_leader_ : "");
+        done->Run();
+        return;
+    }
+    if (!NeedReadConfirm()) {
+        response->set_success(true);
+        response->set_read_index(commit_index_);
+        done->Run();
+        return;
+    }
+    // shares the confirm rounds of the reads on the leader
+    ClientReadAck::Ptr context(new ClientReadAck());
+    context->index_response = response;
+    context->done = done;
+    context->read_index = commit_index_;
+    pending_reads_.push_back(context);
+    if (!read_confirming_) {
+        StartReadConfirm();
+    }
+}
+
+void InsNodeImpl::TransferLeadership(::google::protobuf::RpcController* /*controller*/,
+                                     const ::galaxy::ins::TransferLeadershipRequest* request,
+                                     ::galaxy::ins::TransferLeadershipResponse* response,
+                                     ::google::protobuf::Closure* done) {
+    MutexLock lock(&mu_);
+    if (status_ != kLeader) {
+        response->set_success(false);
+        response->set_leader_id(status_ == kFollower ? current_leader_ : "");
+        done->Run();
+        return;
+    }
+    const std::string& target_id = request->target_id();
+    if (target_id == self_id_) {
+        response->set_success(true);
+        response->set_leader_id(self_id_);
+        done->Run();
+        return;
+    }
+    if (!transfer_target_.empty() || membership_changing_ ||
+        std::find(members_.begin(), members_.end(), target_id) == members_.end()) {
+        LOG(WARNING, "refuse to transfer leadership to %s", target_id.c_str());
+        response->set_success(false);
+        response->set_leader_id(self_id_);
+        done->Run();
+        return;
+    }
+    LOG(INFO, "transfer leadership to %s, term %ld",
+        target_id.c_str(), current_term_);
+    transfer_target_ = target_id;
+    lease_expire_timestamp_ = 0;
+    transfer_worker_.AddTask(boost::bind(&InsNodeImpl::DoTransferLeadership,
+                                         this, target_id, current_term_,
+                                         response, done));
+}
+
+// No write is taken after TransferLeadership, so the target catches up to
+// a fixed end of the log. It is then told to start an election at once,
+// and the writes are refused until it deposes this node, or for an
+// election timeout if it never does.
+void InsNodeImpl::DoTransferLeadership(std::string target_id, int64_t term,
+                                       ::galaxy::ins::TransferLeadershipResponse* response,
+                                       ::google::protobuf::Closure* done) {
+    MutexLock lock(&mu_);
+    int64_t deadline = ins_common::timer::get_micros()
+                       + FLAGS_leader_transfer_timeout * 1000L;
+    bool caught_up = false;
+    while (!stop_ && status_ == kLeader && current_term_ == term &&
+           ins_common::timer::get_micros() < deadline) {
+        if (match_index_[target_id] >= binlogger_->GetAppendedLength() - 1) {
+            caught_up = true;
+            break;
+        }
+        replication_cond_->TimeWait(10);
+    }
+    bool success = false;
+    if (caught_up && status_ == kLeader && current_term_ == term) {
+        InsNode_Stub* stub;
+        rpc_client_.GetStub(target_id, &stub);
+        ::galaxy::ins::TimeoutNowRequest timeout_request;
+        ::galaxy::ins::TimeoutNowResponse timeout_response;
+        timeout_request.set_term(term);
+        timeout_request.set_leader_id(self_id_);
+        mu_.Unlock();
+        bool ok = rpc_client_.SendRequest(stub, &InsNode_Stub::TimeoutNow,
+                                          &timeout_request, &timeout_response,
+                                          1, 1);
+        mu_.Lock();
+        if (ok && timeout_response.success()) {
+            deadline = ins_common::timer::get_micros()
+                       + FLAGS_elect_timeout_max * 1000L;
+            while (!stop_ && status_ == kLeader && current_term_ == term &&
+                   ins_common::timer::get_micros() < deadline) {
+                replication_cond_->TimeWait(10);
+            }
+            success = (current_term_ != term || status_ != kLeader);
+        }
+    }
+    if (success) {
+        LOG(INFO, "leadership transferred to %s", target_id.c_str());
+    } else {
+        LOG(WARNING, "failed to transfer leadership to %s, caught up: %s",
+            target_id.c_str(), caught_up ? "true" : "false");
+    }
+    transfer_target_.clear();
+    response->set_success(success);
+    response->set_leader_id(success ? target_id : self_id_);
+    done->Run();
+}
+
+void InsNodeImpl::TimeoutNow(::google::protobuf::RpcController* /*controller*/,
+                             const ::galaxy::ins::TimeoutNowRequest* request,
+                             ::galaxy::ins::TimeoutNowResponse* response,
+                             ::google::protobuf::Closure* done) {
+    MutexLock lock(&mu_);
+    response->set_current_term(current_term_);
+    if (status_ != kFollower || !IsVoter(self_id_) || request->term() != current_term_ ||
+        request->leader_id() != current_leader_) {
+        response->set_success(false);
+        done->Run();
+        return;
+    }
+    LOG(INFO, "%s hands over the leadership, start election now",
+        request->leader_id().c_str());
+    response->set_success(true);
     done->Run();
+    StartElection(true);
+}
+
+static void RemoveId(const std::string& server_id,
+                     ::google::protobuf::RepeatedPtrField<std::string>* ids) {
+    for (int i = 0; i < ids->size(); i++) {
+        if (ids->Get(i) == server_id) {
+            ids->DeleteSubrange(i, 1);
+            return;
+        }
+    }
+}
+
+void InsNodeImpl::ChangeMembership(::google::protobuf::RpcController* /*controller*/,
+                                   const ::galaxy::ins::ChangeMembershipRequest* request,
+                                   ::galaxy::ins::ChangeMembershipResponse* response,
+                                   ::google::protobuf::Closure* done) {
+    MutexLock lock(&mu_);
+    if (status_ != kLeader) {
+        response->set_success(false);
+        response->set_leader_id(status_ == kFollower ? current_leader_ : "");
+        done->Run();
+        return;
+    }
+    // a new leader first commits an entry of its own term, so that no
+    // change of an earlier leader is still on its way
+    const std::string& server_id = request->server_id();
+    if (in_safe_mode_ || membership_changing_ || !old_members_.empty() ||
+        !transfer_target_.empty() || server_id.empty()) {
+        LOG(WARNING, "refuse to change membership of %s", server_id.c_str());
+        response->set_success(false);
+        response->set_leader_id(self_id_);
+        done->Run();
+        return;
+    }
+    Membership membership;
+    membership.mutable_members()->CopyFrom(memberships_.rbegin()->second.members());
+    membership.mutable_learners()->CopyFrom(memberships_.rbegin()->second.learners());
+    RemoveId(server_id, membership.mutable_members());
+    RemoveId(server_id, membership.mutable_learners());
+    if (request->action() == kAddMember) {
+        membership.add_members(server_id);
+    } else if (request->action() == kAddLearner) {
+        membership.add_learners(server_id);
+    }
+    if (membership.members_size() == 0 ||
+        membership.members_size() + membership.learners_size()
+            > FLAGS_max_cluster_size) {
+        LOG(WARNING, "refuse to change membership of %s, %d members, %d learners",
+            server_id.c_str(), membership.members_size(), membership.learners_size());
+        response->set_success(false);
+        response->set_leader_id(self_id_);
+        done->Run();
+        return;
+    }
+    std::set<std::string> old_voters(members_.begin(), members_.end());
+    std::set<std::string> new_voters(membership.members().begin(),
+                                     membership.members().end());
+    if (old_voters != new_voters) {
+        // both the old and the new members decide until the new ones
+        // take over alone
+        membership.mutable_old_members()->CopyFrom(
+            memberships_.rbegin()->second.members());
+    }
+    LOG(INFO, "change membership, action: %d, server: %s",
+        static_cast<int>(request->action()), server_id.c_str());
+    int64_t index = AppendMembershipEntry(membership);
+    membership_changing_ = true;
+    membership_worker_.AddTask(
+        boost::bind(&InsNodeImpl::FinishMembershipChange, this,
+                    index, current_term_, response, done));
+    WaitLogDurable(index);
+}
+
+int64_t InsNodeImpl::AppendMembershipEntry(const Membership& membership) {
+    mu_.AssertHeld();
+    LogEntry log_entry;
+    log_entry.key = "Membership";
+    membership.SerializeToString(&log_entry.value);
+    log_entry.term = current_term_;
+    log_entry.op = kMembership;
+    int64_t index = binlogger_->AppendEntryAsync(log_entry);
+    AppendMembership(index, log_entry.value);
+    return index;
+}
+
+bool InsNodeImpl::WaitCommitted(int64_t log_index, int64_t term) {
+    mu_.AssertHeld();
+    while (!stop_ && status_ == kLeader && current_term_ == term) {
+        if (commit_index_ >= log_index) {
+            return true;
+        }
+        replication_cond_->TimeWait(10);
+    }
+    return false;
+}
+
+// Once the joint membership is committed, neither the old nor the new
+// members alone can elect a leader without the other, so the new members
+// take over with a second entry. A leader not among them steps down once
+// that entry is committed.
+void InsNodeImpl::FinishMembershipChange(int64_t joint_index, int64_t term,
+                                         ::galaxy::ins::ChangeMembershipResponse* response,
+                                         ::google::protobuf::Closure* done) {
+    MutexLock lock(&mu_);
+    bool success = WaitCommitted(joint_index, term);
+    if (success && !old_members_.empty()) {
+        Membership membership = memberships_.rbegin()->second;
+        membership.clear_old_members();
+        int64_t index = AppendMembershipEntry(membership);
+        WaitLogDurable(index);
+        success = WaitCommitted(index, term);
+    }
+    membership_changing_ = false;
+    if (success && !IsVoter(self_id_)) {
+        LOG(INFO, "removed from the members, step down");
+        status_ = kFollower;
+        current_leader_ = "";
+        lease_expire_timestamp_ = 0;
+    }
+    if (done != NULL) {
+        response->set_success(success);
+        response->set_leader_id(status_ == kLeader ? self_id_ : current_leader_);
+        done->Run();
+    }
+}
+
+// Used by the periodic and group durability modes, which skip the synced
+// write of each entry. The applied index is only written once the data it
+// covers is synced, so it never runs ahead of the data after a crash; the
+// entries after it are applied again on restart.
+void InsNodeImpl::SyncAppliedIndex(int64_t applied_index) {
+    int64_t now = ins_common::timer::get_micros();
+    if (durability_ == kDurabilityPeriodic &&
+        now - last_data_sync_time_ < FLAGS_ins_durability_sync_interval * 1000L) {
+        return;
+    }
+    if (data_store_->Sync() != kOk) {
+        LOG(FATAL, "failed to sync data store");
+        abort();
+    }
+    Status s = data_store_->Put(StorageManager::anonymous_user,
+                                tag_last_applied_index,
+                                BinLogger::IntToString(applied_index));
+    if (s != kOk || data_store_->Sync() != kOk) {
+        LOG(FATAL, "failed to sync last applied index %ld", applied_index);
+        abort();
+    }
+    last_data_sync_time_ = now;
+}
+
+// Make renaming a snapshot into place durable, the binlog slots it
+// covers may be dropped right after
+void InsNodeImpl::SyncSnapshotDir() {
+    if (durability_ == kDurabilityNone) {
+        return;
+    }
+    int fd = open(snapshot_dir_.c_str(), O_RDONLY);
+    if (fd < 0 || fsync(fd) != 0) {
+        LOG(FATAL, "failed to sync dir %s err %s",
+            snapshot_dir_.c_str(), strerror(errno));
+        abort();
+    }
+    close(fd);
+}
+
+void InsNodeImpl::SyncToDisk() {
+    binlogger_->Fsync();
+    meta_->Sync();
+    disk_syncer_.DelayTask(FLAGS_ins_durability_sync_interval,
+        boost::bind(&InsNodeImpl::SyncToDisk, this));
 }
 
 void InsNodeImpl::GarbageClean() {
-    std::vector<std::string> all_members;
-    bool is_leader = false;
+    TakeSnapshot();
+    // every node trims its own binlog up to its own snapshot, followers
+    // lagging behind the trimmed slots get the snapshot instead
+    int64_t clean_index = -1;
     {
         MutexLock lock(&mu_);
-        if (status_ == kLeader) {
-            is_leader = true;
-        }
-        std::copy(members_.begin(), members_.end(), std::back_inserter(all_members));
-    }
-    if (is_leader) {
-        int64_t min_applied_index = std::numeric_limits<int64_t>::max();
-        bool ret_all = true;
-        std::vector<std::string>::iterator it;
-        for(it = all_members.begin(); it != all_members.end(); it++) {
-            galaxy::ins::InsNode_Stub* stub;
-            std::string server_id = *it;
-            rpc_client_.GetStub(server_id, &stub);
-            ::galaxy::ins::ShowStatusRequest request;
-            ::galaxy::ins::ShowStatusResponse response;
-            bool ok = rpc_client_.SendRequest(stub, &InsNode_Stub::ShowStatus, 
-                                               &request, &response, 2, 1);
-            if (!ok) {
-                LOG(INFO, "faild to get last_applied_index from %s", server_id.c_str());
-                ret_all = false;
-                break;
-            } else {
-                min_applied_index = std::min(min_applied_index, response.last_applied());
-            }
+        clean_index = snapshot_index_ - FLAGS_ins_snapshot_keep_entries;
+    }
+    if (clean_index > binlogger_->GetFirstIndex()) {
+        LOG(INFO, "[gc] remove binlog before [%ld]", clean_index);
+        binlogger_->RemoveSlotBefore(clean_index);
+    }
+    binlog_cleaner_.DelayTask(FLAGS_ins_gc_interval * 1000, 
+                              boost::bind(&InsNodeImpl::GarbageClean, this));
+}
+
+// Dump the state machine at last_applied_index_ into the snapshot file.
+// The apply loop is only held while the databases are pinned, the dump
+// itself reads the pinned views.
+void InsNodeImpl::TakeSnapshot() {
+    MutexLock snapshot_lock(&snapshot_mu_);
+    int64_t index = -1;
+    {
+        MutexLock lock(&mu_);
+        if (stop_ || last_applied_index_ < 0 ||
+            last_applied_index_ - snapshot_index_ < FLAGS_ins_snapshot_threshold) {
+            return;
         }
-        if (ret_all) {
-            int64_t safe_clean_index = min_applied_index - 1;
-            int64_t old_index;
-            {
-                MutexLock lock(&mu_);
-                old_index = last_safe_clean_index_;
-                last_safe_clean_index_ = safe_clean_index;
-            }
-            if (old_index != safe_clean_index) {
-                LOG(INFO, "[gc] safe clean index is : %ld", safe_clean_index);
-                for(it = all_members.begin(); it != all_members.end(); it++) {
-                    galaxy::ins::InsNode_Stub* stub;
-                    std::string server_id = *it;
-                    rpc_client_.GetStub(server_id, &stub);
-                    ::galaxy::ins::CleanBinlogRequest request;
-                    ::galaxy::ins::CleanBinlogResponse response;
-                    request.set_end_index(safe_clean_index);
-                    bool ok = rpc_client_.SendRequest(stub, &InsNode_Stub::CleanBinlog, 
-                                                      &request, &response, 2, 1);
-                    if (!ok) {
-                        LOG(INFO, "failed to clean binlog request to %s", server_id.c_str());
-                    }
+        PauseApply();
+        index = last_applied_index_;
+    }
+    int64_t start_time = ins_common::timer::get_micros();
+    std::vector<StorageManager::DatabaseSnapshot> db_snapshots;
+    std::vector<UserInfo> users;
+    std::map<std::string, std::string> logged_users;
+    LogEntry log_entry;
+    bool ok = binlogger_->ReadSlot(index, &log_entry);
+    if (ok) {
+        data_store_->GetSnapshots(&db_snapshots);
+        user_manager_->DumpUsers(&users, &logged_users);
+    }
+    {
+        MutexLock lock(&mu_);
+        ResumeApply();
+    }
+    if (!ok) {
+        LOG(WARNING, "[snapshot] slot %ld is not in binlog", index);
+        return;
+    }
+    SnapshotMeta meta;
+    meta.set_last_included_index(index);
+    meta.set_last_included_term(log_entry.term);
+    std::string tmp_file_name = snapshot_dir_ + "/" + snapshot_tmp_file_name;
+    SnapshotWriter writer(tmp_file_name);
+    ok = writer.Open(meta);
+    int64_t item_count = 0;
+    SnapshotItem item;
+    for (size_t i = 0; ok && i < db_snapshots.size(); i++) {
+        StorageManager::Iterator* it = data_store_->NewIterator(db_snapshots[i]);
+        for (it->Seek(""); ok && it->Valid(); it->Next()) {
+            item.set_type(kSnapshotData);
+            item.set_name(db_snapshots[i].name);
+            item.set_key(it->key());
+            item.set_value(it->value());
+            ok = writer.Add(item);
+            item_count++;
+        }
+        delete it;
+    }
+    data_store_->ReleaseSnapshots(db_snapshots);
+    item.Clear();
+    for (size_t i = 0; ok && i < users.size(); i++) {
+        item.set_type(kSnapshotUser);
+        item.set_key(users[i].username());
+        item.set_value(users[i].passwd());
+        ok = writer.Add(item);
+    }
+    item.Clear();
+    std::map<std::string, std::string>::iterator user_it = logged_users.begin();
+    for (; ok && user_it != logged_users.end(); ++user_it) {
+        item.set_type(kSnapshotLoggedUser);
+        item.set_key(user_it->first);
+        item.set_value(user_it->second);
+        ok = writer.Add(item);
+    }
+    ok = writer.Close() && ok;
+    std::string file_name = snapshot_dir_ + "/" + snapshot_file_name;
+    if (!ok || rename(tmp_file_name.c_str(), file_name.c_str()) != 0) {
+        LOG(WARNING, "[snapshot] failed to take snapshot at %ld", index);
+        return;
+    }
+    SyncSnapshotDir();
+    MutexLock lock(&mu_);
+    snapshot_index_ = index;
+    snapshot_term_ = log_entry.term;
+    LOG(INFO, "[snapshot] take snapshot at %ld, term %ld, %ld keys in %ld ms",
+        index, snapshot_term_, item_count,
+        (ins_common::timer::get_micros() - start_time) / 1000);
+}
+
+// Replace the databases and the users with the content of a snapshot file.
+// The apply loop must be paused.
+bool InsNodeImpl::LoadSnapshot(const std::string& file_name) {
+    SnapshotReader reader(file_name);
+    SnapshotMeta meta;
+    if (!reader.Open(&meta)) {
+        return false;
+    }
+    if (!data_store_->ClearAllDatabases()) {
+        return false;
+    }
+    std::vector<UserInfo> users;
+    std::map<std::string, std::string> logged_users;
+    boost::unordered_map<std::string, std::set<std::string> > session_locks;
+    SnapshotItem item;
+    while (reader.Next(&item)) {
+        if (item.type() == kSnapshotData) {
+            Status s = data_store_->Put(item.name(), item.key(), item.value());
+            if (s == kUnknownUser) {
+                if (data_store_->OpenDatabase(item.name())) {
+                    s = data_store_->Put(item.name(), item.key(), item.value());
                 }
             }
-        } // end-if, got min_applied_index
-    }// end-if, this node is leader
-
-    binlog_cleaner_.DelayTask(FLAGS_ins_gc_interval * 1000, 
-                              boost::bind(&InsNodeImpl::GarbageClean, this));
+            if (s != kOk) {
+                return false;
+            }
+            if (item.name() == StorageManager::anonymous_user &&
+                (item.key() == tag_last_applied_index ||
+                 item.key() == tag_membership)) {
+                continue;
+            }
+            LogOperation op = kNop;
+            std::string session_id;
+            ParseValue(item.value(), op, session_id);
+            if (op == kLock) {
+                session_locks[session_id].insert(item.key());
+            }
+        } else if (item.type() == kSnapshotUser) {
+            UserInfo user;
+            user.set_username(item.key());
+            user.set_passwd(item.value());
+            users.push_back(user);
+        } else if (item.type() == kSnapshotLoggedUser) {
+            logged_users[item.key()] = item.value();
+        }
+    }
+    if (reader.error()) {
+        return false;
+    }
+    if (user_manager_->RestoreUsers(users, logged_users) != kOk) {
+        return false;
+    }
+    Status s = data_store_->Put(StorageManager::anonymous_user,
+                                tag_last_applied_index,
+                                BinLogger::IntToString(meta.last_included_index()));
+    if (s != kOk) {
+        return false;
+    }
+    MutexLock lock_sk(&session_locks_mu_);
+    session_locks_.swap(session_locks);
+    return true;
 }
 
 void InsNodeImpl::SampleAccessLog(const ::google::protobuf::RpcController* controller,
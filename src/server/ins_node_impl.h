@@ -7,6 +7,7 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <boost/function.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
@@ -17,6 +18,8 @@
 #include "common/mutex.h"
 #include "common/thread_pool.h"
 #include "rpc/rpc_client.h"
+#include "server/client_ack_table.h"
+#include "storage/durability.h"
 #include "storage/storage_manage.h"
 #include "server/user_manage.h"
 #include "server/performance_center.h"
@@ -29,45 +32,133 @@ namespace ins {
 class Meta;
 class BinLogger;
 
-struct ClientAck {
-    galaxy::ins::PutResponse* response;
-    galaxy::ins::DelResponse* del_response;
-    galaxy::ins::LockResponse* lock_response;
-    galaxy::ins::UnLockResponse* unlock_response;
-    galaxy::ins::LoginResponse* login_response;
-    galaxy::ins::LogoutResponse* logout_response;
-    galaxy::ins::RegisterResponse* register_response;
-    google::protobuf::Closure* done;
-    ClientAck() : response(NULL),
-                  del_response(NULL),
-                  lock_response(NULL),
-                  unlock_response(NULL),
-                  login_response(NULL),
-                  logout_response(NULL),
-                  register_response(NULL),
-                  done(NULL) {
-    }
-};
-
 struct ClientReadAck
 {
     const galaxy::ins::GetRequest* request;
     galaxy::ins::GetResponse* response;
+    // set instead of the above for a Scan on a follower, or for a ReadIndex
+    // asked by a follower, which is answered once the leadership is confirmed
+    const galaxy::ins::ScanRequest* scan_request;
+    galaxy::ins::ScanResponse* scan_response;
+    galaxy::ins::ReadIndexResponse* index_response;
     google::protobuf::Closure* done;
-    uint32_t succ_count ;
-    uint32_t err_count;
-    bool triggered;
+    // commit index when the read arrived, it is answered once this is applied
+    int64_t read_index;
     ClientReadAck() : request(NULL),
                       response(NULL),
+                      scan_request(NULL),
+                      scan_response(NULL),
+                      index_response(NULL),
                       done(NULL),
-                      succ_count(0),
-                      err_count(0),
-                      triggered(false) {
+                      read_index(-1) {
 
     }
     typedef boost::shared_ptr<ClientReadAck> Ptr;
 };
 
+// One heartbeat round confirming the leadership for all reads that
+// arrived before it started
+struct ReadConfirmRound
+{
+    std::vector<ClientReadAck::Ptr> reads;
+    int64_t start_timestamp;
+    int64_t term;
+    // voters that confirmed, and voters that could not be reached
+    std::set<std::string> acked;
+    std::set<std::string> failed;
+    bool triggered;
+    ReadConfirmRound() : start_timestamp(0),
+                         term(-1),
+                         triggered(false) {
+
+    }
+    typedef boost::shared_ptr<ReadConfirmRound> Ptr;
+};
+
+// What the leader knows of its contact with one follower. The heartbeat
+// messages are allocated once and reused by every heartbeat to it.
+struct FollowerContact
+{
+    galaxy::ins::AppendEntriesRequest heartbeat_request;
+    galaxy::ins::AppendEntriesResponse heartbeat_response;
+    bool heartbeat_in_flight;
+    // when the last AppendEntries of any kind was sent
+    int64_t last_send_time;
+    // send time of the newest AppendEntries answered in the current term,
+    // the follower heard of the leader no earlier than that
+    int64_t last_ack_time;
+    FollowerContact() : heartbeat_in_flight(false),
+                        last_send_time(0),
+                        last_ack_time(0) {
+
+    }
+};
+
+// Replication state of one follower, shared by its ReplicateLog thread
+// and the callbacks of the AppendEntries in flight
+struct ReplicationPipeline {
+    // first slot not sent yet, runs ahead of next_index_
+    int64_t send_index;
+    int32_t in_flight;
+    // bumped whenever sending restarts from next_index_, failures of
+    // batches sent before that are stale
+    int64_t epoch;
+    int64_t term;
+    // no sending before this time, in micro seconds
+    int64_t retry_time;
+    // batches in flight and the size of a batch, grown step by step while
+    // the follower keeps up and halved on failures or slow replies
+    int32_t window;
+    int64_t batch_entries;
+    int64_t batch_bytes;
+    // smoothed round trip of AppendEntries, in micro seconds
+    int64_t rtt;
+    // replies to batches sent before this time shrink nothing again
+    int64_t shrink_time;
+    // last slot the follower takes now, -1 if it did not tell
+    int64_t append_limit;
+    ReplicationPipeline() : send_index(0),
+                            in_flight(0),
+                            epoch(0),
+                            term(-1),
+                            retry_time(0),
+                            window(1),
+                            batch_entries(1),
+                            batch_bytes(0),
+                            rtt(0),
+                            shrink_time(0),
+                            append_limit(-1) {
+    }
+};
+
+struct ReplicationBatch {
+    int64_t epoch;
+    int64_t index;
+    int64_t span;
+    int64_t max_term;
+    int64_t send_time;
+};
+
+// Outcome of one applied entry, kept until its client is answered
+struct ApplyResult {
+    int64_t term;
+    // only meaningful for login, logout and register
+    Status status;
+    std::string uuid;
+};
+
+// Entries applied by the apply loop but not written to the data store yet
+struct ApplyBatch {
+    int64_t from_index;
+    // one per entry from from_index on
+    std::vector<ApplyResult> results;
+    StorageManager::Batch writes;
+    // watch events, fired once the writes are done
+    std::vector<boost::function<void ()> > events;
+    ApplyBatch() : from_index(0) {
+    }
+};
+
 struct Session {
     std::string session_id;
     std::string uuid;
@@ -138,12 +229,17 @@ typedef WatchEventContainer::nth_index<1>::type WatchEventSessionIndex;
 class InsNodeImpl : public InsNode {
 public:
    
-    InsNodeImpl(std::string& server_id, const std::vector<std::string>& members);
+    InsNodeImpl(std::string& server_id, const std::vector<std::string>& members,
+                const std::vector<std::string>& learners);
     virtual ~InsNodeImpl();
     void AppendEntries(::google::protobuf::RpcController* controller,
                        const ::galaxy::ins::AppendEntriesRequest* request,
                        ::galaxy::ins::AppendEntriesResponse* response,
                        ::google::protobuf::Closure* done);
+    void InstallSnapshot(::google::protobuf::RpcController* controller,
+                         const ::galaxy::ins::InstallSnapshotRequest* request,
+                         ::galaxy::ins::InstallSnapshotResponse* response,
+                         ::google::protobuf::Closure* done);
     void Vote(::google::protobuf::RpcController* controller,
               const ::galaxy::ins::VoteRequest* request,
               ::galaxy::ins::VoteResponse* response,
@@ -204,32 +300,140 @@ public:
                  const ::galaxy::ins::RpcStatRequest* request,
                  ::galaxy::ins::RpcStatResponse* response,
                  ::google::protobuf::Closure* done);
+    void ReadIndex(::google::protobuf::RpcController* controller,
+                   const ::galaxy::ins::ReadIndexRequest* request,
+                   ::galaxy::ins::ReadIndexResponse* response,
+                   ::google::protobuf::Closure* done);
+    void TransferLeadership(::google::protobuf::RpcController* controller,
+                            const ::galaxy::ins::TransferLeadershipRequest* request,
+                            ::galaxy::ins::TransferLeadershipResponse* response,
+                            ::google::protobuf::Closure* done);
+    void TimeoutNow(::google::protobuf::RpcController* controller,
+                    const ::galaxy::ins::TimeoutNowRequest* request,
+                    ::galaxy::ins::TimeoutNowResponse* response,
+                    ::google::protobuf::Closure* done);
+    void ChangeMembership(::google::protobuf::RpcController* controller,
+                          const ::galaxy::ins::ChangeMembershipRequest* request,
+                          ::galaxy::ins::ChangeMembershipResponse* response,
+                          ::google::protobuf::Closure* done);
 private:
     void VoteCallback(const ::galaxy::ins::VoteRequest* request,
                       ::galaxy::ins::VoteResponse* response,
-                      bool failed, int error);
+                      bool failed, int error,
+                      std::string voter_id);
+    void PreVoteCallback(const ::galaxy::ins::VoteRequest* request,
+                         ::galaxy::ins::VoteResponse* response,
+                         bool failed, int error,
+                         std::string voter_id);
     void HearBeatCallback(const ::galaxy::ins::AppendEntriesRequest* request,
                           ::galaxy::ins::AppendEntriesResponse* response,
-                          bool failed, int error);
+                          bool failed, int error,
+                          std::string follower_id,
+                          int64_t term,
+                          int64_t send_time);
+    FollowerContact* GetContact(const std::string& follower_id);
+    void AckContact(const std::string& follower_id, int64_t send_time);
+    void ExtendLease(int64_t lease_start);
+    void UpdateAppendLimit(const std::string& follower_id,
+                           const ::galaxy::ins::AppendEntriesResponse* response);
     void HeartBeatForReadCallback(const ::galaxy::ins::AppendEntriesRequest* request,
                                  ::galaxy::ins::AppendEntriesResponse* response,
                                  bool failed, int error,
-                                 ClientReadAck::Ptr context);
+                                 std::string follower_id,
+                                 ReadConfirmRound::Ptr round);
     void ForwardKeepAliveCallback(const ::galaxy::ins::KeepAliveRequest* request,
                                   ::galaxy::ins::KeepAliveResponse* response,
                                   bool failed, int error); 
+    void AppendEntriesCallback(ReplicationPipeline* pipeline,
+                               std::string follower_id,
+                               ReplicationBatch batch,
+                               const ::galaxy::ins::AppendEntriesRequest* request,
+                               ::galaxy::ins::AppendEntriesResponse* response,
+                               bool failed, int error);
 
     void BroadCastHeartBeat();
+    // send a heartbeat round for the reads in pending_reads_
+    void StartReadConfirm();
+    // answer reads whose read index is applied, without holding mu_
+    void ReplyReads(const std::vector<ClientReadAck::Ptr>& reads);
+    void TakeReadyReads(std::vector<ClientReadAck::Ptr>* reads);
+    void EndLocalRead();
+    void FailReads(const std::vector<ClientReadAck::Ptr>& reads,
+                   const std::string& leader_id);
+    void ReadLocal(const ::galaxy::ins::GetRequest* request,
+                   ::galaxy::ins::GetResponse* response);
+    void ScanLocal(const ::galaxy::ins::ScanRequest* request,
+                   ::galaxy::ins::ScanResponse* response);
+    // whether the leader has to confirm its leadership before a read
+    bool NeedReadConfirm();
+    // follower reads: ask the leader for the read index, or check
+    // whether the local data is fresh enough for a stale read
+    void RequestReadIndex(ClientReadAck::Ptr context);
+    void ReadIndexCallback(const ::galaxy::ins::ReadIndexRequest* request,
+                           ::galaxy::ins::ReadIndexResponse* response,
+                           bool failed, int error,
+                           ClientReadAck::Ptr context);
+    bool CanReadStale();
+    // whether a leader may answer reads from its own data right now
+    bool InLeaderLease();
+    // whether a vote now could elect a leader while the lease of the
+    // current one is still running
+    bool InLeaseOfOthers();
     void CheckLeaderCrash();
     void TryToBeLeader();
+    void StartPreVote();
+    // bump the term and ask the others for votes
+    void StartElection(bool leadership_transfer);
+    void SendVoteRequests(int64_t term, bool pre_vote, bool leadership_transfer);
+    void DoTransferLeadership(std::string target_id, int64_t term,
+                              ::galaxy::ins::TransferLeadershipResponse* response,
+                              ::google::protobuf::Closure* done);
     int32_t GetRandomTimeout();
     void TransToFollower(const char* msg, int64_t new_term);
+    // status_, or kLearner for a following learner
+    NodeStatus ReportedStatus();
+    // the members, and the old members during a joint consensus
+    void GetVoters(std::vector<std::string>* voters);
+    bool IsVoter(const std::string& server_id);
+    // whether voters hold a majority of the members, and of the old
+    // members during a joint consensus
+    bool IsQuorum(const std::set<std::string>& voters);
+    // the highest value reached by a majority of the members, and of the
+    // old members during a joint consensus. This node counts with
+    // self_value, voters missing in values count as -1.
+    int64_t QuorumValue(const std::map<std::string, int64_t>& values,
+                        int64_t self_value);
+    // the nodes the leader replicates to: all others in the membership,
+    // and the ones just removed until the removal is committed
+    void GetFollowers(std::vector<std::string>* followers);
+    bool IsFollower(const std::string& server_id);
+    // a membership entry of the log at index takes effect once appended
+    void AppendMembership(int64_t index, const std::string& value);
+    // forget the membership entries cut from the log
+    void TruncateMemberships();
+    // the membership of the applied state, followed by the membership
+    // entries of the log after it
+    void LoadMemberships();
+    // switch members_, learners_ and old_members_ to the latest membership
+    void UseMembership();
+    // leave the joint consensus once the entry at joint_index commits,
+    // response is NULL when no client waits for it
+    void FinishMembershipChange(int64_t joint_index, int64_t term,
+                                ::galaxy::ins::ChangeMembershipResponse* response,
+                                ::google::protobuf::Closure* done);
+    // append a membership entry as the leader, return its slot index
+    int64_t AppendMembershipEntry(const Membership& membership);
+    bool WaitCommitted(int64_t log_index, int64_t term);
     void ReplicateLog(std::string follower_id);
+    // start a ReplicateLog thread for every follower not having one
+    void StartReplicators();
     void StartReplicateLog();
     void GetLastLogIndexAndTerm(int64_t* last_log_index,
                                 int64_t* last_log_term);
     void UpdateCommitIndex(int64_t a_index);
+    void WaitLogDurable(int64_t log_index);
     void CommitIndexObserv();
+    bool FlushApplyBatch(ApplyBatch* batch, int64_t applied_index);
     void TransToLeader();
     void RemoveExpiredSessions();
     void ParseValue(const std::string& value,
@@ -259,23 +463,42 @@ private:
     void ForwardKeepAlive(const ::galaxy::ins::KeepAliveRequest * request,
                           ::galaxy::ins::KeepAliveResponse * response);
     void GarbageClean();
+    void SyncAppliedIndex(int64_t applied_index);
+    void SyncSnapshotDir();
+    // background disk sync of the periodic durability mode
+    void SyncToDisk();
     void DoAppendEntries(const ::galaxy::ins::AppendEntriesRequest* request,
                          ::galaxy::ins::AppendEntriesResponse* response,
                          ::google::protobuf::Closure* done);
+    bool GetLogTerm(int64_t log_index, int64_t* log_term);
+    void PauseApply();
+    void ResumeApply();
+    void TakeSnapshot();
+    bool LoadSnapshot(const std::string& file_name);
+    bool SendSnapshot(const std::string& follower_id);
+    void DoInstallSnapshot(const ::galaxy::ins::InstallSnapshotRequest* request,
+                           ::galaxy::ins::InstallSnapshotResponse* response,
+                           ::google::protobuf::Closure* done);
+    bool InstallSnapshotFile(const std::string& tmp_file_name, int64_t term);
     bool GetParentKey(const std::string& key, std::string* parent_key);
     void TouchParentKey(const std::string& user, const std::string& key,
                         const std::string& changed_session, 
-                        const std::string& action);
+                        const std::string& action,
+                        StorageManager::Batch* writes);
     void SampleAccessLog(const ::google::protobuf::RpcController* controller,
                          const char* action);
 public:
     std::vector<std::string> members_;
+    // get the log and apply it, but never vote nor count for commit
+    std::vector<std::string> learners_;
+    // the members before the change, while in joint consensus
+    std::vector<std::string> old_members_;
 private:
     bool stop_;
     std::string self_id_;
     int64_t current_term_;
     std::map<int64_t, std::string> voted_for_;
-    std::map<int64_t, uint32_t> vote_grant_;
+    std::map<int64_t, std::set<std::string> > vote_grant_;
     std::vector<galaxy::ins::Entry> binlog_;
     galaxy::ins::RpcClient rpc_client_;
     NodeStatus status_;
@@ -285,6 +508,9 @@ private:
     int64_t elect_leader_task_;
     std::string current_leader_;
     int32_t heartbeat_count_;
+    // the term asked for by the running pre-vote round, -1 if none
+    int64_t pre_vote_term_;
+    std::set<std::string> pre_vote_grant_;
     Meta* meta_;
     BinLogger* binlogger_;
     UserManager* user_manager_;
@@ -295,9 +521,39 @@ private:
     std::map<std::string, int64_t> next_index_;
     std::map<std::string, int64_t> match_index_;
     CondVar* replication_cond_;
-    boost::unordered_map<int64_t, ClientAck> client_ack_;
+    ClientAckTable client_ack_;
     std::set<std::string> replicating_;
+    // pipelines of the running ReplicateLog threads, for RpcStat
+    std::map<std::string, ReplicationPipeline*> pipelines_;
+    std::map<std::string, FollowerContact*> contacts_;
+    int64_t heartbeat_sent_count_;
+    // heartbeats skipped as the follower got other traffic just before
+    int64_t heartbeat_avoided_count_;
+    // followers that take binlog records as packed_entries
+    std::set<std::string> packed_followers_;
     int64_t heartbeat_read_timestamp_;
+    // the leader serves reads locally until lease_expire_timestamp_,
+    // followers refuse votes for a while after hearing from the leader
+    int64_t lease_expire_timestamp_;
+    int64_t leader_contact_timestamp_;
+    int64_t lease_read_count_;
+    // reads waiting for the next confirm round while one is in flight,
+    // and confirmed reads waiting for their read index to be applied
+    std::vector<ClientReadAck::Ptr> pending_reads_;
+    bool read_confirming_;
+    std::multimap<int64_t, ClientReadAck::Ptr> confirmed_reads_;
+    int64_t quorum_read_count_;
+    int64_t follower_read_count_;
+    // set while the leader hands over to this follower, writes are
+    // refused and the lease is not renewed meanwhile
+    std::string transfer_target_;
+    ThreadPool transfer_worker_;
+    // membership entries of the log by slot, the applied membership is
+    // at -1. The last one is in use, from the time it is appended.
+    std::map<int64_t, Membership> memberships_;
+    // set while the leader takes a change through the joint consensus
+    bool membership_changing_;
+    ThreadPool membership_worker_;
     bool in_safe_mode_;
     int64_t server_start_timestamp_;
     ThreadPool event_trigger_;
@@ -314,8 +570,33 @@ private:
     Mutex session_locks_mu_;
     ThreadPool binlog_cleaner_;
     ThreadPool follower_worker_;
-    bool single_node_mode_;
-    int64_t last_safe_clean_index_;
+    // the latest snapshot, covering slots up to snapshot_index_
+    std::string snapshot_dir_;
+    int64_t snapshot_index_;
+    int64_t snapshot_term_;
+    int64_t snapshot_sent_count_;
+    int64_t snapshot_installed_count_;
+    // held while a snapshot is taken or installed
+    Mutex snapshot_mu_;
+    ThreadPool snapshot_installer_;
+    // the apply loop stops between entries while apply_pausers_ > 0,
+    // applying_ is set while it works on a batch
+    int32_t apply_pausers_;
+    bool applying_;
+    CondVar* apply_cond_;
+    // a follower appends one AppendEntries batch at a time
+    bool appending_entries_;
+    CondVar* append_cond_;
+    // reads run on the databases without mu_, local_readers_ counts them;
+    // none starts while snapshot_installing_ is set, as the databases are
+    // replaced then
+    bool snapshot_installing_;
+    int32_t local_readers_;
+    CondVar* local_read_cond_;
+    DurabilityMode durability_;
+    // only touched by the apply loop
+    int64_t last_data_sync_time_;
+    ThreadPool disk_syncer_;
     PerformanceCenter perform_;
 };
 
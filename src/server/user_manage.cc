@@ -226,6 +226,34 @@ std::string UserManager::GetUsernameFromUuid(const std::string& uuid) {
     return "";
 }
 
+void UserManager::DumpUsers(std::vector<UserInfo>* users,
+                            std::map<std::string, std::string>* logged_users) {
+    MutexLock lock(&mu_);
+    std::map<std::string, UserInfo>::const_iterator it = user_list_.begin();
+    for (; it != user_list_.end(); ++it) {
+        users->push_back(it->second);
+    }
+    *logged_users = logged_users_;
+}
+
+Status UserManager::RestoreUsers(const std::vector<UserInfo>& users,
+                                 const std::map<std::string, std::string>& logged_users) {
+    MutexLock lock(&mu_);
+    if (!TruncateDatabase()) {
+        return kError;
+    }
+    user_list_.clear();
+    for (std::vector<UserInfo>::const_iterator it = users.begin();
+         it != users.end(); ++it) {
+        if (!WriteToDatabase(*it)) {
+            return kError;
+        }
+        user_list_[it->username()] = *it;
+    }
+    logged_users_ = logged_users;
+    return kOk;
+}
+
 bool UserManager::WriteToDatabase(const UserInfo& user) {
     if (!user.has_username() || !user.has_passwd()) {
         return false;
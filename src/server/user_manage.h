@@ -3,6 +3,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include "common/mutex.h"
 #include "proto/ins_node.pb.h"
 #include "storage/meta.h"
@@ -31,6 +32,13 @@ public:
 
     std::string GetUsernameFromUuid(const std::string& uuid);
 
+    // Copy out all registered users and the logged in uuid -> username map
+    void DumpUsers(std::vector<UserInfo>* users,
+                   std::map<std::string, std::string>* logged_users);
+    // Replace all users with those from a snapshot
+    Status RestoreUsers(const std::vector<UserInfo>& users,
+                        const std::map<std::string, std::string>& logged_users);
+
     static std::string CalcUuid(const std::string& name);
 private:
     bool WriteToDatabase(const UserInfo& user);
@@ -1,9 +1,22 @@
 #include "binlog.h"
 
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <boost/bind.hpp>
 #include "common/asm_atomic.h"
+#include "common/crc32c.h"
 #include "common/logging.h"
-#include "leveldb/write_batch.h"
+#include "common/thread_pool.h"
+#include "common/timer.h"
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+#include "leveldb/db.h"
 #include "utils.h"
 
 namespace galaxy {
@@ -11,51 +24,340 @@ namespace ins {
 
 const std::string log_dbname = "#binlog";
 const std::string length_tag = "#BINLOG_LEN#";
+const std::string segment_dirname = "#segments";
+const std::string segment_suffix = ".log";
+const std::string legacy_suffix = ".imported";
+
+// every kIndexInterval slots of a segment get an entry in the sparse index
+const static int64_t kIndexInterval = 16;
+// a record is [payload length | flags: fixed32][masked crc32c: fixed32][payload],
+// records written before checksums were added have no crc field
+const static int64_t kRecordLengthSize = sizeof(uint32_t);
+const static int64_t kRecordHeaderSize = 2 * sizeof(uint32_t);
+const static int64_t kRecoverChunkSize = (1 << 20);
+const static int64_t kImportBatchSize = (4 << 20);
+// the most bytes freed by one ftruncate of the reclaimer
+const static int64_t kReclaimChunkSize = (4 << 20);
+// set in the record header when the payload is a serialized Entry,
+// records without it use the DumpLogEntry layout
+const static uint32_t kEntryFormatFlag = 0x80000000U;
+// set in the record header when the crc field is present
+const static uint32_t kChecksumFlag = 0x40000000U;
+
+static uint32_t PayloadSize(uint32_t header) {
+    return header & ~(kEntryFormatFlag | kChecksumFlag);
+}
+
+static int64_t HeaderSize(uint32_t header) {
+    return (header & kChecksumFlag) ? kRecordHeaderSize : kRecordLengthSize;
+}
+
+// tags of the galaxy::ins::Entry fields
+const static uint8_t kEntryKeyTag = (1 << 3) | 2;
+const static uint8_t kEntryValueTag = (2 << 3) | 2;
+const static uint8_t kEntryTermTag = (3 << 3) | 0;
+const static uint8_t kEntryOpTag = (4 << 3) | 0;
+const static uint8_t kEntryUserTag = (5 << 3) | 2;
+
+static uint8_t* WriteStringField(uint8_t tag, const std::string& value,
+                                 uint8_t* p) {
+    using ::google::protobuf::io::CodedOutputStream;
+    *p++ = tag;
+    p = CodedOutputStream::WriteVarint32ToArray(value.size(), p);
+    return CodedOutputStream::WriteStringToArray(value, p);
+}
+
+// Serialize log_entry as a galaxy::ins::Entry without building the message
+static void EncodeEntry(const LogEntry& log_entry, std::string* buf) {
+    using ::google::protobuf::io::CodedOutputStream;
+    size_t size = 5 + CodedOutputStream::VarintSize32(log_entry.key.size())
+                  + log_entry.key.size()
+                  + CodedOutputStream::VarintSize32(log_entry.value.size())
+                  + log_entry.value.size()
+                  + CodedOutputStream::VarintSize64(log_entry.term)
+                  + CodedOutputStream::VarintSize32(log_entry.op)
+                  + CodedOutputStream::VarintSize32(log_entry.user.size())
+                  + log_entry.user.size();
+    buf->resize(size);
+    uint8_t* p = reinterpret_cast<uint8_t*>(&(*buf)[0]);
+    p = WriteStringField(kEntryKeyTag, log_entry.key, p);
+    p = WriteStringField(kEntryValueTag, log_entry.value, p);
+    *p++ = kEntryTermTag;
+    p = CodedOutputStream::WriteVarint64ToArray(log_entry.term, p);
+    *p++ = kEntryOpTag;
+    p = CodedOutputStream::WriteVarint32ToArray(log_entry.op, p);
+    p = WriteStringField(kEntryUserTag, log_entry.user, p);
+    assert(p == reinterpret_cast<uint8_t*>(&(*buf)[0]) + size);
+}
+
+static void DecodeEntry(const std::string& buf, LogEntry* log_entry) {
+    Entry entry;
+    if (!entry.ParseFromString(buf)) {
+        LOG(FATAL, "[binlog] failed to parse entry, size %lu", buf.size());
+        abort();
+    }
+    log_entry->op = entry.op();
+    log_entry->term = entry.term();
+    log_entry->key.swap(*entry.mutable_key());
+    log_entry->value.swap(*entry.mutable_value());
+    log_entry->user.swap(*entry.mutable_user());
+}
+
+// Pick the term out of a serialized Entry without parsing the other fields
+static int64_t EntryTerm(const std::string& buf) {
+    using ::google::protobuf::internal::WireFormatLite;
+    ::google::protobuf::io::CodedInputStream input(
+        reinterpret_cast<const uint8_t*>(buf.data()), buf.size());
+    uint32_t tag = 0;
+    while ((tag = input.ReadTag()) != 0) {
+        if (tag == kEntryTermTag) {
+            ::google::protobuf::uint64 term = 0;
+            if (!input.ReadVarint64(&term)) {
+                break;
+            }
+            return static_cast<int64_t>(term);
+        }
+        if (!WireFormatLite::SkipField(&input, tag)) {
+            break;
+        }
+    }
+    LOG(FATAL, "[binlog] no term in entry, size %lu", buf.size());
+    abort();
+    return -1;
+}
+
+LogOperation BinLogger::EntryOp(const std::string& buf) {
+    using ::google::protobuf::internal::WireFormatLite;
+    ::google::protobuf::io::CodedInputStream input(
+        reinterpret_cast<const uint8_t*>(buf.data()), buf.size());
+    uint32_t tag = 0;
+    while ((tag = input.ReadTag()) != 0) {
+        if (tag == kEntryOpTag) {
+            uint32_t op = 0;
+            if (!input.ReadVarint32(&op)) {
+                break;
+            }
+            return static_cast<LogOperation>(op);
+        }
+        if (!WireFormatLite::SkipField(&input, tag)) {
+            break;
+        }
+    }
+    // as Entry::op() of an entry without op
+    return kPut;
+}
+
+static std::string SegmentFileName(int64_t start_index) {
+    char buf[32] = {'\0'};
+    snprintf(buf, sizeof(buf), "%020ld", start_index);
+    return std::string(buf) + segment_suffix;
+}
+
+static bool PreadFully(int fd, char* buf, size_t n, int64_t offset) {
+    while (n > 0) {
+        ssize_t ret = pread(fd, buf, n, offset);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        buf += ret;
+        n -= ret;
+        offset += ret;
+    }
+    return true;
+}
+
+static bool PwriteFully(int fd, const char* buf, size_t n, int64_t offset) {
+    while (n > 0) {
+        ssize_t ret = pwrite(fd, buf, n, offset);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        buf += ret;
+        n -= ret;
+        offset += ret;
+    }
+    return true;
+}
+
+// Sequential reader over the records of a segment file. Records are read
+// in chunks of chunk_size bytes, so a scan needs few large preads.
+class RecordReader {
+public:
+    enum Result {
+        kRecordOk,
+        kRecordEnd,
+        kRecordTruncated,
+        kRecordCorrupted
+    };
+    RecordReader(int fd, int64_t offset, int64_t file_size, int64_t chunk_size)
+        : fd_(fd), offset_(offset), file_size_(file_size),
+          chunk_size_(chunk_size), chunk_offset_(offset) {
+    }
+    // on kRecordOk, payload points into the reader buffer until the next call
+    Result Next(uint32_t* header, const char** payload, uint32_t* payload_size) {
+        if (offset_ == file_size_) {
+            return kRecordEnd;
+        }
+        if (offset_ + kRecordLengthSize > file_size_ || !Fill(kRecordLengthSize)) {
+            return kRecordTruncated;
+        }
+        const char* p = chunk_.data() + (offset_ - chunk_offset_);
+        memcpy(header, p, sizeof(uint32_t));
+        int64_t header_size = HeaderSize(*header);
+        *payload_size = PayloadSize(*header);
+        int64_t record_size = header_size + *payload_size;
+        if (offset_ + record_size > file_size_ || !Fill(record_size)) {
+            return kRecordTruncated;
+        }
+        p = chunk_.data() + (offset_ - chunk_offset_);
+        *payload = p + header_size;
+        if (*header & kChecksumFlag) {
+            uint32_t masked_crc = 0;
+            memcpy(&masked_crc, p + kRecordLengthSize, sizeof(uint32_t));
+            if (ins_common::crc32c::Unmask(masked_crc) !=
+                ins_common::crc32c::Value(*payload, *payload_size)) {
+                return kRecordCorrupted;
+            }
+        }
+        offset_ += record_size;
+        return kRecordOk;
+    }
+    int64_t offset() const {
+        return offset_;
+    }
+    static const char* ResultToString(Result result) {
+        switch (result) {
+            case kRecordOk: return "ok";
+            case kRecordEnd: return "end";
+            case kRecordTruncated: return "truncated";
+            case kRecordCorrupted: return "checksum mismatch";
+        }
+        return "unknown";
+    }
+private:
+    // make [offset_, offset_ + n) available in chunk_
+    bool Fill(int64_t n) {
+        if (offset_ >= chunk_offset_ &&
+            offset_ + n <= chunk_offset_ + static_cast<int64_t>(chunk_.size())) {
+            return true;
+        }
+        int64_t size = std::max(n, std::min(chunk_size_, file_size_ - offset_));
+        chunk_.resize(size);
+        if (!PreadFully(fd_, &chunk_[0], size, offset_)) {
+            return false;
+        }
+        chunk_offset_ = offset_;
+        return true;
+    }
+    int fd_;
+    int64_t offset_;
+    int64_t file_size_;
+    int64_t chunk_size_;
+    std::string chunk_;
+    int64_t chunk_offset_;
+};
+
+// Offset of the first record with a good checksum in (offset, file_size),
+// or -1 if there is none. Only records of the current layout carry a
+// checksum, so stray bytes of a torn write are not taken for a record.
+static int64_t FindGoodRecord(int fd, int64_t offset, int64_t file_size) {
+    int64_t tail_size = file_size - offset;
+    if (tail_size <= kRecordHeaderSize) {
+        return -1;
+    }
+    std::string tail(tail_size, '\0');
+    if (!PreadFully(fd, &tail[0], tail_size, offset)) {
+        return -1;
+    }
+    const uint32_t flags = kEntryFormatFlag | kChecksumFlag;
+    for (int64_t i = 1; i + kRecordHeaderSize <= tail_size; i++) {
+        uint32_t header = 0;
+        memcpy(&header, tail.data() + i, sizeof(uint32_t));
+        int64_t payload_size = PayloadSize(header);
+        if ((header & flags) != flags || payload_size == 0 ||
+            i + kRecordHeaderSize + payload_size > tail_size) {
+            continue;
+        }
+        uint32_t masked_crc = 0;
+        memcpy(&masked_crc, tail.data() + i + kRecordLengthSize,
+               sizeof(uint32_t));
+        if (ins_common::crc32c::Unmask(masked_crc) ==
+            ins_common::crc32c::Value(tail.data() + i + kRecordHeaderSize,
+                                      payload_size)) {
+            return offset + i;
+        }
+    }
+    return -1;
+}
 
 BinLogger::BinLogger(const std::string& data_dir,
-                     bool compress,
-                     int32_t block_size,
-                     int32_t write_buffer_size) : db_(NULL),
-                                                  length_(0),
-                                                  last_log_term_(-1) {
+                     const BinLogOptions& options) : options_(options),
+                                                     length_(0),
+                                                     last_log_term_(-1),
+                                                     pending_last_term_(-1),
+                                                     pending_length_(0),
+                                                     writing_(false),
+                                                     synced_length_(0),
+                                                     cache_start_(0),
+                                                     cache_bytes_(0),
+                                                     reclaiming_(false),
+                                                     reclaimed_bytes_(0),
+                                                     reclaim_pending_bytes_(0),
+                                                     reclaimer_(1),
+                                                     write_cond_(&mu_) {
     bool ok = ins_common::Mkdirs(data_dir.c_str());
     if (!ok) {
         LOG(FATAL, "failed to create dir :%s", data_dir.c_str());
         abort();
     }
-    std::string full_name = data_dir + "/" + log_dbname;
-    leveldb::Options options;
-    options.create_if_missing = true;
-    if (compress) {
-        options.compression = leveldb::kSnappyCompression;
-        LOG(INFO, "enable snappy compress for binlog");
-    }
-    options.write_buffer_size = write_buffer_size;
-    options.block_size = block_size;
-    LOG(INFO, "[binlog]: block_size: %d, writer_buffer_size: %d", 
-        options.block_size,
-        options.write_buffer_size);
-    leveldb::Status status = leveldb::DB::Open(options, full_name, &db_);
-    if (!status.ok()) {
-        LOG(FATAL, "failed to open db %s err %s", 
-                   full_name.c_str(), status.ToString().c_str()); 
-        assert(status.ok());
+    log_dir_ = data_dir + "/" + segment_dirname;
+    ok = ins_common::Mkdirs(log_dir_.c_str());
+    if (!ok) {
+        LOG(FATAL, "failed to create dir :%s", log_dir_.c_str());
+        abort();
     }
-    std::string value;
-    status = db_->Get(leveldb::ReadOptions(), length_tag, &value);
-    if (status.ok() && !value.empty()) {
-        length_ = StringToInt(value);
-        if (length_ > 0) {
-            LogEntry log_entry;
-            bool slot_ok = ReadSlot(length_ - 1, &log_entry);
-            assert(slot_ok);
-            last_log_term_ = log_entry.term;
-        }
+    LoadSegments();
+    if (segments_.empty()) {
+        ImportLegacyLog(data_dir + "/" + log_dbname);
     }
+    ReloadLastLogTerm();
+    pending_length_ = length_;
+    synced_length_ = length_;
+    cache_start_ = length_;
+    LOG(INFO, "[binlog]: segment_size: %ld, segments: %d, length: %ld, "
+        "durability: %d", options_.segment_size, segments_.size(), length_,
+        options_.durability);
 }
 
 BinLogger::~BinLogger() {
-    delete db_;
+    reclaimer_.Stop(true);
+    std::map<int64_t, LogSegment*>::iterator it;
+    for (it = segments_.begin(); it != segments_.end(); it++) {
+        CloseSegment(it->second, false);
+    }
+    segments_.clear();
+    // files left in the queue are freed at once by the last close
+    for (size_t i = 0; i < reclaim_queue_.size(); i++) {
+        CloseSegment(reclaim_queue_[i], false);
+    }
+    reclaim_queue_.clear();
+}
+
+void BinLogger::GetCacheStat(int64_t* hits, int64_t* misses) {
+    *hits = cache_hits_.Get();
+    *misses = cache_misses_.Get();
+}
+
+void BinLogger::GetReclaimStat(int64_t* reclaimed_bytes, int64_t* pending_bytes) {
+    MutexLock lock(&mu_);
+    *reclaimed_bytes = reclaimed_bytes_;
+    *pending_bytes = reclaim_pending_bytes_;
 }
 
 int64_t BinLogger::GetLength() {
@@ -63,6 +365,19 @@ int64_t BinLogger::GetLength() {
     return length_;
 }
 
+int64_t BinLogger::GetAppendedLength() {
+    MutexLock lock(&mu_);
+    return pending_length_;
+}
+
+int64_t BinLogger::GetFirstIndex() {
+    MutexLock lock(&mu_);
+    if (segments_.empty()) {
+        return length_;
+    }
+    return segments_.begin()->second->start_index;
+}
+
 void BinLogger::GetLastLogIndexAndTerm(int64_t* last_log_index, int64_t* last_log_term) {
     MutexLock lock(&mu_);
     *last_log_index = length_ - 1;
@@ -83,82 +398,722 @@ int64_t BinLogger::StringToInt(const std::string& s) {
     return num;
 }
 
-bool BinLogger::RemoveSlot(int64_t slot_index) {
-    std::string value;
-    std::string key = IntToString(slot_index);
-    leveldb::Status status = db_->Get(leveldb::ReadOptions(), key, &value);
+void BinLogger::LoadSegments() {
+    DIR* dir = opendir(log_dir_.c_str());
+    if (dir == NULL) {
+        LOG(FATAL, "failed to open dir :%s", log_dir_.c_str());
+        abort();
+    }
+    std::vector<std::pair<int64_t, std::string> > files;
+    struct dirent* ent = NULL;
+    while ((ent = readdir(dir)) != NULL) {
+        std::string name = ent->d_name;
+        if (name.size() <= segment_suffix.size() ||
+            name.compare(name.size() - segment_suffix.size(),
+                         segment_suffix.size(), segment_suffix) != 0) {
+            continue;
+        }
+        char* end = NULL;
+        int64_t start_index = strtoll(name.c_str(), &end, 10);
+        if (end != name.c_str() + name.size() - segment_suffix.size()) {
+            continue;
+        }
+        files.push_back(std::make_pair(start_index, name));
+    }
+    closedir(dir);
+    std::sort(files.begin(), files.end());
+    std::vector<LogSegment*> loaded;
+    for (size_t i = 0; i < files.size(); i++) {
+        loaded.push_back(OpenSegment(files[i].second, files[i].first));
+    }
+    // segments are independent, so the whole log is verified in parallel
+    int64_t start_time = ins_common::timer::get_micros();
+    {
+        ThreadPool pool(std::max(1, options_.recover_threads));
+        for (size_t i = 0; i < loaded.size(); i++) {
+            pool.AddTask(boost::bind(&BinLogger::RecoverSegment, this,
+                                     loaded[i], i + 1 == loaded.size()));
+        }
+        pool.Stop(true);
+    }
+    for (size_t i = 0; i < loaded.size(); i++) {
+        LogSegment* segment = loaded[i];
+        if (!segments_.empty() &&
+            segments_.rbegin()->second->end_index != segment->start_index) {
+            LOG(FATAL, "[binlog] segments are not contiguous: %ld != %ld",
+                segments_.rbegin()->second->end_index, segment->start_index);
+            abort();
+        }
+        segments_[segment->start_index] = segment;
+        length_ = segment->end_index;
+    }
+    LOG(INFO, "[binlog] verified %d segments in %ld ms",
+        loaded.size(), (ins_common::timer::get_micros() - start_time) / 1000);
+}
+
+void BinLogger::ImportLegacyLog(const std::string& legacy_name) {
+    if (access(legacy_name.c_str(), F_OK) != 0) {
+        return;
+    }
+    leveldb::DB* db = NULL;
+    leveldb::Options options;
+    leveldb::Status status = leveldb::DB::Open(options, legacy_name, &db);
     if (!status.ok()) {
+        LOG(FATAL, "failed to open legacy binlog %s err %s",
+            legacy_name.c_str(), status.ToString().c_str());
+        abort();
+    }
+    std::string value;
+    int64_t legacy_length = 0;
+    status = db->Get(leveldb::ReadOptions(), length_tag, &value);
+    if (status.ok() && !value.empty()) {
+        legacy_length = StringToInt(value);
+    }
+    // slots below the gc key are dropped lazily by compaction,
+    // so only the contiguous tail of the legacy log is imported
+    int64_t first_index = legacy_length;
+    while (first_index > 0) {
+        status = db->Get(leveldb::ReadOptions(),
+                         IntToString(first_index - 1), &value);
+        if (!status.ok()) {
+            break;
+        }
+        first_index--;
+    }
+    LOG(INFO, "[binlog] import legacy binlog %s, slots [%ld, %ld)",
+        legacy_name.c_str(), first_index, legacy_length);
+    {
+        MutexLock lock(&mu_);
+        length_ = first_index;
+        pending_length_ = first_index;
+        cache_start_ = first_index;
+        for (int64_t i = first_index; i < legacy_length; i++) {
+            status = db->Get(leveldb::ReadOptions(), IntToString(i), &value);
+            assert(status.ok());
+            LogEntry log_entry;
+            LoadLogEntry(value, &log_entry);
+            EncodeEntry(log_entry, &value);
+            QueueRecord(value, log_entry.term);
+            if (static_cast<int64_t>(pending_buf_.size()) >= kImportBatchSize) {
+                WritePendingLocked();
+            }
+        }
+        FlushPendingLocked();
+    }
+    delete db;
+    std::string imported_name = legacy_name + legacy_suffix;
+    if (rename(legacy_name.c_str(), imported_name.c_str()) != 0) {
+        LOG(FATAL, "failed to rename %s to %s",
+            legacy_name.c_str(), imported_name.c_str());
+        abort();
+    }
+}
+
+LogSegment* BinLogger::OpenSegment(const std::string& file_name,
+                                   int64_t start_index) {
+    std::string full_name = log_dir_ + "/" + file_name;
+    int fd = open(full_name.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        LOG(FATAL, "failed to open segment %s err %s",
+            full_name.c_str(), strerror(errno));
+        abort();
+    }
+    LogSegment* segment = new LogSegment();
+    segment->start_index = start_index;
+    segment->end_index = start_index;
+    segment->fd = fd;
+    segment->file_name = full_name;
+    return segment;
+}
+
+// Rebuild the sparse index of a segment and check the crc of every record.
+// Only the last segment may end with a torn write, i.e. broken bytes up to
+// the end of the file, which are dropped. Damage followed by a good record
+// is not a torn write, records after it may have been synced and
+// acknowledged, so recovery stops there as for any other segment.
+void BinLogger::RecoverSegment(LogSegment* segment, bool is_last) {
+    struct stat st;
+    if (fstat(segment->fd, &st) != 0) {
+        LOG(FATAL, "failed to stat segment %s", segment->file_name.c_str());
+        abort();
+    }
+    int64_t file_size = st.st_size;
+    int64_t offset = 0;
+    int64_t slot_index = segment->start_index;
+    RecordReader reader(segment->fd, 0, file_size, kRecoverChunkSize);
+    RecordReader::Result ret = RecordReader::kRecordOk;
+    uint32_t header = 0;
+    const char* payload = NULL;
+    uint32_t payload_size = 0;
+    while ((ret = reader.Next(&header, &payload, &payload_size))
+           == RecordReader::kRecordOk) {
+        if ((slot_index - segment->start_index) % kIndexInterval == 0) {
+            segment->offsets.push_back(offset);
+        }
+        offset = reader.offset();
+        slot_index++;
+    }
+    if (ret != RecordReader::kRecordEnd) {
+        int64_t good_offset = -1;
+        if (is_last) {
+            good_offset = FindGoodRecord(segment->fd, offset, file_size);
+            if (good_offset >= 0) {
+                LOG(WARNING, "[binlog] good record at offset %ld after the "
+                    "damage in %s", good_offset, segment->file_name.c_str());
+            }
+        }
+        if (!is_last || good_offset >= 0) {
+            LOG(FATAL, "[binlog] broken segment %s at offset %ld: %s",
+                segment->file_name.c_str(), offset,
+                RecordReader::ResultToString(ret));
+            abort();
+        }
+        LOG(WARNING, "[binlog] drop tail of %s, %ld -> %ld bytes: %s",
+            segment->file_name.c_str(), file_size, offset,
+            RecordReader::ResultToString(ret));
+        if (ftruncate(segment->fd, offset) != 0) {
+            LOG(FATAL, "failed to truncate segment %s",
+                segment->file_name.c_str());
+            abort();
+        }
+    }
+    segment->file_size = offset;
+    segment->end_index = slot_index;
+}
+
+// A removed segment is unlinked right away, so its name can be taken by a
+// new segment, but the file is kept open and handed to the reclaimer.
+// Freeing a large file in one go stalls the disk for other writers.
+void BinLogger::CloseSegment(LogSegment* segment, bool remove_file) {
+    if (!remove_file) {
+        close(segment->fd);
+        delete segment;
+        return;
+    }
+    mu_.AssertHeld();
+    if (unlink(segment->file_name.c_str()) != 0) {
+        LOG(WARNING, "failed to remove segment %s", segment->file_name.c_str());
+    }
+    std::vector<int64_t>().swap(segment->offsets);
+    reclaim_queue_.push_back(segment);
+    reclaim_pending_bytes_ += segment->file_size;
+    if (!reclaiming_) {
+        reclaiming_ = true;
+        reclaimer_.AddTask(boost::bind(&BinLogger::ReclaimStep, this));
+    }
+}
+
+// Shrink the first queued file by one chunk, the next step is delayed
+// so that no more than reclaim_rate bytes are freed per second.
+void BinLogger::ReclaimStep() {
+    LogSegment* segment = NULL;
+    int64_t chunk_size = kReclaimChunkSize;
+    if (options_.reclaim_rate > 0) {
+        chunk_size = std::min(chunk_size, options_.reclaim_rate);
+    }
+    {
+        MutexLock lock(&mu_);
+        if (reclaim_queue_.empty()) {
+            reclaiming_ = false;
+            return;
+        }
+        segment = reclaim_queue_.front();
+    }
+    // queued segments are only touched by the reclaimer
+    int64_t new_size = std::max(static_cast<int64_t>(0),
+                                segment->file_size - chunk_size);
+    if (ftruncate(segment->fd, new_size) != 0) {
+        LOG(WARNING, "[binlog] failed to shrink removed segment %s err %s",
+            segment->file_name.c_str(), strerror(errno));
+        new_size = 0;
+    }
+    int64_t freed = segment->file_size - new_size;
+    {
+        MutexLock lock(&mu_);
+        segment->file_size = new_size;
+        reclaimed_bytes_ += freed;
+        reclaim_pending_bytes_ -= freed;
+        if (new_size == 0) {
+            reclaim_queue_.pop_front();
+        }
+    }
+    if (new_size == 0) {
+        LOG(DEBUG, "[binlog] reclaimed %s", segment->file_name.c_str());
+        CloseSegment(segment, false);
+    }
+    int64_t delay = 0;
+    if (options_.reclaim_rate > 0) {
+        delay = freed * 1000 / options_.reclaim_rate;
+    }
+    reclaimer_.DelayTask(delay, boost::bind(&BinLogger::ReclaimStep, this));
+}
+
+// Make creating and removing segment files durable
+void BinLogger::SyncLogDir() {
+    if (options_.durability == kDurabilityNone) {
+        return;
+    }
+    int fd = open(log_dir_.c_str(), O_RDONLY);
+    if (fd < 0 || fsync(fd) != 0) {
+        LOG(FATAL, "failed to sync dir %s err %s",
+            log_dir_.c_str(), strerror(errno));
+        abort();
+    }
+    close(fd);
+}
+
+LogSegment* BinLogger::FindSegment(int64_t slot_index) {
+    mu_.AssertHeld();
+    std::map<int64_t, LogSegment*>::iterator it = segments_.upper_bound(slot_index);
+    if (it == segments_.begin()) {
+        return NULL;
+    }
+    --it;
+    if (slot_index >= it->second->end_index) {
+        return NULL;
+    }
+    return it->second;
+}
+
+int64_t BinLogger::SlotOffset(LogSegment* segment, int64_t slot_index) {
+    if (slot_index >= segment->end_index) {
+        return segment->file_size;
+    }
+    int64_t pos = (slot_index - segment->start_index) / kIndexInterval;
+    int64_t offset = segment->offsets[pos];
+    for (int64_t i = segment->start_index + pos * kIndexInterval;
+         i < slot_index; i++) {
+        uint32_t header = 0;
+        if (!PreadFully(segment->fd, reinterpret_cast<char*>(&header),
+                        sizeof(uint32_t), offset)) {
+            LOG(FATAL, "[binlog] bad record header in %s at %ld",
+                segment->file_name.c_str(), offset);
+            abort();
+        }
+        offset += HeaderSize(header) + PayloadSize(header);
+    }
+    return offset;
+}
+
+// Read the record at offset, records in the old layout are converted so
+// that buf always holds a serialized Entry.
+bool BinLogger::ReadRecord(LogSegment* segment, int64_t offset, std::string* buf) {
+    RecordReader reader(segment->fd, offset, segment->file_size, 0);
+    uint32_t header = 0;
+    const char* payload = NULL;
+    uint32_t payload_size = 0;
+    RecordReader::Result ret = reader.Next(&header, &payload, &payload_size);
+    if (ret != RecordReader::kRecordOk) {
+        LOG(WARNING, "[binlog] bad record in %s at %ld: %s",
+            segment->file_name.c_str(), offset,
+            RecordReader::ResultToString(ret));
         return false;
     }
-    status = db_->Delete(leveldb::WriteOptions(), key);
-    if (status.ok()) {
-        return true;
+    buf->assign(payload, payload_size);
+    if ((header & kEntryFormatFlag) == 0) {
+        LogEntry log_entry;
+        LoadLogEntry(*buf, &log_entry);
+        EncodeEntry(log_entry, buf);
+    }
+    return true;
+}
+
+void BinLogger::AppendRecord(const std::string& payload, std::string* buf) {
+    uint32_t header = payload.size() | kEntryFormatFlag | kChecksumFlag;
+    uint32_t masked_crc = ins_common::crc32c::Mask(
+        ins_common::crc32c::Value(payload.data(), payload.size()));
+    buf->append(reinterpret_cast<const char*>(&header), sizeof(uint32_t));
+    buf->append(reinterpret_cast<const char*>(&masked_crc), sizeof(uint32_t));
+    buf->append(payload);
+}
+
+void BinLogger::QueueRecord(const std::string& payload, int64_t term) {
+    mu_.AssertHeld();
+    pending_offsets_.push_back(pending_buf_.size());
+    AppendRecord(payload, &pending_buf_);
+    unwritten_.push_back(payload);
+    pending_last_term_ = term;
+    pending_length_++;
+}
+
+void BinLogger::CacheRecordsLocked(const std::string& buf,
+                                   const std::vector<int64_t>& record_offsets) {
+    mu_.AssertHeld();
+    for (size_t i = 0; i < record_offsets.size(); i++) {
+        int64_t record_end = (i + 1 < record_offsets.size()) ?
+                             record_offsets[i + 1] : buf.size();
+        int64_t payload_offset = record_offsets[i] + kRecordHeaderSize;
+        cache_.push_back(buf.substr(payload_offset, record_end - payload_offset));
+        cache_bytes_ += sizeof(std::string) + cache_.back().size();
+    }
+    while (!cache_.empty() &&
+           (static_cast<int64_t>(cache_.size()) > options_.cache_entries ||
+            cache_bytes_ > options_.cache_size)) {
+        cache_bytes_ -= sizeof(std::string) + cache_.front().size();
+        cache_.pop_front();
+        cache_start_++;
+    }
+}
+
+void BinLogger::TruncateCacheLocked(int64_t new_length) {
+    mu_.AssertHeld();
+    while (!cache_.empty() && cache_start_ + static_cast<int64_t>(cache_.size())
+                              > new_length) {
+        cache_bytes_ -= sizeof(std::string) + cache_.back().size();
+        cache_.pop_back();
+    }
+    if (cache_.empty()) {
+        cache_start_ = new_length;
+    }
+}
+
+// Write the whole pending batch with a single pwrite. mu_ is released during
+// the write so that other appenders can queue up the next batch meanwhile.
+// In group durability mode the batch also shares a single fdatasync, in sync
+// mode every record is written and synced on its own.
+void BinLogger::WritePendingLocked() {
+    mu_.AssertHeld();
+    assert(!writing_);
+    if (pending_offsets_.empty()) {
+        return;
+    }
+    std::string buf;
+    std::vector<int64_t> record_offsets;
+    int64_t last_term = pending_last_term_;
+    if (options_.durability == kDurabilitySync && pending_offsets_.size() > 1) {
+        int64_t record_end = pending_offsets_[1];
+        buf = pending_buf_.substr(0, record_end);
+        pending_buf_.erase(0, record_end);
+        pending_offsets_.erase(pending_offsets_.begin());
+        for (size_t i = 0; i < pending_offsets_.size(); i++) {
+            pending_offsets_[i] -= record_end;
+        }
+        record_offsets.push_back(0);
+        last_term = EntryTerm(buf.substr(kRecordHeaderSize));
     } else {
-        return false;
+        buf.swap(pending_buf_);
+        record_offsets.swap(pending_offsets_);
+    }
+    LogSegment* active = NULL;
+    if (!segments_.empty()) {
+        active = segments_.rbegin()->second;
+    }
+    if (active == NULL || active->file_size >= options_.segment_size) {
+        if (active != NULL && options_.durability == kDurabilityPeriodic
+            && fdatasync(active->fd) != 0) {
+            LOG(FATAL, "failed to sync segment %s err %s",
+                active->file_name.c_str(), strerror(errno));
+            abort();
+        }
+        active = OpenSegment(SegmentFileName(length_), length_);
+        segments_[length_] = active;
+        SyncLogDir();
+        LOG(INFO, "[binlog] roll new segment %s", active->file_name.c_str());
+    }
+    // the active segment is neither removed nor truncated while writing_ is set
+    writing_ = true;
+    int64_t file_offset = active->file_size;
+    bool need_sync = (options_.durability == kDurabilityGroup ||
+                      options_.durability == kDurabilitySync);
+    mu_.Unlock();
+    bool ok = PwriteFully(active->fd, buf.data(), buf.size(), file_offset);
+    if (ok && need_sync) {
+        ok = (fdatasync(active->fd) == 0);
+    }
+    mu_.Lock();
+    writing_ = false;
+    if (!ok) {
+        LOG(FATAL, "failed to write segment %s err %s",
+            active->file_name.c_str(), strerror(errno));
+        abort();
+    }
+    for (size_t i = 0; i < record_offsets.size(); i++) {
+        int64_t slot_index = active->end_index + i;
+        if ((slot_index - active->start_index) % kIndexInterval == 0) {
+            active->offsets.push_back(file_offset + record_offsets[i]);
+        }
+    }
+    active->file_size += buf.size();
+    active->end_index += record_offsets.size();
+    length_ = active->end_index;
+    if (need_sync) {
+        synced_length_ = length_;
+    }
+    last_log_term_ = last_term;
+    unwritten_.erase(unwritten_.begin(), unwritten_.begin() + record_offsets.size());
+    CacheRecordsLocked(buf, record_offsets);
+    write_cond_.Broadcast();
+}
+
+void BinLogger::Fsync() {
+    MutexLock lock(&mu_);
+    while (writing_) {
+        write_cond_.Wait();
+    }
+    if (segments_.empty() || synced_length_ >= length_) {
+        return;
+    }
+    // appends keep queueing up while the active segment is synced
+    LogSegment* active = segments_.rbegin()->second;
+    int64_t length = length_;
+    writing_ = true;
+    mu_.Unlock();
+    bool ok = (fdatasync(active->fd) == 0);
+    mu_.Lock();
+    writing_ = false;
+    write_cond_.Broadcast();
+    if (!ok) {
+        LOG(FATAL, "failed to sync segment %s err %s",
+            active->file_name.c_str(), strerror(errno));
+        abort();
+    }
+    synced_length_ = length;
+}
+
+void BinLogger::FlushPendingLocked() {
+    mu_.AssertHeld();
+    while (writing_ || !pending_offsets_.empty()) {
+        if (writing_) {
+            write_cond_.Wait();
+        } else {
+            WritePendingLocked();
+        }
+    }
+}
+
+void BinLogger::ReloadLastLogTerm() {
+    MutexLock lock(&mu_);
+    last_log_term_ = -1;
+    if (length_ > 0) {
+        LogEntry log_entry;
+        if (ReadSlotLocked(length_ - 1, &log_entry)) {
+            last_log_term_ = log_entry.term;
+        }
     }
 }
 
 bool BinLogger::RemoveSlotBefore(int64_t slot_gc_index) {
-    db_->SetNexusGCKey(slot_gc_index);
+    MutexLock lock(&mu_);
+    // the active segment is never removed, so appends always have a target
+    while (segments_.size() > 1) {
+        LogSegment* segment = segments_.begin()->second;
+        if (segment->end_index > slot_gc_index) {
+            break;
+        }
+        LOG(INFO, "[binlog] remove segment %s, slots [%ld, %ld)",
+            segment->file_name.c_str(), segment->start_index, segment->end_index);
+        segments_.erase(segments_.begin());
+        CloseSegment(segment, true);
+    }
     return true;
 }
 
+void BinLogger::Reset(int64_t start_index, int64_t prev_term) {
+    MutexLock lock(&mu_);
+    FlushPendingLocked();
+    std::map<int64_t, LogSegment*>::iterator it;
+    for (it = segments_.begin(); it != segments_.end(); it++) {
+        CloseSegment(it->second, true);
+    }
+    segments_.clear();
+    // an empty segment keeps the start index over restarts
+    LogSegment* active = OpenSegment(SegmentFileName(start_index), start_index);
+    segments_[start_index] = active;
+    SyncLogDir();
+    length_ = start_index;
+    pending_length_ = start_index;
+    synced_length_ = start_index;
+    last_log_term_ = prev_term;
+    cache_.clear();
+    cache_start_ = start_index;
+    cache_bytes_ = 0;
+    LOG(INFO, "[binlog] reset, start from slot %ld", start_index);
+}
+
 bool BinLogger::ReadSlot(int64_t slot_index, LogEntry* log_entry) {
-    std::string value;
-    std::string key = IntToString(slot_index);
-    leveldb::Status status = db_->Get(leveldb::ReadOptions(), key, &value);
-    if (status.ok()) {
-        LoadLogEntry(value, log_entry);
+    MutexLock lock(&mu_);
+    return ReadSlotLocked(slot_index, log_entry);
+}
+
+bool BinLogger::ReadSlotLocked(int64_t slot_index, LogEntry* log_entry) {
+    mu_.AssertHeld();
+    if (slot_index >= length_ && slot_index < pending_length_) {
+        DecodeEntry(unwritten_[slot_index - length_], log_entry);
+        return true;
+    }
+    if (slot_index >= cache_start_ &&
+        slot_index < cache_start_ + static_cast<int64_t>(cache_.size())) {
+        cache_hits_.Inc();
+        DecodeEntry(cache_[slot_index - cache_start_], log_entry);
         return true;
-    } else if (status.IsNotFound()) {
+    }
+    LogSegment* segment = FindSegment(slot_index);
+    if (segment == NULL) {
         return false;
     }
-    abort();
+    cache_misses_.Inc();
+    std::string buf;
+    if (!ReadRecord(segment, SlotOffset(segment, slot_index), &buf)) {
+        LOG(FATAL, "[binlog] bad record of slot %ld in %s",
+            slot_index, segment->file_name.c_str());
+        abort();
+    }
+    DecodeEntry(buf, log_entry);
+    return true;
 }
 
-void BinLogger::AppendEntryList(
-    const ::google::protobuf::RepeatedPtrField< ::galaxy::ins::Entry >& entries
+// Collect the serialized Entry of up to count slots from start_index.
+// Cached and unwritten slots are copied from memory, the others are read
+// from the segment files with large sequential preads.
+bool BinLogger::ReadRecordsLocked(int64_t start_index, int64_t count,
+                                  int64_t max_bytes,
+                                  std::vector<std::string>* payloads) {
+    mu_.AssertHeld();
+    int64_t end_index = std::min(start_index + count, pending_length_);
+    int64_t slot_index = start_index;
+    int64_t bytes = 0;
+    while (slot_index < end_index && (bytes < max_bytes || slot_index == start_index)) {
+        if (slot_index >= length_) {
+            payloads->push_back(unwritten_[slot_index - length_]);
+            bytes += kRecordHeaderSize + payloads->back().size();
+            slot_index++;
+            continue;
+        }
+        if (slot_index >= cache_start_ &&
+            slot_index < cache_start_ + static_cast<int64_t>(cache_.size())) {
+            cache_hits_.Inc();
+            payloads->push_back(cache_[slot_index - cache_start_]);
+            bytes += kRecordHeaderSize + payloads->back().size();
+            slot_index++;
+            continue;
+        }
+        LogSegment* segment = FindSegment(slot_index);
+        if (segment == NULL) {
+            break;
+        }
+        // walk the segment records until the cached tail or the segment end
+        int64_t seg_end = std::min(end_index, segment->end_index);
+        if (cache_start_ > slot_index) {
+            seg_end = std::min(seg_end, cache_start_);
+        }
+        int64_t offset = SlotOffset(segment, slot_index);
+        RecordReader reader(segment->fd, offset, segment->file_size,
+                            kRecoverChunkSize);
+        while (slot_index < seg_end && (bytes < max_bytes || slot_index == start_index)) {
+            uint32_t header = 0;
+            const char* payload = NULL;
+            uint32_t payload_size = 0;
+            RecordReader::Result ret = reader.Next(&header, &payload, &payload_size);
+            if (ret != RecordReader::kRecordOk) {
+                LOG(FATAL, "[binlog] bad record of slot %ld in %s: %s",
+                    slot_index, segment->file_name.c_str(),
+                    RecordReader::ResultToString(ret));
+                abort();
+            }
+            cache_misses_.Inc();
+            payloads->push_back(std::string(payload, payload_size));
+            if ((header & kEntryFormatFlag) == 0) {
+                LogEntry log_entry;
+                LoadLogEntry(payloads->back(), &log_entry);
+                EncodeEntry(log_entry, &payloads->back());
+            }
+            bytes += HeaderSize(header) + payload_size;
+            slot_index++;
+        }
+    }
+    return slot_index > start_index || start_index >= end_index;
+}
+
+bool BinLogger::ReadRange(int64_t start_index, int64_t count, int64_t max_bytes,
+    ::google::protobuf::RepeatedPtrField< ::galaxy::ins::Entry >* entries
 ) {
-    leveldb::WriteBatch batch;
+    std::vector<std::string> payloads;
+    bool ok = false;
     {
         MutexLock lock(&mu_);
-        int64_t cur_index = length_;
-        std::string next_index = IntToString(length_ + entries.size());
-        for(int i = 0; i < entries.size(); i++) {
-            LogEntry log_entry;
-            std::string buf;
-            log_entry.op = entries.Get(i).op();
-            log_entry.user = entries.Get(i).user();
-            log_entry.key = entries.Get(i).key();
-            log_entry.value = entries.Get(i).value();
-            log_entry.term = entries.Get(i).term();
-            last_log_term_ =  log_entry.term;
-            DumpLogEntry(log_entry, &buf);
-            batch.Put(IntToString(cur_index + i), buf);
+        ok = ReadRecordsLocked(start_index, count, max_bytes, &payloads);
+    }
+    for (size_t i = 0; i < payloads.size(); i++) {
+        if (!entries->Add()->ParseFromString(payloads[i])) {
+            LOG(FATAL, "[binlog] bad entry of slot %ld", start_index + i);
+            abort();
         }
-        batch.Put(length_tag, next_index);
-        leveldb::Status status = db_->Write(leveldb::WriteOptions(), &batch);
-        assert(status.ok());
-        length_ += entries.size();
     }
+    return ok;
 }
 
-void BinLogger::AppendEntry(const LogEntry& log_entry) {
-    std::string buf;
-    DumpLogEntry(log_entry, &buf);
-    std::string cur_index;
-    std::string next_index;
+bool BinLogger::ReadRange(int64_t start_index, int64_t count, int64_t max_bytes,
+    ::google::protobuf::RepeatedPtrField<std::string>* packed_entries,
+    int64_t* last_term
+) {
+    std::vector<std::string> payloads;
+    bool ok = false;
     {
         MutexLock lock(&mu_);
-        cur_index = IntToString(length_);
-        next_index = IntToString(length_ + 1);
-        leveldb::WriteBatch batch;
-        batch.Put(cur_index, buf);
-        batch.Put(length_tag, next_index);
-        leveldb::Status status = db_->Write(leveldb::WriteOptions(), &batch);
-        assert(status.ok());
-        length_++;
-        last_log_term_ = log_entry.term;
+        ok = ReadRecordsLocked(start_index, count, max_bytes, &payloads);
+    }
+    for (size_t i = 0; i < payloads.size(); i++) {
+        packed_entries->Add()->swap(payloads[i]);
+    }
+    if (packed_entries->size() > 0) {
+        *last_term = EntryTerm(packed_entries->Get(packed_entries->size() - 1));
+    }
+    return ok;
+}
+
+void BinLogger::AppendEntryList(
+    const ::google::protobuf::RepeatedPtrField< ::galaxy::ins::Entry >& entries
+) {
+    if (entries.size() == 0) {
+        return;
+    }
+    std::vector<std::string> payloads(entries.size());
+    for(int i = 0; i < entries.size(); i++) {
+        entries.Get(i).SerializeToString(&payloads[i]);
+    }
+    MutexLock lock(&mu_);
+    for (size_t i = 0; i < payloads.size(); i++) {
+        QueueRecord(payloads[i], entries.Get(i).term());
+    }
+    FlushPendingLocked();
+}
+
+void BinLogger::AppendEntryList(
+    const ::google::protobuf::RepeatedPtrField<std::string>& packed_entries
+) {
+    if (packed_entries.size() == 0) {
+        return;
+    }
+    MutexLock lock(&mu_);
+    for (int i = 0; i < packed_entries.size(); i++) {
+        QueueRecord(packed_entries.Get(i), EntryTerm(packed_entries.Get(i)));
+    }
+    FlushPendingLocked();
+}
+
+void BinLogger::AppendEntry(const LogEntry& log_entry) {
+    Sync(AppendEntryAsync(log_entry));
+}
+
+int64_t BinLogger::AppendEntryAsync(const LogEntry& log_entry) {
+    std::string payload;
+    EncodeEntry(log_entry, &payload);
+    MutexLock lock(&mu_);
+    QueueRecord(payload, log_entry.term);
+    return pending_length_ - 1;
+}
+
+void BinLogger::Sync(int64_t slot_index) {
+    MutexLock lock(&mu_);
+    while (length_ <= slot_index) {
+        if (writing_) {
+            write_cond_.Wait();
+        } else if (!pending_offsets_.empty()) {
+            WritePendingLocked();
+        } else {
+            // the slot was truncated before it got written
+            break;
+        }
     }
 }
 
@@ -169,22 +1124,50 @@ void BinLogger::Truncate(int64_t trunk_slot_index) {
 
     {
         MutexLock lock(&mu_);
-        length_ = trunk_slot_index + 1;
-        leveldb::Status status = db_->Put(leveldb::WriteOptions(), 
-                                          length_tag, IntToString(length_));
-        assert(status.ok());
-        if (length_ > 0) {
-            LogEntry log_entry;
-            bool slot_ok = ReadSlot(length_ - 1, &log_entry);
-            assert(slot_ok);
-            last_log_term_ = log_entry.term;
+        FlushPendingLocked();
+        int64_t new_length = trunk_slot_index + 1;
+        if (new_length >= length_) {
+            return;
         }
+        bool removed = false;
+        while (!segments_.empty()) {
+            LogSegment* segment = segments_.rbegin()->second;
+            if (segment->start_index < new_length) {
+                break;
+            }
+            segments_.erase(segment->start_index);
+            CloseSegment(segment, true);
+            removed = true;
+        }
+        if (removed) {
+            SyncLogDir();
+        }
+        if (!segments_.empty()) {
+            LogSegment* segment = segments_.rbegin()->second;
+            int64_t offset = SlotOffset(segment, new_length);
+            if (ftruncate(segment->fd, offset) != 0) {
+                LOG(FATAL, "failed to truncate segment %s",
+                    segment->file_name.c_str());
+                abort();
+            }
+            reclaimed_bytes_ += segment->file_size - offset;
+            segment->file_size = offset;
+            segment->end_index = new_length;
+            segment->offsets.resize(
+                (new_length - segment->start_index + kIndexInterval - 1)
+                / kIndexInterval);
+        }
+        length_ = new_length;
+        pending_length_ = new_length;
+        synced_length_ = std::min(synced_length_, new_length);
+        TruncateCacheLocked(new_length);
     }
+    ReloadLastLogTerm();
 }
 
 void BinLogger::DumpLogEntry(const LogEntry& log_entry, std::string* buf) {
     assert(buf);
-    int32_t total_len = sizeof(uint8_t) 
+    int32_t total_len = sizeof(uint8_t)
                         + sizeof(int32_t) + log_entry.user.size()
                         + sizeof(int32_t) + log_entry.key.size()
                         + sizeof(int32_t) + log_entry.value.size()
@@ -212,7 +1195,7 @@ void BinLogger::DumpLogEntry(const LogEntry& log_entry, std::string* buf) {
 }
 
 void BinLogger::LoadLogEntry(const std::string& buf, LogEntry* log_entry) {
-    assert(log_entry);  
+    assert(log_entry);
     const char* p = buf.data();
     int32_t user_size = 0;
     int32_t key_size = 0;
@@ -239,6 +1222,5 @@ void BinLogger::LoadLogEntry(const std::string& buf, LogEntry* log_entry) {
     memcpy(static_cast<void*>(&log_entry->term), p , sizeof(int64_t));
 }
 
-} //namespace ins 
+} //namespace ins
 } //namespace galaxy
-
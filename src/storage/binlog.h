@@ -2,12 +2,17 @@
 #define GALAXY_SDK_BINGLOG_H_
 
 #include <string>
+#include <deque>
+#include <map>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 #include <boost/function.hpp>
+#include "common/counter.h"
 #include "common/mutex.h"
+#include "common/thread_pool.h"
 #include "proto/ins_node.pb.h"
-#include "leveldb/db.h"
+#include "storage/durability.h"
 
 namespace galaxy {
 namespace ins {
@@ -22,35 +27,154 @@ struct LogEntry {
     }
 };
 
+// One append-only file of the binlog, holding slots [start_index, end_index).
+// offsets[i] is the file offset of slot start_index + i * kIndexInterval,
+// the slots in between are reached by skipping record headers.
+struct LogSegment {
+    int64_t start_index;
+    int64_t end_index;
+    int64_t file_size;
+    int fd;
+    std::string file_name;
+    std::vector<int64_t> offsets;
+    LogSegment() : start_index(0), end_index(0), file_size(0), fd(-1) {
+    }
+};
+
+struct BinLogOptions {
+    // a new segment file is started once the active one reaches this size
+    int64_t segment_size;
+    // limits of the in-memory tail cache
+    int64_t cache_entries;
+    int64_t cache_size;
+    // threads verifying the segments at startup
+    int32_t recover_threads;
+    // when written slots are forced to disk, in periodic mode the owner
+    // is expected to call Fsync from time to time
+    DurabilityMode durability;
+    // bytes per second given back to the file system when removed
+    // segments are reclaimed, 0 for no limit
+    int64_t reclaim_rate;
+    BinLogOptions() : segment_size(64L << 20),
+                      cache_entries(10000),
+                      cache_size(64L << 20),
+                      recover_threads(4),
+                      durability(kDurabilityNone),
+                      reclaim_rate(32L << 20) {
+    }
+};
+
 class BinLogger {
 public:
-    BinLogger(const std::string& data_dir, 
-              bool compress = false,
-              int32_t block_size = 32748,
-              int32_t write_buffer_size = 33554432);
+    BinLogger(const std::string& data_dir,
+              const BinLogOptions& options = BinLogOptions());
     ~BinLogger();
     int64_t GetLength();
+    // GetLength plus the slots queued by AppendEntryAsync and not written
+    // yet, which can already be read
+    int64_t GetAppendedLength();
+    // the first slot still kept on disk, slots before it have been removed
+    int64_t GetFirstIndex();
     bool ReadSlot(int64_t slot_index, LogEntry* log_entry);
+    // read up to count slots from start_index in one sequential pass, stop
+    // early once max_bytes are collected (the first slot is always returned)
+    bool ReadRange(int64_t start_index, int64_t count, int64_t max_bytes,
+       ::google::protobuf::RepeatedPtrField< ::galaxy::ins::Entry >* entries
+    );
+    // same as above, but hand out the stored serialized Entry of each slot
+    bool ReadRange(int64_t start_index, int64_t count, int64_t max_bytes,
+       ::google::protobuf::RepeatedPtrField<std::string>* packed_entries,
+       int64_t* last_term
+    );
     void AppendEntry(const LogEntry& log_entry);
+    // queue an entry into the current group commit batch, return its slot index
+    int64_t AppendEntryAsync(const LogEntry& log_entry);
+    // block until slot_index is written, the first waiter writes the whole batch
+    void Sync(int64_t slot_index);
+    // force all written slots to disk
+    void Fsync();
     void Truncate(int64_t trunc_slot_index);
-    void DumpLogEntry(const LogEntry& log_entry, std::string* buf);
-    void LoadLogEntry(const std::string& buf, LogEntry* log_entry);
+    // record layout of older binlogs, new records hold a serialized Entry
+    static void DumpLogEntry(const LogEntry& log_entry, std::string* buf);
+    static void LoadLogEntry(const std::string& buf, LogEntry* log_entry);
+    // pick the op out of a serialized Entry without parsing the other fields
+    static LogOperation EntryOp(const std::string& buf);
     void AppendEntryList(
        const ::google::protobuf::RepeatedPtrField< ::galaxy::ins::Entry > &entries
     );
-    bool RemoveSlot(int64_t slot_index);
+    // append serialized Entry records as they are
+    void AppendEntryList(
+       const ::google::protobuf::RepeatedPtrField<std::string>& packed_entries
+    );
     bool RemoveSlotBefore(int64_t slot_gc_index);
+    // drop the whole log and continue at start_index, used once a snapshot
+    // covering all slots before start_index has been installed
+    void Reset(int64_t start_index, int64_t prev_term);
     static std::string IntToString(int64_t num);
     static int64_t StringToInt(const std::string& s);
     void GetLastLogIndexAndTerm(int64_t* last_log_index, int64_t* last_log_term);
+    void GetCacheStat(int64_t* hits, int64_t* misses);
+    // bytes of removed slots given back to the file system so far,
+    // and bytes still waiting for the reclaimer
+    void GetReclaimStat(int64_t* reclaimed_bytes, int64_t* pending_bytes);
+private:
+    void LoadSegments();
+    void ImportLegacyLog(const std::string& legacy_name);
+    LogSegment* OpenSegment(const std::string& file_name, int64_t start_index);
+    void RecoverSegment(LogSegment* segment, bool is_last);
+    void CloseSegment(LogSegment* segment, bool remove_file);
+    void ReclaimStep();
+    void SyncLogDir();
+    LogSegment* FindSegment(int64_t slot_index);
+    int64_t SlotOffset(LogSegment* segment, int64_t slot_index);
+    bool ReadSlotLocked(int64_t slot_index, LogEntry* log_entry);
+    bool ReadRecord(LogSegment* segment, int64_t offset, std::string* buf);
+    bool ReadRecordsLocked(int64_t start_index, int64_t count, int64_t max_bytes,
+                           std::vector<std::string>* payloads);
+    void AppendRecord(const std::string& payload, std::string* buf);
+    void QueueRecord(const std::string& payload, int64_t term);
+    void WritePendingLocked();
+    void FlushPendingLocked();
+    void ReloadLastLogTerm();
+    void CacheRecordsLocked(const std::string& buf,
+                            const std::vector<int64_t>& record_offsets);
+    void TruncateCacheLocked(int64_t new_length);
 private:
-    leveldb::DB* db_;
+    std::string log_dir_;
+    BinLogOptions options_;
+    std::map<int64_t, LogSegment*> segments_;
     int64_t length_;
     int64_t last_log_term_;
+    // group commit batch, slots [length_, pending_length_) are not written yet
+    std::string pending_buf_;
+    std::vector<int64_t> pending_offsets_;
+    int64_t pending_last_term_;
+    int64_t pending_length_;
+    // serialized Entry of slots [length_, pending_length_), readable before
+    // they are written
+    std::deque<std::string> unwritten_;
+    bool writing_;
+    // slots [0, synced_length_) have been forced to disk by Fsync
+    int64_t synced_length_;
+    // serialized Entry of the most recent written slots,
+    // slots [cache_start_, cache_start_ + cache_.size())
+    std::deque<std::string> cache_;
+    int64_t cache_start_;
+    int64_t cache_bytes_;
+    Counter cache_hits_;
+    Counter cache_misses_;
+    // removed segments, already unlinked but still open, so their space
+    // is freed bit by bit by ftruncate instead of all at once on close
+    std::deque<LogSegment*> reclaim_queue_;
+    bool reclaiming_;
+    int64_t reclaimed_bytes_;
+    int64_t reclaim_pending_bytes_;
+    ThreadPool reclaimer_;
     Mutex mu_;
+    CondVar write_cond_;
 };
 
-} //namespace ins 
+} //namespace ins
 } //namespace galaxy
 
 #endif
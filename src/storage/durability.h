@@ -0,0 +1,40 @@
+#ifndef GALAXY_INS_DURABILITY_H_
+#define GALAXY_INS_DURABILITY_H_
+
+#include <string>
+
+namespace galaxy {
+namespace ins {
+
+// When binlog, meta and data writes are forced to disk
+enum DurabilityMode {
+    // left to the page cache
+    kDurabilityNone = 0,
+    // fsync in the background every ins_durability_sync_interval ms
+    kDurabilityPeriodic = 1,
+    // one fsync for each batch of writes
+    kDurabilityGroup = 2,
+    // one fsync for each write
+    kDurabilitySync = 3
+};
+
+static inline bool ParseDurabilityMode(const std::string& name,
+                                       DurabilityMode* mode) {
+    if (name == "none") {
+        *mode = kDurabilityNone;
+    } else if (name == "periodic") {
+        *mode = kDurabilityPeriodic;
+    } else if (name == "group") {
+        *mode = kDurabilityGroup;
+    } else if (name == "sync") {
+        *mode = kDurabilitySync;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+} //namespace ins
+} //namespace galaxy
+
+#endif
@@ -1,35 +1,66 @@
 #include "meta.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <string>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <gflags/gflags.h>
+#include "common/crc32c.h"
 #include "common/logging.h"
 #include "utils.h"
 #include "server/user_manage.h"
 
+DECLARE_string(ins_durability_mode);
+
 namespace galaxy {
 namespace ins {
 
+const std::string state_file_name = "state.data";
+const std::string root_file_name = "root.data";
+// text files appending every term and vote, replaced by state.data
 const std::string term_file_name = "term.data";
 const std::string vote_file_name = "vote.data";
-const std::string root_file_name = "root.data";
+
+// a slot is [masked crc32c: fixed32][sequence: fixed64][current term: fixed64]
+// [vote term: fixed64][voted for length: fixed32][voted for],
+// the crc covers everything after itself
+const static int64_t kStateSlotSize = 512;
+const static int64_t kStateHeaderSize = 32;
+const static int64_t kStateMaxIdSize = kStateSlotSize - kStateHeaderSize;
 
 Meta::Meta(const std::string& data_dir) : data_dir_(data_dir),
-                                          term_file_(NULL),
-                                          vote_file_(NULL),
+                                          durability_(kDurabilityNone),
+                                          state_fd_(-1),
+                                          state_seq_(0),
+                                          current_term_(0),
+                                          vote_term_(-1),
                                           root_file_(NULL) {
+    if (!ParseDurabilityMode(FLAGS_ins_durability_mode, &durability_)) {
+        LOG(FATAL, "unknown durability mode: %s",
+            FLAGS_ins_durability_mode.c_str());
+        abort();
+    }
     bool ok = ins_common::Mkdirs(data_dir.c_str());
     if (!ok) {
         LOG(FATAL, "failed to create dir :%s", data_dir.c_str());
         abort();
     }
-    term_file_ = fopen((data_dir + "/" + term_file_name).c_str(), "a+");
-    vote_file_ = fopen((data_dir + "/" + vote_file_name).c_str(), "a+");
+    std::string state_file = data_dir + "/" + state_file_name;
+    state_fd_ = open(state_file.c_str(), O_RDWR | O_CREAT, 0644);
+    if (state_fd_ < 0) {
+        LOG(FATAL, "failed to open %s err %s",
+            state_file.c_str(), strerror(errno));
+        abort();
+    }
+    if (!LoadState()) {
+        ImportLegacyState();
+    }
     root_file_ = fopen((data_dir + "/" + root_file_name).c_str(), "r+");
-    assert(term_file_);
-    assert(vote_file_);
     if (root_file_ == NULL) {
         root_file_ = fopen((data_dir + "/" + root_file_name).c_str(), "w+");
         assert(root_file_);
@@ -37,31 +68,121 @@ Meta::Meta(const std::string& data_dir) : data_dir_(data_dir),
 }
 
 Meta::~Meta() {
-    fclose(term_file_);
-    fclose(vote_file_);
+    close(state_fd_);
     fclose(root_file_);
 }
 
-int64_t Meta::ReadCurrentTerm() {
-    int64_t cur_term = 0, tmp = 0;
-    while(fscanf(term_file_, "%ld", &tmp) == 1) {
-        cur_term = tmp;
+bool Meta::LoadState() {
+    bool found = false;
+    for (int64_t slot = 0; slot < 2; slot++) {
+        char buf[kStateSlotSize];
+        ssize_t ret = pread(state_fd_, buf, kStateSlotSize, slot * kStateSlotSize);
+        if (ret < kStateHeaderSize) {
+            continue;
+        }
+        uint32_t masked_crc = 0;
+        uint64_t seq = 0;
+        int64_t current_term = 0;
+        int64_t vote_term = 0;
+        uint32_t id_size = 0;
+        memcpy(&masked_crc, buf, sizeof(masked_crc));
+        memcpy(&seq, buf + 4, sizeof(seq));
+        memcpy(&current_term, buf + 12, sizeof(current_term));
+        memcpy(&vote_term, buf + 20, sizeof(vote_term));
+        memcpy(&id_size, buf + 28, sizeof(id_size));
+        if (id_size > kStateMaxIdSize || kStateHeaderSize + id_size > ret) {
+            continue;
+        }
+        if (ins_common::crc32c::Unmask(masked_crc) !=
+            ins_common::crc32c::Value(buf + 4, kStateHeaderSize - 4 + id_size)) {
+            LOG(WARNING, "[meta] checksum mismatch in slot %ld", slot);
+            continue;
+        }
+        if (found && seq <= state_seq_) {
+            continue;
+        }
+        found = true;
+        state_seq_ = seq;
+        current_term_ = current_term;
+        vote_term_ = vote_term;
+        voted_for_.assign(buf + kStateHeaderSize, id_size);
     }
-    return cur_term;
+    return found;
+}
+
+void Meta::ImportLegacyState() {
+    std::string term_file = data_dir_ + "/" + term_file_name;
+    std::string vote_file = data_dir_ + "/" + vote_file_name;
+    FILE* fp = fopen(term_file.c_str(), "r");
+    if (fp != NULL) {
+        int64_t tmp = 0;
+        while(fscanf(fp, "%ld", &tmp) == 1) {
+            current_term_ = tmp;
+        }
+        fclose(fp);
+    }
+    fp = fopen(vote_file.c_str(), "r");
+    if (fp != NULL) {
+        int64_t term = 0;
+        char server_id[1024] = {'\0'};
+        while(fscanf(fp, "%ld %1023s", &term, server_id) == 2) {
+            vote_term_ = term;
+            voted_for_ = server_id;
+        }
+        fclose(fp);
+    }
+    if (current_term_ == 0 && voted_for_.empty()) {
+        return;
+    }
+    LOG(INFO, "[meta] import legacy term %ld, vote %ld:%s",
+        current_term_, vote_term_, voted_for_.c_str());
+    WriteState();
+    // the legacy files are only dropped once the new state is on disk
+    SyncFile(state_fd_, state_file_name.c_str());
+    unlink(term_file.c_str());
+    unlink(vote_file.c_str());
+}
+
+// Write the state to the slot not holding the latest one
+void Meta::WriteState() {
+    if (static_cast<int64_t>(voted_for_.size()) > kStateMaxIdSize) {
+        LOG(FATAL, "Meta::WriteState failed, server id too long: %s",
+            voted_for_.c_str());
+        abort();
+    }
+    char buf[kStateSlotSize];
+    uint64_t seq = state_seq_ + 1;
+    uint32_t id_size = voted_for_.size();
+    memcpy(buf + 4, &seq, sizeof(seq));
+    memcpy(buf + 12, &current_term_, sizeof(current_term_));
+    memcpy(buf + 20, &vote_term_, sizeof(vote_term_));
+    memcpy(buf + 28, &id_size, sizeof(id_size));
+    memcpy(buf + kStateHeaderSize, voted_for_.data(), id_size);
+    uint32_t masked_crc = ins_common::crc32c::Mask(
+        ins_common::crc32c::Value(buf + 4, kStateHeaderSize - 4 + id_size));
+    memcpy(buf, &masked_crc, sizeof(masked_crc));
+    int64_t size = kStateHeaderSize + id_size;
+    int64_t offset = static_cast<int64_t>(seq % 2) * kStateSlotSize;
+    if (pwrite(state_fd_, buf, size, offset) != size) {
+        LOG(FATAL, "Meta::WriteState failed, term:%ld, err:%s",
+            current_term_, strerror(errno));
+        abort();
+    }
+    state_seq_ = seq;
+    // term and vote are rare writes, there is nothing to batch them with
+    if (durability_ == kDurabilityGroup || durability_ == kDurabilitySync) {
+        SyncFile(state_fd_, state_file_name.c_str());
+    }
+}
+
+int64_t Meta::ReadCurrentTerm() {
+    return current_term_;
 }
 
 void Meta::ReadVotedFor(std::map<int64_t, std::string>& voted_for) {
     voted_for.clear();
-    int64_t term = 0;
-    char server_id[1024] = {'\0'};
-    int64_t last_term;
-    std::string last_vote_for;
-    while(fscanf(vote_file_, "%ld %1023s", &term, server_id) == 2) {
-        last_term = term;
-        last_vote_for = server_id;
-    }
-    if (!last_vote_for.empty()) {
-        voted_for[last_term] = std::string(last_vote_for);
+    if (!voted_for_.empty()) {
+        voted_for[vote_term_] = voted_for_;
     }
 }
 
@@ -79,20 +200,22 @@ UserInfo Meta::ReadRootInfo() {
 }
 
 void Meta::WriteCurrentTerm(int64_t current_term) {
-    fprintf(term_file_, "%ld\n", current_term);
-    if (fflush(term_file_) != 0) {
-        LOG(FATAL, "Meta::WriteCurrentTerm failed, term:%ld", current_term);
-        abort();
+    current_term_ = current_term;
+    // a vote only counts in its own term
+    if (vote_term_ < current_term) {
+        vote_term_ = -1;
+        voted_for_.clear();
     }
+    WriteState();
 }
 
 void Meta::WriteVotedFor(int64_t term, const std::string& server_id) {
-    fprintf(vote_file_, "%ld %s\n", term, server_id.c_str());
-    if (fflush(vote_file_) != 0) {
-        LOG(FATAL, "Meta::WriteVotedFor failed, term:%ld, server_id:%s",
-            term, server_id.c_str());
-        abort();
+    if (term > current_term_) {
+        current_term_ = term;
     }
+    vote_term_ = term;
+    voted_for_ = server_id;
+    WriteState();
 }
 
 void Meta::WriteRootInfo(const UserInfo& user) {
@@ -106,8 +229,26 @@ void Meta::WriteRootInfo(const UserInfo& user) {
             user.username().c_str());
         abort();
     }
+    if (durability_ == kDurabilityGroup || durability_ == kDurabilitySync) {
+        SyncFile(fileno(root_file_), root_file_name.c_str());
+    }
+}
+
+void Meta::Sync() {
+    if (durability_ == kDurabilityNone) {
+        return;
+    }
+    SyncFile(state_fd_, state_file_name.c_str());
+    SyncFile(fileno(root_file_), root_file_name.c_str());
+}
+
+void Meta::SyncFile(int fd, const char* file_name) {
+    if (fdatasync(fd) != 0) {
+        LOG(FATAL, "Meta::SyncFile failed, file:%s, err:%s",
+            file_name, strerror(errno));
+        abort();
+    }
 }
 
 } //namespace ins
 } //namespace galaxy
-
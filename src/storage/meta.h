@@ -5,12 +5,17 @@
 #include <map>
 #include <stdint.h>
 #include "proto/ins_node.pb.h"
+#include "storage/durability.h"
 
 namespace galaxy {
 namespace ins {
 
 class UserManager;
 
+// Term and vote live in one small file with two fixed size slots. Each
+// write goes to the slot not holding the latest state, so a torn write
+// leaves the previous state readable; the slot with the highest sequence
+// and a good checksum wins on load.
 class Meta {
 public:
     Meta(const std::string& data_dir);
@@ -21,10 +26,21 @@ public:
     void WriteCurrentTerm(int64_t term); 
     void WriteVotedFor(int64_t term, const std::string& server_id);
     void WriteRootInfo(const UserInfo& root);
+    // force all meta files to disk, used by the periodic durability mode
+    void Sync();
+private:
+    bool LoadState();
+    void ImportLegacyState();
+    void WriteState();
+    void SyncFile(int fd, const char* file_name);
 private:
     std::string data_dir_;
-    FILE* term_file_;
-    FILE* vote_file_;
+    DurabilityMode durability_;
+    int state_fd_;
+    uint64_t state_seq_;
+    int64_t current_term_;
+    int64_t vote_term_;
+    std::string voted_for_;
     FILE* root_file_;
 };
 
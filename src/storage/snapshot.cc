@@ -0,0 +1,194 @@
+#include "snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "common/crc32c.h"
+#include "common/logging.h"
+
+namespace galaxy {
+namespace ins {
+
+const static int64_t kSnapshotHeaderSize = 2 * sizeof(uint32_t);
+const static int64_t kSnapshotReadSize = (1 << 20);
+// a record larger than this is taken as a broken header
+const static uint32_t kSnapshotMaxRecordSize = (256 << 20);
+
+SnapshotWriter::SnapshotWriter(const std::string& file_name)
+    : file_name_(file_name), fp_(NULL) {
+}
+
+SnapshotWriter::~SnapshotWriter() {
+    if (fp_ != NULL) {
+        fclose(fp_);
+        fp_ = NULL;
+    }
+}
+
+bool SnapshotWriter::Open(const SnapshotMeta& meta) {
+    fp_ = fopen(file_name_.c_str(), "w");
+    if (fp_ == NULL) {
+        LOG(WARNING, "[snapshot] failed to create %s err %s",
+            file_name_.c_str(), strerror(errno));
+        return false;
+    }
+    return AddRecord(meta);
+}
+
+bool SnapshotWriter::Add(const SnapshotItem& item) {
+    return AddRecord(item);
+}
+
+bool SnapshotWriter::AddRecord(const ::google::protobuf::Message& message) {
+    if (fp_ == NULL) {
+        return false;
+    }
+    if (!message.SerializeToString(&buf_)) {
+        return false;
+    }
+    uint32_t size = buf_.size();
+    uint32_t masked_crc = ins_common::crc32c::Mask(
+        ins_common::crc32c::Value(buf_.data(), buf_.size()));
+    if (fwrite(&size, sizeof(size), 1, fp_) != 1 ||
+        fwrite(&masked_crc, sizeof(masked_crc), 1, fp_) != 1 ||
+        fwrite(buf_.data(), 1, buf_.size(), fp_) != buf_.size()) {
+        LOG(WARNING, "[snapshot] failed to write %s err %s",
+            file_name_.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool SnapshotWriter::Close() {
+    if (fp_ == NULL) {
+        return false;
+    }
+    bool ok = (fflush(fp_) == 0 && fsync(fileno(fp_)) == 0);
+    if (fclose(fp_) != 0) {
+        ok = false;
+    }
+    fp_ = NULL;
+    if (!ok) {
+        LOG(WARNING, "[snapshot] failed to sync %s err %s",
+            file_name_.c_str(), strerror(errno));
+    }
+    return ok;
+}
+
+SnapshotReader::SnapshotReader(const std::string& file_name)
+    : file_name_(file_name), fd_(-1), file_size_(0), offset_(0),
+      error_(false), buf_offset_(0) {
+}
+
+SnapshotReader::~SnapshotReader() {
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+}
+
+bool SnapshotReader::Open(SnapshotMeta* meta) {
+    fd_ = open(file_name_.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+        return false;
+    }
+    file_size_ = st.st_size;
+    if (!NextRecord(meta)) {
+        LOG(WARNING, "[snapshot] no meta in %s", file_name_.c_str());
+        error_ = true;
+        return false;
+    }
+    return true;
+}
+
+bool SnapshotReader::Next(SnapshotItem* item) {
+    return NextRecord(item);
+}
+
+bool SnapshotReader::NextRecord(::google::protobuf::Message* message) {
+    if (fd_ < 0 || error_ || offset_ == file_size_) {
+        return false;
+    }
+    uint32_t size = 0;
+    uint32_t masked_crc = 0;
+    std::string header;
+    if (!ReadChunk(offset_, kSnapshotHeaderSize, &header)) {
+        error_ = true;
+        return false;
+    }
+    memcpy(&size, header.data(), sizeof(uint32_t));
+    memcpy(&masked_crc, header.data() + sizeof(uint32_t), sizeof(uint32_t));
+    std::string payload;
+    if (size > kSnapshotMaxRecordSize ||
+        !ReadChunk(offset_ + kSnapshotHeaderSize, size, &payload)) {
+        LOG(WARNING, "[snapshot] truncated record in %s at %ld",
+            file_name_.c_str(), offset_);
+        error_ = true;
+        return false;
+    }
+    if (ins_common::crc32c::Unmask(masked_crc) !=
+        ins_common::crc32c::Value(payload.data(), payload.size())) {
+        LOG(WARNING, "[snapshot] checksum mismatch in %s at %ld",
+            file_name_.c_str(), offset_);
+        error_ = true;
+        return false;
+    }
+    if (!message->ParseFromString(payload)) {
+        LOG(WARNING, "[snapshot] bad record in %s at %ld",
+            file_name_.c_str(), offset_);
+        error_ = true;
+        return false;
+    }
+    offset_ += kSnapshotHeaderSize + size;
+    return true;
+}
+
+// Reads are served from a buffer of kSnapshotReadSize bytes,
+// so scanning the records needs few preads.
+bool SnapshotReader::ReadChunk(int64_t offset, int64_t size, std::string* data) {
+    if (fd_ < 0 || offset < 0 || offset + size > file_size_) {
+        return false;
+    }
+    if (offset < buf_offset_ ||
+        offset + size > buf_offset_ + static_cast<int64_t>(buf_.size())) {
+        int64_t read_size = std::max(size, std::min(kSnapshotReadSize,
+                                                    file_size_ - offset));
+        buf_.resize(read_size);
+        int64_t done = 0;
+        while (done < read_size) {
+            ssize_t ret = pread(fd_, &buf_[done], read_size - done, offset + done);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                buf_.clear();
+                return false;
+            }
+            done += ret;
+        }
+        buf_offset_ = offset;
+    }
+    data->assign(buf_.data() + (offset - buf_offset_), size);
+    return true;
+}
+
+bool SnapshotReader::Verify(const std::string& file_name, SnapshotMeta* meta) {
+    SnapshotReader reader(file_name);
+    if (!reader.Open(meta)) {
+        return false;
+    }
+    SnapshotItem item;
+    while (reader.Next(&item)) {
+    }
+    return !reader.error();
+}
+
+} //namespace ins
+} //namespace galaxy
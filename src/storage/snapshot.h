@@ -0,0 +1,66 @@
+#ifndef GALAXY_INS_SNAPSHOT_H_
+#define GALAXY_INS_SNAPSHOT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include "proto/ins_node.pb.h"
+
+namespace galaxy {
+namespace ins {
+
+// A snapshot file is a sequence of crc checked records, each one is
+// [payload length: fixed32][masked crc32c: fixed32][payload].
+// The first record holds a SnapshotMeta, the others hold SnapshotItem.
+
+class SnapshotWriter {
+public:
+    SnapshotWriter(const std::string& file_name);
+    ~SnapshotWriter();
+    bool Open(const SnapshotMeta& meta);
+    bool Add(const SnapshotItem& item);
+    // flush and sync the file, it is complete only after Close succeeds
+    bool Close();
+private:
+    bool AddRecord(const ::google::protobuf::Message& message);
+private:
+    std::string file_name_;
+    FILE* fp_;
+    std::string buf_;
+};
+
+class SnapshotReader {
+public:
+    SnapshotReader(const std::string& file_name);
+    ~SnapshotReader();
+    // read the meta record, must be called before anything else
+    bool Open(SnapshotMeta* meta);
+    // return false at the end of the file or on a broken record,
+    // the two are told apart by error()
+    bool Next(SnapshotItem* item);
+    bool error() const {
+        return error_;
+    }
+    int64_t file_size() const {
+        return file_size_;
+    }
+    // raw bytes of the file, used to ship it to other nodes
+    bool ReadChunk(int64_t offset, int64_t size, std::string* data);
+    // read through the whole file and check every record
+    static bool Verify(const std::string& file_name, SnapshotMeta* meta);
+private:
+    bool NextRecord(::google::protobuf::Message* message);
+private:
+    std::string file_name_;
+    int fd_;
+    int64_t file_size_;
+    int64_t offset_;
+    bool error_;
+    std::string buf_;
+    int64_t buf_offset_;
+};
+
+} //namespace ins
+} //namespace galaxy
+
+#endif
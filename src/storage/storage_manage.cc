@@ -1,26 +1,39 @@
 #include "storage_manage.h"
 
 #include <assert.h>
+#include <dirent.h>
 #include <gflags/gflags.h>
+#include <boost/bind.hpp>
 #include "common/logging.h"
 #include "leveldb/db.h"
+#include "leveldb/write_batch.h"
 #include "utils.h"
 
 DECLARE_bool(ins_data_compress);
 DECLARE_int32(ins_data_block_size);
 DECLARE_int32(ins_data_write_buffer_size);
+DECLARE_string(ins_durability_mode);
+DECLARE_int32(ins_apply_threads);
 
 namespace galaxy {
 namespace ins {
 
 const std::string StorageManager::anonymous_user = "";
+const std::string db_suffix = "@db";
 
-StorageManager::StorageManager(const std::string& data_dir) : data_dir_(data_dir) {
+StorageManager::StorageManager(const std::string& data_dir)
+    : data_dir_(data_dir), durability_(kDurabilityNone), write_pool_(NULL) {
     bool ok = ins_common::Mkdirs(data_dir.c_str());
     if (!ok) {
         LOG(FATAL, "failed to create dir :%s", data_dir.c_str());
         abort();
     }
+    if (!ParseDurabilityMode(FLAGS_ins_durability_mode, &durability_)) {
+        LOG(FATAL, "unknown durability mode: %s",
+            FLAGS_ins_durability_mode.c_str());
+        abort();
+    }
+    write_options_.sync = (durability_ == kDurabilitySync);
     // Create default database for shared namespace, i.e. anonymous user
     std::string full_name = data_dir + "/@db";
     leveldb::Options options;
@@ -38,9 +51,13 @@ StorageManager::StorageManager(const std::string& data_dir) : data_dir_(data_dir
     leveldb::Status status = leveldb::DB::Open(options, full_name, &default_db);
     assert(status.ok());
     dbs_[""] = default_db;
+    if (FLAGS_ins_apply_threads > 1) {
+        write_pool_ = new ThreadPool(FLAGS_ins_apply_threads);
+    }
 }
 
 StorageManager::~StorageManager() {
+    delete write_pool_;
     MutexLock lock(&mu_);
     for (std::map<std::string, leveldb::DB*>::iterator it = dbs_.begin();
          it != dbs_.end(); ++it) {
@@ -126,8 +143,11 @@ Status StorageManager::Put(const std::string& name,
             LOG(WARNING, "Try to access a closing database :%s", name.c_str());
             return kError;
         }
+        if (durability_ == kDurabilityPeriodic || durability_ == kDurabilityGroup) {
+            dirty_dbs_.insert(name);
+        }
     }
-    leveldb::Status status = db_ptr->Put(leveldb::WriteOptions(), key, value);
+    leveldb::Status status = db_ptr->Put(write_options_, key, value);
     return (status.ok()) ? kOk : kError;
 }
 
@@ -145,12 +165,157 @@ Status StorageManager::Delete(const std::string& name,
             LOG(WARNING, "Try to access a closing database :%s", name.c_str());
             return kError;
         }
+        if (durability_ == kDurabilityPeriodic || durability_ == kDurabilityGroup) {
+            dirty_dbs_.insert(name);
+        }
     }
-    leveldb::Status status = db_ptr->Delete(leveldb::WriteOptions(), key);
+    leveldb::Status status = db_ptr->Delete(write_options_, key);
     // Note: leveldb returns kOk even if the key is inexist
     return (status.ok()) ? kOk : kError;
 }
 
+Status StorageManager::Sync() {
+    std::vector<leveldb::DB*> dirty_dbs;
+    leveldb::DB* default_db = NULL;
+    {
+        MutexLock lock(&mu_);
+        for (std::set<std::string>::iterator it = dirty_dbs_.begin();
+             it != dirty_dbs_.end(); ++it) {
+            std::map<std::string, leveldb::DB*>::iterator dbs_it = dbs_.find(*it);
+            if (dbs_it == dbs_.end() || dbs_it->second == NULL) {
+                continue;
+            }
+            if (*it == anonymous_user) {
+                default_db = dbs_it->second;
+            } else {
+                dirty_dbs.push_back(dbs_it->second);
+            }
+        }
+        dirty_dbs_.clear();
+    }
+    if (default_db != NULL) {
+        dirty_dbs.push_back(default_db);
+    }
+    // a synced write flushes the log of the database along with all
+    // the writes before it
+    leveldb::WriteOptions options;
+    options.sync = true;
+    for (size_t i = 0; i < dirty_dbs.size(); i++) {
+        leveldb::WriteBatch empty_batch;
+        leveldb::Status status = dirty_dbs[i]->Write(options, &empty_batch);
+        if (!status.ok()) {
+            LOG(WARNING, "failed to sync database: %s", status.ToString().c_str());
+            return kError;
+        }
+    }
+    return kOk;
+}
+
+void StorageManager::Batch::Put(const std::string& name,
+                                const std::string& key,
+                                const std::string& value) {
+    batches_[name].Put(key, value);
+}
+
+void StorageManager::Batch::Delete(const std::string& name,
+                                   const std::string& key) {
+    batches_[name].Delete(key);
+}
+
+struct StorageManager::ParallelWrite {
+    Mutex mu;
+    CondVar done_cond;
+    int32_t pending;
+    Status status;
+    ParallelWrite() : done_cond(&mu), pending(0), status(kOk) {
+    }
+};
+
+Status StorageManager::Write(Batch* batch) {
+    std::vector<std::pair<std::string, leveldb::WriteBatch*> > user_batches;
+    std::map<std::string, leveldb::WriteBatch>::iterator it;
+    for (it = batch->batches_.begin(); it != batch->batches_.end(); ++it) {
+        if (it->first != anonymous_user) {
+            user_batches.push_back(std::make_pair(it->first, &it->second));
+        }
+    }
+    ParallelWrite state;
+    if (write_pool_ != NULL && user_batches.size() > 1) {
+        state.pending = user_batches.size();
+        // the caller takes the first database itself
+        for (size_t i = 1; i < user_batches.size(); i++) {
+            write_pool_->AddTask(boost::bind(&StorageManager::WriteDatabaseTask,
+                                             this, user_batches[i].first,
+                                             user_batches[i].second, &state));
+        }
+        WriteDatabaseTask(user_batches[0].first, user_batches[0].second, &state);
+        MutexLock lock(&state.mu);
+        while (state.pending > 0) {
+            state.done_cond.Wait();
+        }
+    } else {
+        for (size_t i = 0; i < user_batches.size(); i++) {
+            state.pending = 1;
+            WriteDatabaseTask(user_batches[i].first, user_batches[i].second,
+                              &state);
+            if (state.status != kOk) {
+                break;
+            }
+        }
+    }
+    Status s = state.status;
+    if (s != kOk) {
+        return s;
+    }
+    it = batch->batches_.find(anonymous_user);
+    if (it != batch->batches_.end()) {
+        s = WriteDatabase(it->first, &it->second);
+    }
+    if (s == kOk) {
+        batch->Clear();
+    }
+    return s;
+}
+
+void StorageManager::WriteDatabaseTask(const std::string& name,
+                                       leveldb::WriteBatch* batch,
+                                       ParallelWrite* state) {
+    Status s = WriteDatabase(name, batch);
+    if (s == kUnknownUser && OpenDatabase(name)) {
+        s = WriteDatabase(name, batch);
+    }
+    MutexLock lock(&state->mu);
+    if (s != kOk) {
+        LOG(WARNING, "failed to write database: %s", name.c_str());
+        state->status = s;
+    }
+    state->pending--;
+    if (state->pending == 0) {
+        state->done_cond.Signal();
+    }
+}
+
+Status StorageManager::WriteDatabase(const std::string& name,
+                                     leveldb::WriteBatch* batch) {
+    leveldb::DB* db_ptr = NULL;
+    {
+        MutexLock lock(&mu_);
+        if (dbs_.find(name) == dbs_.end()) {
+            return kUnknownUser;
+        }
+        db_ptr = dbs_[name];
+        if (db_ptr == NULL) {
+            LOG(WARNING, "Try to access a closing database :%s", name.c_str());
+            return kError;
+        }
+        if (durability_ == kDurabilityPeriodic || durability_ == kDurabilityGroup) {
+            dirty_dbs_.insert(name);
+        }
+    }
+    leveldb::Status status = db_ptr->Write(write_options_, batch);
+    return (status.ok()) ? kOk : kError;
+}
+
 std::string StorageManager::Iterator::key() const {
     return (it_ != NULL) ? it_->key().ToString() : "";
 }
@@ -209,5 +374,83 @@ StorageManager::Iterator *StorageManager::NewIterator(const std::string& name) {
     return new StorageManager::Iterator(db_ptr, leveldb::ReadOptions());
 }
 
+void StorageManager::ListDatabases(std::vector<std::string>* names) {
+    DIR* dir = opendir(data_dir_.c_str());
+    if (dir == NULL) {
+        LOG(WARNING, "failed to open dir :%s", data_dir_.c_str());
+        return;
+    }
+    struct dirent* ent = NULL;
+    while ((ent = readdir(dir)) != NULL) {
+        std::string file_name = ent->d_name;
+        if (file_name.size() < db_suffix.size() ||
+            file_name.compare(file_name.size() - db_suffix.size(),
+                              db_suffix.size(), db_suffix) != 0) {
+            continue;
+        }
+        names->push_back(file_name.substr(0, file_name.size() - db_suffix.size()));
+    }
+    closedir(dir);
+}
+
+void StorageManager::GetSnapshots(std::vector<DatabaseSnapshot>* snapshots) {
+    std::vector<std::string> names;
+    ListDatabases(&names);
+    for (size_t i = 0; i < names.size(); i++) {
+        if (!OpenDatabase(names[i])) {
+            LOG(WARNING, "failed to open database :%s", names[i].c_str());
+        }
+    }
+    MutexLock lock(&mu_);
+    for (std::map<std::string, leveldb::DB*>::iterator it = dbs_.begin();
+         it != dbs_.end(); ++it) {
+        if (it->second == NULL) {
+            continue;
+        }
+        DatabaseSnapshot snapshot;
+        snapshot.name = it->first;
+        snapshot.db = it->second;
+        snapshot.snapshot = it->second->GetSnapshot();
+        snapshots->push_back(snapshot);
+    }
+}
+
+StorageManager::Iterator *StorageManager::NewIterator(const DatabaseSnapshot& snapshot) {
+    leveldb::ReadOptions options;
+    options.snapshot = snapshot.snapshot;
+    options.fill_cache = false;
+    return new StorageManager::Iterator(snapshot.db, options);
+}
+
+void StorageManager::ReleaseSnapshots(const std::vector<DatabaseSnapshot>& snapshots) {
+    for (size_t i = 0; i < snapshots.size(); i++) {
+        snapshots[i].db->ReleaseSnapshot(snapshots[i].snapshot);
+    }
+}
+
+bool StorageManager::ClearAllDatabases() {
+    {
+        MutexLock lock(&mu_);
+        for (std::map<std::string, leveldb::DB*>::iterator it = dbs_.begin();
+             it != dbs_.end(); ++it) {
+            delete it->second;
+            it->second = NULL;
+        }
+        dbs_.clear();
+    }
+    std::vector<std::string> names;
+    ListDatabases(&names);
+    for (size_t i = 0; i < names.size(); i++) {
+        std::string full_name = data_dir_ + "/" + names[i] + db_suffix;
+        leveldb::Status status = leveldb::DestroyDB(full_name, leveldb::Options());
+        if (!status.ok()) {
+            LOG(WARNING, "failed to destroy database %s err %s",
+                full_name.c_str(), status.ToString().c_str());
+            return false;
+        }
+    }
+    return OpenDatabase(anonymous_user);
+}
+
 }
 }
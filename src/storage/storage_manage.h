@@ -3,10 +3,15 @@
 
 #include <string>
 #include <map>
+#include <set>
+#include <vector>
 #include <boost/function.hpp>
 #include "common/mutex.h"
+#include "common/thread_pool.h"
 #include "leveldb/db.h"
+#include "leveldb/write_batch.h"
 #include "proto/ins_node.pb.h"
+#include "storage/durability.h"
 
 namespace galaxy {
 namespace ins {
@@ -22,6 +27,28 @@ public:
     Status Get(const std::string& name, const std::string& key, std::string* value);
     Status Put(const std::string& name, const std::string& key, const std::string& value);
     Status Delete(const std::string& name, const std::string& key);
+    // Force the writes since the last Sync to disk. In periodic and group
+    // durability modes Put and Delete leave that to the caller; the default
+    // database is synced last.
+    Status Sync();
+
+    // Writes to several databases, gathered to be written together
+    class Batch {
+    public:
+        void Put(const std::string& name, const std::string& key,
+                 const std::string& value);
+        void Delete(const std::string& name, const std::string& key);
+        bool Empty() const { return batches_.empty(); }
+        void Clear() { batches_.clear(); }
+    private:
+        friend class StorageManager;
+        std::map<std::string, leveldb::WriteBatch> batches_;
+    };
+    // Each database gets its part of the batch in one atomic write, the
+    // default database last. The user databases are independent and are
+    // written in parallel. Databases not opened yet are opened. The batch
+    // is cleared once written.
+    Status Write(Batch* batch);
 
     // All user field in proto set default value to anonymous_user, which is ""
     static const std::string anonymous_user;
@@ -52,10 +79,37 @@ public:
     };
 
     Iterator *NewIterator(const std::string& name);
+
+    // A pinned view of one database, see GetSnapshots
+    struct DatabaseSnapshot {
+        std::string name;
+        leveldb::DB* db;
+        const leveldb::Snapshot* snapshot;
+    };
+    // Pin the current state of every database in data_dir, the ones not
+    // opened yet included. Each view is read by NewIterator and has to be
+    // given back by ReleaseSnapshots.
+    void GetSnapshots(std::vector<DatabaseSnapshot>* snapshots);
+    Iterator *NewIterator(const DatabaseSnapshot& snapshot);
+    void ReleaseSnapshots(const std::vector<DatabaseSnapshot>& snapshots);
+    // Remove all databases and their files, the default one is recreated
+    bool ClearAllDatabases();
+private:
+    void ListDatabases(std::vector<std::string>* names);
+    Status WriteDatabase(const std::string& name, leveldb::WriteBatch* batch);
+    struct ParallelWrite;
+    void WriteDatabaseTask(const std::string& name, leveldb::WriteBatch* batch,
+                           ParallelWrite* state);
 private:
     Mutex mu_;
     std::string data_dir_;
     std::map<std::string, leveldb::DB*> dbs_;
+    DurabilityMode durability_;
+    leveldb::WriteOptions write_options_;
+    // databases written since the last Sync
+    std::set<std::string> dirty_dbs_;
+    // writes the user databases of a batch, NULL to write them one by one
+    ThreadPool* write_pool_;
 };
 
 }
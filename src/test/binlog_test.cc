@@ -2,10 +2,25 @@
 #include <boost/bind.hpp>
 #include <string>
 #include <stdlib.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include "common/thread_pool.h"
+#include "common/timer.h"
 #include "storage/binlog.h"
 
 using namespace galaxy::ins;
 
+static BinLogOptions TestOptions(int64_t segment_size, int64_t cache_entries) {
+    BinLogOptions options;
+    options.segment_size = segment_size;
+    options.cache_entries = cache_entries;
+    return options;
+}
+
 TEST(BinLogTest, LogEntryDumpLoad) {
     BinLogger bin_logger("/tmp/nexus_unittest/");
     LogEntry log_entry, log_entry2;
@@ -41,7 +56,7 @@ TEST(BinLogTest, SlotWriteTest) {
 }
 
 TEST(BinLogTest, SlotBatchWriteTest) {
-    BinLogger bin_logger("/tmp/nexus_unittest/", true);
+    BinLogger bin_logger("/tmp/nexus_unittest/");
     char key_buf[1024] = {'\0'};
     char value_buf[1024] = {'\0'};
     ::google::protobuf::RepeatedPtrField< ::galaxy::ins::Entry > entries;
@@ -84,6 +99,521 @@ TEST(BinLogTest, SlotTruncate) {
     EXPECT_EQ(bin_logger.GetLength(), 0);
 }
 
+TEST(BinLogTest, SegmentRollAndReload) {
+    const std::string dir = "/tmp/nexus_unittest/segment";
+    char key_buf[1024] = {'\0'};
+    {
+        BinLogger bin_logger(dir, TestOptions(1024, 10000));
+        for (int i = 0; i < 500; i++) {
+            LogEntry log_entry;
+            snprintf(key_buf, sizeof(key_buf), "key_%d", i);
+            log_entry.key = key_buf;
+            log_entry.term = i / 100;
+            log_entry.op = kPut;
+            bin_logger.AppendEntry(log_entry);
+        }
+        EXPECT_EQ(bin_logger.GetLength(), 500);
+    }
+    BinLogger bin_logger(dir, TestOptions(1024, 10000));
+    EXPECT_EQ(bin_logger.GetLength(), 500);
+    int64_t last_log_index = 0;
+    int64_t last_log_term = 0;
+    bin_logger.GetLastLogIndexAndTerm(&last_log_index, &last_log_term);
+    EXPECT_EQ(last_log_index, 499);
+    EXPECT_EQ(last_log_term, 4);
+    for (int i = 0; i < 500; i += 7) {
+        LogEntry log_entry;
+        EXPECT_TRUE(bin_logger.ReadSlot(i, &log_entry));
+        snprintf(key_buf, sizeof(key_buf), "key_%d", i);
+        EXPECT_EQ(log_entry.key, std::string(key_buf));
+    }
+    bin_logger.Truncate(250);
+    EXPECT_EQ(bin_logger.GetLength(), 251);
+    bin_logger.GetLastLogIndexAndTerm(&last_log_index, &last_log_term);
+    EXPECT_EQ(last_log_term, 2);
+    LogEntry log_entry;
+    EXPECT_FALSE(bin_logger.ReadSlot(251, &log_entry));
+    log_entry.key = "after_truncate";
+    log_entry.term = 5;
+    bin_logger.AppendEntry(log_entry);
+    EXPECT_TRUE(bin_logger.ReadSlot(251, &log_entry));
+    EXPECT_EQ(log_entry.key, "after_truncate");
+    bin_logger.RemoveSlotBefore(200);
+    EXPECT_FALSE(bin_logger.ReadSlot(0, &log_entry));
+    EXPECT_TRUE(bin_logger.ReadSlot(200, &log_entry));
+    EXPECT_EQ(bin_logger.GetLength(), 252);
+}
+
+TEST(BinLogTest, ResetAfterSnapshot) {
+    const std::string dir = "/tmp/nexus_unittest/reset";
+    {
+        BinLogger bin_logger(dir, TestOptions(1024, 10000));
+        for (int i = 0; i < 100; i++) {
+            LogEntry log_entry;
+            log_entry.key = "key";
+            log_entry.term = 1;
+            bin_logger.AppendEntry(log_entry);
+        }
+        EXPECT_EQ(bin_logger.GetFirstIndex(), 0);
+        bin_logger.Reset(1000, 7);
+        EXPECT_EQ(bin_logger.GetLength(), 1000);
+        EXPECT_EQ(bin_logger.GetFirstIndex(), 1000);
+        int64_t last_log_index = 0;
+        int64_t last_log_term = 0;
+        bin_logger.GetLastLogIndexAndTerm(&last_log_index, &last_log_term);
+        EXPECT_EQ(last_log_index, 999);
+        EXPECT_EQ(last_log_term, 7);
+        LogEntry log_entry;
+        EXPECT_FALSE(bin_logger.ReadSlot(50, &log_entry));
+    }
+    // the start index survives a restart, the next append goes to slot 1000
+    BinLogger bin_logger(dir, TestOptions(1024, 10000));
+    EXPECT_EQ(bin_logger.GetLength(), 1000);
+    EXPECT_EQ(bin_logger.GetFirstIndex(), 1000);
+    LogEntry log_entry;
+    log_entry.key = "after_reset";
+    log_entry.term = 8;
+    bin_logger.AppendEntry(log_entry);
+    EXPECT_TRUE(bin_logger.ReadSlot(1000, &log_entry));
+    EXPECT_EQ(log_entry.key, "after_reset");
+    EXPECT_EQ(bin_logger.GetLength(), 1001);
+}
+
+TEST(BinLogTest, DropTornTail) {
+    const std::string dir = "/tmp/nexus_unittest/torn";
+    {
+        BinLogger bin_logger(dir);
+        for (int i = 0; i < 10; i++) {
+            LogEntry log_entry;
+            log_entry.key = "key";
+            log_entry.term = 1;
+            bin_logger.AppendEntry(log_entry);
+        }
+    }
+    DIR* seg_dir = opendir((dir + "/#segments").c_str());
+    ASSERT_TRUE(seg_dir != NULL);
+    struct dirent* ent = NULL;
+    std::string seg_name;
+    while ((ent = readdir(seg_dir)) != NULL) {
+        if (ent->d_name[0] != '.') {
+            seg_name = dir + "/#segments/" + ent->d_name;
+        }
+    }
+    closedir(seg_dir);
+    FILE* fp = fopen(seg_name.c_str(), "a");
+    ASSERT_TRUE(fp != NULL);
+    fprintf(fp, "%c%c", 100, 0);
+    fclose(fp);
+    BinLogger bin_logger(dir);
+    EXPECT_EQ(bin_logger.GetLength(), 10);
+}
+
+TEST(BinLogTest, TailCache) {
+    std::string dir = "/tmp/nexus_unittest/cache";
+    BinLogger bin_logger(dir, TestOptions(64L << 20, 100));
+    char key_buf[64] = {'\0'};
+    for (int i = 0; i < 300; i++) {
+        snprintf(key_buf, sizeof(key_buf), "key_%d", i);
+        LogEntry log_entry;
+        log_entry.key = key_buf;
+        log_entry.term = 1;
+        bin_logger.AppendEntry(log_entry);
+    }
+    int64_t hits = 0;
+    int64_t misses = 0;
+    bin_logger.GetCacheStat(&hits, &misses);
+    for (int i = 200; i < 300; i++) {
+        LogEntry log_entry;
+        EXPECT_TRUE(bin_logger.ReadSlot(i, &log_entry));
+        snprintf(key_buf, sizeof(key_buf), "key_%d", i);
+        EXPECT_EQ(log_entry.key, key_buf);
+    }
+    for (int i = 0; i < 10; i++) {
+        LogEntry log_entry;
+        EXPECT_TRUE(bin_logger.ReadSlot(i, &log_entry));
+        snprintf(key_buf, sizeof(key_buf), "key_%d", i);
+        EXPECT_EQ(log_entry.key, key_buf);
+    }
+    int64_t hits2 = 0;
+    int64_t misses2 = 0;
+    bin_logger.GetCacheStat(&hits2, &misses2);
+    EXPECT_EQ(hits2 - hits, 100);
+    EXPECT_EQ(misses2 - misses, 10);
+    bin_logger.Truncate(249);
+    LogEntry log_entry;
+    log_entry.key = "new_key";
+    log_entry.term = 2;
+    bin_logger.AppendEntry(log_entry);
+    LogEntry log_entry2;
+    EXPECT_TRUE(bin_logger.ReadSlot(250, &log_entry2));
+    EXPECT_EQ(log_entry2.key, "new_key");
+    EXPECT_EQ(log_entry2.term, 2);
+    EXPECT_FALSE(bin_logger.ReadSlot(251, &log_entry2));
+}
+
+TEST(BinLogTest, ReadRange) {
+    std::string dir = "/tmp/nexus_unittest/range";
+    BinLogger bin_logger(dir, TestOptions(1024, 10));
+    char key_buf[64] = {'\0'};
+    for (int i = 0; i < 300; i++) {
+        snprintf(key_buf, sizeof(key_buf), "key_%d", i);
+        LogEntry log_entry;
+        log_entry.key = key_buf;
+        log_entry.value = "value";
+        log_entry.term = i;
+        log_entry.op = kPut;
+        bin_logger.AppendEntry(log_entry);
+    }
+    ::google::protobuf::RepeatedPtrField< ::galaxy::ins::Entry > entries;
+    EXPECT_TRUE(bin_logger.ReadRange(5, 1000, 1 << 20, &entries));
+    ASSERT_EQ(entries.size(), 295);
+    for (int i = 0; i < entries.size(); i++) {
+        snprintf(key_buf, sizeof(key_buf), "key_%d", i + 5);
+        EXPECT_EQ(entries.Get(i).key(), key_buf);
+        EXPECT_EQ(entries.Get(i).value(), "value");
+        EXPECT_EQ(entries.Get(i).term(), i + 5);
+        EXPECT_EQ(entries.Get(i).op(), kPut);
+    }
+    entries.Clear();
+    EXPECT_TRUE(bin_logger.ReadRange(100, 50, 1, &entries));
+    EXPECT_EQ(entries.size(), 1);
+    entries.Clear();
+    EXPECT_TRUE(bin_logger.ReadRange(100, 50, 200, &entries));
+    EXPECT_GT(entries.size(), 1);
+    EXPECT_LT(entries.size(), 50);
+    entries.Clear();
+    EXPECT_TRUE(bin_logger.ReadRange(300, 50, 1 << 20, &entries));
+    EXPECT_EQ(entries.size(), 0);
+    bin_logger.RemoveSlotBefore(100);
+    entries.Clear();
+    EXPECT_FALSE(bin_logger.ReadRange(0, 50, 1 << 20, &entries));
+}
+
+TEST(BinLogTest, PackedEntries) {
+    BinLogger leader_log("/tmp/nexus_unittest/packed_leader");
+    BinLogger follower_log("/tmp/nexus_unittest/packed_follower");
+    std::string big_value(100000, 'v');
+    for (int i = 0; i < 20; i++) {
+        LogEntry log_entry;
+        log_entry.key = "key";
+        log_entry.value = (i % 2 == 0) ? big_value : "";
+        log_entry.user = "user";
+        log_entry.term = i / 5;
+        log_entry.op = (i == 7) ? kMembership : kPut;
+        leader_log.AppendEntry(log_entry);
+    }
+    ::google::protobuf::RepeatedPtrField<std::string> packed;
+    int64_t last_term = -1;
+    EXPECT_TRUE(leader_log.ReadRange(0, 20, 1 << 20, &packed, &last_term));
+    EXPECT_EQ(packed.size(), 20);
+    EXPECT_EQ(last_term, 3);
+    for (int i = 0; i < packed.size(); i++) {
+        ::galaxy::ins::Entry entry;
+        EXPECT_TRUE(entry.ParseFromString(packed.Get(i)));
+        EXPECT_EQ(entry.term(), i / 5);
+        EXPECT_EQ(BinLogger::EntryOp(packed.Get(i)), entry.op());
+    }
+    follower_log.AppendEntryList(packed);
+    int64_t last_index = 0;
+    follower_log.GetLastLogIndexAndTerm(&last_index, &last_term);
+    EXPECT_EQ(last_index, 19);
+    EXPECT_EQ(last_term, 3);
+    for (int i = 0; i < 20; i++) {
+        LogEntry log_entry;
+        EXPECT_TRUE(follower_log.ReadSlot(i, &log_entry));
+        EXPECT_EQ(log_entry.key, "key");
+        EXPECT_EQ(log_entry.value, (i % 2 == 0) ? big_value : "");
+        EXPECT_EQ(log_entry.user, "user");
+        EXPECT_EQ(log_entry.term, i / 5);
+        EXPECT_EQ(log_entry.op, (i == 7) ? kMembership : kPut);
+    }
+}
+
+TEST(BinLogTest, OldRecordLayout) {
+    std::string dir = "/tmp/nexus_unittest/old_layout";
+    std::string seg_dir = dir + "/#segments";
+    ASSERT_EQ(system(("mkdir -p '" + seg_dir + "'").c_str()), 0);
+    FILE* fp = fopen((seg_dir + "/00000000000000000000.log").c_str(), "w");
+    ASSERT_TRUE(fp != NULL);
+    for (int i = 0; i < 10; i++) {
+        LogEntry log_entry;
+        log_entry.key = "key";
+        log_entry.value = "value";
+        log_entry.term = i;
+        log_entry.op = kDel;
+        std::string payload;
+        BinLogger::DumpLogEntry(log_entry, &payload);
+        uint32_t payload_size = payload.size();
+        fwrite(&payload_size, sizeof(payload_size), 1, fp);
+        fwrite(payload.data(), payload.size(), 1, fp);
+    }
+    fclose(fp);
+    BinLogger bin_logger(dir);
+    EXPECT_EQ(bin_logger.GetLength(), 10);
+    LogEntry log_entry;
+    log_entry.key = "new_key";
+    log_entry.term = 10;
+    bin_logger.AppendEntry(log_entry);
+    ::google::protobuf::RepeatedPtrField< ::galaxy::ins::Entry > entries;
+    EXPECT_TRUE(bin_logger.ReadRange(0, 11, 1 << 20, &entries));
+    ASSERT_EQ(entries.size(), 11);
+    for (int i = 0; i < 10; i++) {
+        EXPECT_EQ(entries.Get(i).key(), "key");
+        EXPECT_EQ(entries.Get(i).value(), "value");
+        EXPECT_EQ(entries.Get(i).term(), i);
+        EXPECT_EQ(entries.Get(i).op(), kDel);
+    }
+    EXPECT_EQ(entries.Get(10).key(), "new_key");
+}
+
+static std::string LastSegmentFile(const std::string& dir) {
+    DIR* seg_dir = opendir((dir + "/#segments").c_str());
+    std::string seg_name;
+    if (seg_dir == NULL) {
+        return seg_name;
+    }
+    struct dirent* ent = NULL;
+    while ((ent = readdir(seg_dir)) != NULL) {
+        std::string name = ent->d_name;
+        if (name[0] != '.' && dir + "/#segments/" + name > seg_name) {
+            seg_name = dir + "/#segments/" + name;
+        }
+    }
+    closedir(seg_dir);
+    return seg_name;
+}
+
+TEST(BinLogTest, ChecksumMismatch) {
+    std::string dir = "/tmp/nexus_unittest/checksum";
+    {
+        BinLogger bin_logger(dir);
+        for (int i = 0; i < 20; i++) {
+            LogEntry log_entry;
+            log_entry.key = "key";
+            log_entry.value = "value";
+            log_entry.term = 1;
+            bin_logger.AppendEntry(log_entry);
+        }
+    }
+    // flip one bit of the last value, the file size stays the same
+    std::string seg_name = LastSegmentFile(dir);
+    FILE* fp = fopen(seg_name.c_str(), "r+");
+    ASSERT_TRUE(fp != NULL);
+    ASSERT_EQ(fseek(fp, -1, SEEK_END), 0);
+    int c = fgetc(fp);
+    ASSERT_EQ(fseek(fp, -1, SEEK_END), 0);
+    fputc(c ^ 1, fp);
+    fclose(fp);
+    BinLogger bin_logger(dir);
+    EXPECT_EQ(bin_logger.GetLength(), 19);
+    LogEntry log_entry;
+    EXPECT_TRUE(bin_logger.ReadSlot(18, &log_entry));
+    EXPECT_EQ(log_entry.value, "value");
+}
+
+// damage in front of good records is not a torn write
+TEST(BinLogTest, ChecksumMismatchBeforeGoodRecords) {
+    std::string dir = "/tmp/nexus_unittest/checksum_middle";
+    {
+        BinLogger bin_logger(dir);
+        for (int i = 0; i < 20; i++) {
+            LogEntry log_entry;
+            log_entry.key = "key";
+            log_entry.value = "value";
+            log_entry.term = 1;
+            bin_logger.AppendEntry(log_entry);
+        }
+    }
+    // records are of the same size, flip one bit of the 10th value
+    std::string seg_name = LastSegmentFile(dir);
+    struct stat st;
+    ASSERT_EQ(stat(seg_name.c_str(), &st), 0);
+    FILE* fp = fopen(seg_name.c_str(), "r+");
+    ASSERT_TRUE(fp != NULL);
+    long offset = st.st_size / 20 * 10 - 1;
+    ASSERT_EQ(fseek(fp, offset, SEEK_SET), 0);
+    int c = fgetc(fp);
+    ASSERT_EQ(fseek(fp, offset, SEEK_SET), 0);
+    fputc(c ^ 1, fp);
+    fclose(fp);
+    ::testing::FLAGS_gtest_death_test_style = "threadsafe";
+    EXPECT_DEATH(BinLogger bin_logger(dir), "");
+}
+
+static void GroupCommitWriter(BinLogger* bin_logger, int writer_id,
+                              int count, int* ok) {
+    char key_buf[64] = {'\0'};
+    for (int i = 0; i < count; i++) {
+        snprintf(key_buf, sizeof(key_buf), "w%d_%d", writer_id, i);
+        LogEntry log_entry;
+        log_entry.key = key_buf;
+        log_entry.term = 1;
+        int64_t slot_index = bin_logger->AppendEntryAsync(log_entry);
+        bin_logger->Sync(slot_index);
+        LogEntry log_entry2;
+        if (!bin_logger->ReadSlot(slot_index, &log_entry2)
+            || log_entry2.key != log_entry.key) {
+            *ok = 0;
+        }
+    }
+}
+
+TEST(BinLogTest, GroupCommit) {
+    std::string dir = "/tmp/nexus_unittest/group";
+    const int writers = 8;
+    const int count = 200;
+    // one result per writer, they are written concurrently
+    std::vector<int> ok(writers, 1);
+    {
+        BinLogger bin_logger(dir, TestOptions(4096, 10000));
+        ThreadPool pool(writers);
+        for (int i = 0; i < writers; i++) {
+            pool.AddTask(boost::bind(&GroupCommitWriter, &bin_logger,
+                                     i, count, &ok[i]));
+        }
+        pool.Stop(true);
+        EXPECT_EQ(std::count(ok.begin(), ok.end(), 1), writers);
+        EXPECT_EQ(bin_logger.GetLength(), writers * count);
+    }
+    BinLogger bin_logger(dir, TestOptions(4096, 10000));
+    EXPECT_EQ(bin_logger.GetLength(), writers * count);
+    std::set<std::string> keys;
+    for (int64_t i = 0; i < writers * count; i++) {
+        LogEntry log_entry;
+        ASSERT_TRUE(bin_logger.ReadSlot(i, &log_entry));
+        keys.insert(log_entry.key);
+    }
+    EXPECT_EQ(keys.size(), static_cast<size_t>(writers * count));
+}
+
+TEST(BinLogTest, ReadUnwritten) {
+    BinLogger bin_logger("/tmp/nexus_unittest/unwritten", TestOptions(1024, 10));
+    LogEntry log_entry;
+    log_entry.term = 1;
+    log_entry.op = kPut;
+    log_entry.key = "written";
+    bin_logger.AppendEntry(log_entry);
+    char key_buf[64] = {'\0'};
+    int64_t last_index = -1;
+    for (int i = 0; i < 20; i++) {
+        snprintf(key_buf, sizeof(key_buf), "queued_%d", i);
+        log_entry.key = key_buf;
+        last_index = bin_logger.AppendEntryAsync(log_entry);
+    }
+    // queued slots are readable before they are written
+    EXPECT_EQ(bin_logger.GetLength(), 1);
+    EXPECT_EQ(bin_logger.GetAppendedLength(), 21);
+    LogEntry log_entry2;
+    ASSERT_TRUE(bin_logger.ReadSlot(5, &log_entry2));
+    EXPECT_EQ(log_entry2.key, "queued_4");
+    ::google::protobuf::RepeatedPtrField< ::galaxy::ins::Entry > entries;
+    EXPECT_TRUE(bin_logger.ReadRange(0, 100, 1 << 20, &entries));
+    ASSERT_EQ(entries.size(), 21);
+    EXPECT_EQ(entries.Get(0).key(), "written");
+    EXPECT_EQ(entries.Get(20).key(), "queued_19");
+    bin_logger.Sync(last_index);
+    EXPECT_EQ(bin_logger.GetLength(), 21);
+    EXPECT_EQ(bin_logger.GetAppendedLength(), 21);
+    ASSERT_TRUE(bin_logger.ReadSlot(20, &log_entry2));
+    EXPECT_EQ(log_entry2.key, "queued_19");
+}
+
+// Concurrent appends under each durability mode are all readable after
+// a restart
+TEST(BinLogTest, DurabilityModes) {
+    const char* names[] = {"none", "periodic", "group", "sync"};
+    const int writers = 8;
+    const int count = 100;
+    for (int mode = kDurabilityNone; mode <= kDurabilitySync; mode++) {
+        std::string dir = std::string("/tmp/nexus_unittest/durability_")
+                          + names[mode];
+        ASSERT_EQ(system(("rm -rf '" + dir + "'").c_str()), 0);
+        BinLogOptions options = TestOptions(4096, 10000);
+        options.durability = static_cast<DurabilityMode>(mode);
+        std::vector<int> ok(writers, 1);
+        {
+            BinLogger bin_logger(dir, options);
+            ThreadPool pool(writers);
+            for (int i = 0; i < writers; i++) {
+                pool.AddTask(boost::bind(&GroupCommitWriter, &bin_logger,
+                                         i, count, &ok[i]));
+            }
+            pool.Stop(true);
+            bin_logger.Fsync();
+            EXPECT_EQ(std::count(ok.begin(), ok.end(), 1), writers);
+            EXPECT_EQ(bin_logger.GetLength(), writers * count);
+        }
+        BinLogger bin_logger(dir, options);
+        EXPECT_EQ(bin_logger.GetLength(), writers * count);
+        int64_t last_log_index = -1;
+        int64_t last_log_term = -1;
+        bin_logger.GetLastLogIndexAndTerm(&last_log_index, &last_log_term);
+        EXPECT_EQ(last_log_term, 1);
+    }
+}
+
+static int64_t SegmentDirSize(const std::string& dir) {
+    std::string seg_dir = dir + "/#segments";
+    DIR* d = opendir(seg_dir.c_str());
+    int64_t size = 0;
+    if (d == NULL) {
+        return size;
+    }
+    struct dirent* ent = NULL;
+    while ((ent = readdir(d)) != NULL) {
+        struct stat st;
+        std::string name = seg_dir + "/" + ent->d_name;
+        if (stat(name.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+            size += st.st_size;
+        }
+    }
+    closedir(d);
+    return size;
+}
+
+TEST(BinLogTest, ReclaimRemovedSegments) {
+    std::string dir = "/tmp/nexus_unittest/reclaim";
+    ASSERT_EQ(system(("rm -rf '" + dir + "'").c_str()), 0);
+    BinLogOptions options = TestOptions(4096, 10);
+    options.reclaim_rate = 200 * 1024;
+    BinLogger bin_logger(dir, options);
+    LogEntry log_entry;
+    log_entry.value = std::string(200, 'v');
+    log_entry.term = 1;
+    for (int i = 0; i < 500; i++) {
+        bin_logger.AppendEntry(log_entry);
+    }
+    int64_t total_size = SegmentDirSize(dir);
+    bin_logger.RemoveSlotBefore(450);
+    bin_logger.Truncate(479);
+    // the files are gone at once, their space comes back in the background
+    int64_t live_size = SegmentDirSize(dir);
+    EXPECT_LT(live_size, total_size);
+    int64_t removed_size = total_size - live_size;
+    // a step frees one segment of about 4KB, then waits about 20ms at 200KB/s,
+    // so the reclaimed bytes are seen to grow in several steps
+    std::set<int64_t> partial;
+    int64_t start = ins_common::timer::get_micros();
+    int64_t reclaimed = 0;
+    int64_t pending = 1;
+    while (pending > 0 && ins_common::timer::get_micros() - start < 10000000) {
+        usleep(1000);
+        bin_logger.GetReclaimStat(&reclaimed, &pending);
+        EXPECT_EQ(reclaimed + pending, removed_size);
+        if (reclaimed > 0 && pending > 0) {
+            partial.insert(reclaimed);
+        }
+    }
+    EXPECT_EQ(pending, 0);
+    EXPECT_EQ(reclaimed, removed_size);
+    EXPECT_GT(partial.size(), 1u);
+    LogEntry log_entry2;
+    EXPECT_FALSE(bin_logger.ReadSlot(400, &log_entry2));
+    EXPECT_TRUE(bin_logger.ReadSlot(470, &log_entry2));
+    EXPECT_EQ(log_entry2.value, log_entry.value);
+    EXPECT_EQ(bin_logger.GetLength(), 480);
+}
+
 int main(int argc, char* argv[]) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
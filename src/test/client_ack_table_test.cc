@@ -0,0 +1,84 @@
+#include <gtest/gtest.h>
+#include <vector>
+#include <boost/bind.hpp>
+#include "server/client_ack_table.h"
+#include "common/thread_pool.h"
+
+using namespace galaxy::ins;
+
+TEST(ClientAckTableTest, AddTake) {
+    ClientAckTable table;
+    ClientAck ack;
+    for (int64_t i = 0; i < 100; i++) {
+        ack.term = i;
+        table.Add(i, ack);
+    }
+    EXPECT_EQ(table.Size(), 100);
+    EXPECT_TRUE(table.Take(42, &ack));
+    EXPECT_EQ(ack.term, 42);
+    EXPECT_FALSE(table.Take(42, &ack));
+    EXPECT_FALSE(table.Take(100, &ack));
+    EXPECT_EQ(table.Size(), 99);
+}
+
+TEST(ClientAckTableTest, TakeRange) {
+    ClientAckTable table;
+    ClientAck ack;
+    for (int64_t i = 10; i < 100; i += 3) {
+        ack.term = i;
+        table.Add(i, ack);
+    }
+    std::vector<std::pair<int64_t, ClientAck> > acks;
+    table.TakeRange(20, 60, &acks);
+    ASSERT_EQ(acks.size(), 13u);
+    for (size_t i = 0; i < acks.size(); i++) {
+        EXPECT_EQ(acks[i].first, 22 + 3 * static_cast<int64_t>(i));
+        EXPECT_EQ(acks[i].second.term, acks[i].first);
+    }
+    EXPECT_EQ(table.Size(), 17);
+    table.TakeRange(20, 60, &acks);
+    EXPECT_TRUE(acks.empty());
+    table.TakeRange(100, 200, &acks);
+    EXPECT_TRUE(acks.empty());
+    EXPECT_TRUE(table.Take(19, &ack));
+}
+
+// Like the rpc threads and the apply loop: every writer adds its own
+// indexes and takes them back
+static void AckWorker(ClientAckTable* table, int64_t worker, int64_t workers,
+                      int64_t count, int* ok) {
+    ClientAck ack;
+    for (int64_t i = 0; i < count; i++) {
+        int64_t index = i * workers + worker;
+        ack.term = index;
+        table->Add(index, ack);
+        if (!table->Take(index, &ack) || ack.term != index) {
+            *ok = 0;
+        }
+    }
+}
+
+TEST(ClientAckTableTest, Contention) {
+    const int64_t workers = 16;
+    const int64_t count = 2000;
+    ClientAckTable table(4);
+    // one result per worker, they are written concurrently
+    std::vector<int> ok(workers, 1);
+    {
+        ThreadPool pool(workers);
+        for (int64_t i = 0; i < workers; i++) {
+            pool.AddTask(boost::bind(&AckWorker, &table, i, workers, count,
+                                     &ok[i]));
+        }
+        pool.Stop(true);
+    }
+    for (int64_t i = 0; i < workers; i++) {
+        EXPECT_EQ(ok[i], 1);
+    }
+    EXPECT_EQ(table.Size(), 0);
+}
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
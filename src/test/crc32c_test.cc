@@ -0,0 +1,60 @@
+#include <gtest/gtest.h>
+#include <string.h>
+#include <string>
+#include "common/crc32c.h"
+
+using namespace ins_common;
+
+TEST(CRC32CTest, StandardResults) {
+    // from rfc3720 section B.4
+    char buf[32];
+    memset(buf, 0, sizeof(buf));
+    EXPECT_EQ(0x8a9136aaU, crc32c::Value(buf, sizeof(buf)));
+    EXPECT_EQ(0x8a9136aaU, crc32c::ExtendPortable(0, buf, sizeof(buf)));
+    memset(buf, 0xff, sizeof(buf));
+    EXPECT_EQ(0x62a8ab43U, crc32c::Value(buf, sizeof(buf)));
+    EXPECT_EQ(0x62a8ab43U, crc32c::ExtendPortable(0, buf, sizeof(buf)));
+    for (int i = 0; i < 32; i++) {
+        buf[i] = i;
+    }
+    EXPECT_EQ(0x46dd794eU, crc32c::Value(buf, sizeof(buf)));
+    EXPECT_EQ(0x46dd794eU, crc32c::ExtendPortable(0, buf, sizeof(buf)));
+    EXPECT_EQ(0xe3069283U, crc32c::Value("123456789", 9));
+    EXPECT_EQ(0xe3069283U, crc32c::ExtendPortable(0, "123456789", 9));
+}
+
+TEST(CRC32CTest, HardwareMatchesTable) {
+    std::string data;
+    for (int i = 0; i < 4096; i++) {
+        data.push_back(static_cast<char>((i * 131) ^ (i >> 3)));
+    }
+    // every alignment and a mix of short and long tails
+    for (size_t start = 0; start < 16; start++) {
+        for (size_t n = 0; n < 100; n++) {
+            EXPECT_EQ(crc32c::ExtendPortable(0, data.data() + start, n),
+                      crc32c::Value(data.data() + start, n));
+        }
+        size_t n = data.size() - start;
+        EXPECT_EQ(crc32c::ExtendPortable(0, data.data() + start, n),
+                  crc32c::Value(data.data() + start, n));
+    }
+}
+
+TEST(CRC32CTest, Extend) {
+    EXPECT_EQ(crc32c::Value("hello world", 11),
+              crc32c::Extend(crc32c::Value("hello ", 6), "world", 5));
+    EXPECT_NE(crc32c::Value("a", 1), crc32c::Value("foo", 3));
+}
+
+TEST(CRC32CTest, Mask) {
+    uint32_t crc = crc32c::Value("foo", 3);
+    EXPECT_NE(crc, crc32c::Mask(crc));
+    EXPECT_NE(crc, crc32c::Mask(crc32c::Mask(crc)));
+    EXPECT_EQ(crc, crc32c::Unmask(crc32c::Mask(crc)));
+    EXPECT_EQ(crc, crc32c::Unmask(crc32c::Unmask(crc32c::Mask(crc32c::Mask(crc)))));
+}
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,108 @@
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <map>
+#include <string>
+#include "storage/meta.h"
+
+using namespace galaxy::ins;
+
+static const std::string kMetaDir = "/tmp/nexus_unittest/meta";
+
+static void ResetDir(const std::string& dir) {
+    ASSERT_EQ(system(("rm -rf '" + dir + "'").c_str()), 0);
+}
+
+TEST(MetaTest, TermAndVote) {
+    std::string dir = kMetaDir + "/term_vote";
+    ResetDir(dir);
+    {
+        Meta meta(dir);
+        EXPECT_EQ(meta.ReadCurrentTerm(), 0);
+        std::map<int64_t, std::string> voted_for;
+        meta.ReadVotedFor(voted_for);
+        EXPECT_TRUE(voted_for.empty());
+        for (int64_t term = 1; term <= 1000; term++) {
+            meta.WriteCurrentTerm(term);
+        }
+        meta.WriteVotedFor(1000, "host1:8868");
+    }
+    {
+        Meta meta(dir);
+        EXPECT_EQ(meta.ReadCurrentTerm(), 1000);
+        std::map<int64_t, std::string> voted_for;
+        meta.ReadVotedFor(voted_for);
+        ASSERT_EQ(voted_for.size(), 1u);
+        EXPECT_EQ(voted_for[1000], "host1:8868");
+        // a new term drops the vote of the old one
+        meta.WriteCurrentTerm(1001);
+    }
+    Meta meta(dir);
+    EXPECT_EQ(meta.ReadCurrentTerm(), 1001);
+    std::map<int64_t, std::string> voted_for;
+    meta.ReadVotedFor(voted_for);
+    EXPECT_TRUE(voted_for.empty());
+    // the file does not grow with the number of terms
+    struct stat st;
+    ASSERT_EQ(stat((dir + "/state.data").c_str(), &st), 0);
+    EXPECT_LE(st.st_size, 1024);
+}
+
+TEST(MetaTest, TornWrite) {
+    std::string dir = kMetaDir + "/torn";
+    ResetDir(dir);
+    {
+        Meta meta(dir);
+        meta.WriteCurrentTerm(5);
+        meta.WriteVotedFor(5, "host2:8868");
+        meta.WriteCurrentTerm(6);
+    }
+    // break the slot holding the latest write
+    int fd = open((dir + "/state.data").c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    char c = 0;
+    ASSERT_EQ(pread(fd, &c, 1, 512 + 20), 1);
+    c ^= 1;
+    ASSERT_EQ(pwrite(fd, &c, 1, 512 + 20), 1);
+    close(fd);
+    Meta meta(dir);
+    EXPECT_EQ(meta.ReadCurrentTerm(), 5);
+    std::map<int64_t, std::string> voted_for;
+    meta.ReadVotedFor(voted_for);
+    EXPECT_EQ(voted_for[5], "host2:8868");
+}
+
+TEST(MetaTest, ImportLegacyFiles) {
+    std::string dir = kMetaDir + "/legacy";
+    ResetDir(dir);
+    ASSERT_EQ(system(("mkdir -p '" + dir + "'").c_str()), 0);
+    FILE* fp = fopen((dir + "/term.data").c_str(), "w");
+    ASSERT_TRUE(fp != NULL);
+    for (int term = 1; term <= 7; term++) {
+        fprintf(fp, "%d\n", term);
+    }
+    fclose(fp);
+    fp = fopen((dir + "/vote.data").c_str(), "w");
+    ASSERT_TRUE(fp != NULL);
+    fprintf(fp, "3 host1:8868\n7 host3:8868\n");
+    fclose(fp);
+    {
+        Meta meta(dir);
+        EXPECT_EQ(meta.ReadCurrentTerm(), 7);
+        std::map<int64_t, std::string> voted_for;
+        meta.ReadVotedFor(voted_for);
+        EXPECT_EQ(voted_for[7], "host3:8868");
+    }
+    EXPECT_NE(access((dir + "/term.data").c_str(), F_OK), 0);
+    EXPECT_NE(access((dir + "/vote.data").c_str(), F_OK), 0);
+    Meta meta(dir);
+    EXPECT_EQ(meta.ReadCurrentTerm(), 7);
+}
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,105 @@
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <string>
+#include "storage/snapshot.h"
+#include "storage/utils.h"
+#include "proto/ins_node.pb.h"
+
+using namespace galaxy::ins;
+
+static const std::string kSnapshotDir = "/tmp/nexus_unittest/snapshot";
+
+static void WriteSnapshot(const std::string& file_name, int count) {
+    SnapshotMeta meta;
+    meta.set_last_included_index(count - 1);
+    meta.set_last_included_term(3);
+    SnapshotWriter writer(file_name);
+    ASSERT_TRUE(writer.Open(meta));
+    for (int i = 0; i < count; i++) {
+        SnapshotItem item;
+        item.set_type(kSnapshotData);
+        item.set_name("user1");
+        item.set_key("key" + std::string(1, 'a' + i % 26));
+        item.set_value(std::string(i, 'v'));
+        ASSERT_TRUE(writer.Add(item));
+    }
+    ASSERT_TRUE(writer.Close());
+}
+
+TEST(SnapshotTest, WriteRead) {
+    ins_common::Mkdirs(kSnapshotDir.c_str());
+    std::string file_name = kSnapshotDir + "/write_read.data";
+    WriteSnapshot(file_name, 1000);
+    SnapshotReader reader(file_name);
+    SnapshotMeta meta;
+    ASSERT_TRUE(reader.Open(&meta));
+    EXPECT_EQ(meta.last_included_index(), 999);
+    EXPECT_EQ(meta.last_included_term(), 3);
+    SnapshotItem item;
+    int count = 0;
+    while (reader.Next(&item)) {
+        EXPECT_EQ(item.type(), kSnapshotData);
+        EXPECT_EQ(item.name(), "user1");
+        EXPECT_EQ(item.value(), std::string(count, 'v'));
+        count++;
+    }
+    EXPECT_FALSE(reader.error());
+    EXPECT_EQ(count, 1000);
+    EXPECT_TRUE(SnapshotReader::Verify(file_name, &meta));
+}
+
+TEST(SnapshotTest, ReadChunk) {
+    ins_common::Mkdirs(kSnapshotDir.c_str());
+    std::string file_name = kSnapshotDir + "/chunk.data";
+    std::string copy_name = kSnapshotDir + "/chunk_copy.data";
+    WriteSnapshot(file_name, 3000);
+    SnapshotReader reader(file_name);
+    SnapshotMeta meta;
+    ASSERT_TRUE(reader.Open(&meta));
+    // copy the file in chunks as it is shipped to followers
+    FILE* fp = fopen(copy_name.c_str(), "w");
+    ASSERT_TRUE(fp != NULL);
+    int64_t offset = 0;
+    while (offset < reader.file_size()) {
+        std::string data;
+        int64_t size = std::min(static_cast<int64_t>(4096),
+                                reader.file_size() - offset);
+        ASSERT_TRUE(reader.ReadChunk(offset, size, &data));
+        fwrite(data.data(), 1, data.size(), fp);
+        offset += size;
+    }
+    fclose(fp);
+    std::string data;
+    EXPECT_FALSE(reader.ReadChunk(offset, 1, &data));
+    SnapshotMeta copy_meta;
+    EXPECT_TRUE(SnapshotReader::Verify(copy_name, &copy_meta));
+    EXPECT_EQ(copy_meta.last_included_index(), 2999);
+}
+
+TEST(SnapshotTest, Corrupted) {
+    ins_common::Mkdirs(kSnapshotDir.c_str());
+    std::string file_name = kSnapshotDir + "/corrupted.data";
+    WriteSnapshot(file_name, 100);
+    FILE* fp = fopen(file_name.c_str(), "r+");
+    ASSERT_TRUE(fp != NULL);
+    ASSERT_EQ(fseek(fp, -1, SEEK_END), 0);
+    int c = fgetc(fp);
+    ASSERT_EQ(fseek(fp, -1, SEEK_END), 0);
+    fputc(c ^ 1, fp);
+    fclose(fp);
+    SnapshotMeta meta;
+    EXPECT_FALSE(SnapshotReader::Verify(file_name, &meta));
+    // a cut off file is broken as well
+    WriteSnapshot(file_name, 100);
+    fp = fopen(file_name.c_str(), "r+");
+    ASSERT_TRUE(fp != NULL);
+    ASSERT_EQ(fseek(fp, 0, SEEK_END), 0);
+    ASSERT_EQ(ftruncate(fileno(fp), ftell(fp) - 3), 0);
+    fclose(fp);
+    EXPECT_FALSE(SnapshotReader::Verify(file_name, &meta));
+}
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
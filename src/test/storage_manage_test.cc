@@ -1,6 +1,8 @@
 #include <gtest/gtest.h>
+#include <stdio.h>
 #include <string>
 #include <set>
+#include <vector>
 #include <boost/lexical_cast.hpp>
 #include "storage/storage_manage.h"
 #include "proto/ins_node.pb.h"
@@ -112,6 +114,85 @@ TEST(StorageManageTest, IteratorTest) {
     storage_manager.CloseDatabase("user1");
 }
 
+TEST(StorageManageTest, SnapshotTest) {
+    StorageManager storage_manager("/tmp/nexus_unittest/storage_test4");
+    EXPECT_TRUE(storage_manager.OpenDatabase("user1"));
+    EXPECT_EQ(storage_manager.Put("", "key", "old"), kOk);
+    EXPECT_EQ(storage_manager.Put("user1", "key", "old"), kOk);
+    storage_manager.CloseDatabase("user1");
+    // databases closed or not opened yet are pinned as well
+    std::vector<StorageManager::DatabaseSnapshot> snapshots;
+    storage_manager.GetSnapshots(&snapshots);
+    EXPECT_EQ(snapshots.size(), 2u);
+    EXPECT_EQ(storage_manager.Put("", "key", "new"), kOk);
+    EXPECT_EQ(storage_manager.Put("user1", "key", "new"), kOk);
+    for (size_t i = 0; i < snapshots.size(); i++) {
+        StorageManager::Iterator* it = storage_manager.NewIterator(snapshots[i]);
+        int count = 0;
+        for (it->Seek(""); it->Valid(); it->Next()) {
+            EXPECT_EQ(it->key(), "key");
+            EXPECT_EQ(it->value(), "old");
+            count++;
+        }
+        EXPECT_EQ(count, 1);
+        delete it;
+    }
+    storage_manager.ReleaseSnapshots(snapshots);
+    EXPECT_TRUE(storage_manager.ClearAllDatabases());
+    std::string value;
+    EXPECT_EQ(storage_manager.Get("", "key", &value), kNotFound);
+    EXPECT_EQ(storage_manager.Get("user1", "key", &value), kUnknownUser);
+    EXPECT_TRUE(storage_manager.OpenDatabase("user1"));
+    EXPECT_EQ(storage_manager.Get("user1", "key", &value), kNotFound);
+}
+
+TEST(StorageManageTest, BatchWriteTest) {
+    StorageManager storage_manager("/tmp/nexus_unittest/storage_test5");
+    EXPECT_EQ(storage_manager.Put("", "gone", "value"), kOk);
+    StorageManager::Batch batch;
+    EXPECT_TRUE(batch.Empty());
+    batch.Put("", "key", "value");
+    batch.Delete("", "gone");
+    // not opened yet, the write opens it
+    batch.Put("user1", "key", "value1");
+    batch.Put("user1", "key", "value2");
+    EXPECT_FALSE(batch.Empty());
+    EXPECT_EQ(storage_manager.Write(&batch), kOk);
+    EXPECT_TRUE(batch.Empty());
+    std::string value;
+    EXPECT_EQ(storage_manager.Get("", "key", &value), kOk);
+    EXPECT_EQ(value, "value");
+    EXPECT_EQ(storage_manager.Get("", "gone", &value), kNotFound);
+    EXPECT_EQ(storage_manager.Get("user1", "key", &value), kOk);
+    EXPECT_EQ(value, "value2");
+    EXPECT_TRUE(storage_manager.ClearAllDatabases());
+}
+
+TEST(StorageManageTest, ParallelBatchWriteTest) {
+    StorageManager storage_manager("/tmp/nexus_unittest/storage_test6");
+    StorageManager::Batch batch;
+    for (int i = 0; i < 8; i++) {
+        char user[16];
+        snprintf(user, sizeof(user), "user%d", i);
+        for (int j = 0; j < 100; j++) {
+            char key[16];
+            snprintf(key, sizeof(key), "key%d", j);
+            batch.Put(user, key, user);
+        }
+    }
+    batch.Put("", "tag", "done");
+    EXPECT_EQ(storage_manager.Write(&batch), kOk);
+    std::string value;
+    for (int i = 0; i < 8; i++) {
+        char user[16];
+        snprintf(user, sizeof(user), "user%d", i);
+        EXPECT_EQ(storage_manager.Get(user, "key99", &value), kOk);
+        EXPECT_EQ(value, user);
+    }
+    EXPECT_EQ(storage_manager.Get("", "tag", &value), kOk);
+    EXPECT_TRUE(storage_manager.ClearAllDatabases());
+}
+
 int main(int argc, char *argv[]) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
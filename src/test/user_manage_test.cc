@@ -1,5 +1,7 @@
 #include <gtest/gtest.h>
+#include <map>
 #include <string>
+#include <vector>
 #include "server/user_manage.h"
 #include "proto/ins_node.pb.h"
 
@@ -169,6 +171,31 @@ TEST(UserManageTest, ToolFunctionTest) {
     EXPECT_TRUE(!user_manager.IsValidUser("user3"));
 }
 
+TEST(UserManageTest, DumpRestoreTest) {
+    UserInfo root;
+    root.set_username("root");
+    root.set_passwd("rootpassword");
+    std::vector<UserInfo> users;
+    std::map<std::string, std::string> logged_users;
+    std::string uuid1 = UserManager::CalcUuid("user1");
+    {
+        UserManager user_manager("/tmp/nexus_unittest/user_test4", root);
+        EXPECT_EQ(user_manager.Register("user1", "123456"), kOk);
+        EXPECT_EQ(user_manager.Login("user1", "123456", uuid1), kOk);
+        user_manager.DumpUsers(&users, &logged_users);
+    }
+    EXPECT_EQ(users.size(), 2u);
+    EXPECT_EQ(logged_users.size(), 1u);
+    EXPECT_EQ(logged_users[uuid1], "user1");
+    UserManager user_manager("/tmp/nexus_unittest/user_test5", root);
+    EXPECT_EQ(user_manager.Register("user2", "123456"), kOk);
+    EXPECT_EQ(user_manager.RestoreUsers(users, logged_users), kOk);
+    EXPECT_TRUE(user_manager.IsValidUser("user1"));
+    EXPECT_TRUE(!user_manager.IsValidUser("user2"));
+    EXPECT_TRUE(user_manager.IsLoggedIn(uuid1));
+    EXPECT_EQ(user_manager.GetUsernameFromUuid(uuid1), "user1");
+}
+
 int main(int argc, char *argv[]) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();